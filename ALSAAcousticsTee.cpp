@@ -0,0 +1,135 @@
+/* ALSAAcousticsTee.cpp
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_TAG "AudioHardwareALSA"
+#include <utils/Log.h>
+
+#include <cutils/atomic.h>
+
+#include "AudioHardwareALSA.h"
+
+namespace android
+{
+
+// How long the consumer sleeps before looking at the ring again when it
+// missed a wakeup; the output path never waits for the consumer.
+static const nsecs_t TEE_POLL_NS = 20000000;
+
+// ----------------------------------------------------------------------------
+
+ALSAAcousticsTee::ALSAAcousticsTee(acoustic_device_t *dev,
+        size_t frameSize, size_t bufferSize) :
+    Thread(false),
+    mDevice(dev),
+    mRing(bufferSize),
+    mFrameSize(frameSize),
+    mPosition(0),
+    mDropped(0),
+    mScratch(0),
+    mScratchSize(0),
+    mSleeping(0)
+{
+}
+
+ALSAAcousticsTee::~ALSAAcousticsTee()
+{
+    free(mScratch);
+}
+
+void ALSAAcousticsTee::publish(const void *buffer, size_t bytes)
+{
+    block_t block;
+
+    block.bytes = bytes;
+    block.position = mPosition;
+    clock_gettime(CLOCK_MONOTONIC, &block.timestamp);
+
+    mPosition += bytes / mFrameSize;
+
+    if (!mRing.isValid() || mRing.space() < sizeof(block) + bytes) {
+        mDropped++;
+        return;
+    }
+
+    // The consumer waits for the payload once it has seen the header, so
+    // publishing them one after the other is safe.
+    mRing.write(&block, sizeof(block));
+    mRing.write(buffer, bytes);
+
+    if (android_atomic_acquire_load(&mSleeping)) {
+        AutoMutex lock(mLock);
+        mCond.signal();
+    }
+}
+
+void ALSAAcousticsTee::stop()
+{
+    requestExit();
+    {
+        AutoMutex lock(mLock);
+        mCond.signal();
+    }
+    requestExitAndWait();
+}
+
+bool ALSAAcousticsTee::waitFor(size_t bytes)
+{
+    while (mRing.available() < bytes) {
+        if (exitPending()) return false;
+
+        AutoMutex lock(mLock);
+        android_atomic_release_store(1, &mSleeping);
+        if (mRing.available() < bytes)
+            mCond.waitRelative(mLock, TEE_POLL_NS);
+        android_atomic_release_store(0, &mSleeping);
+    }
+
+    return true;
+}
+
+bool ALSAAcousticsTee::threadLoop()
+{
+    block_t block;
+
+    if (!waitFor(sizeof(block))) return false;
+    mRing.read(&block, sizeof(block));
+
+    if (block.bytes > mScratchSize) {
+        char *scratch = (char *)realloc(mScratch, block.bytes);
+        if (!scratch) {
+            LOGE("Unable to allocate %u bytes of acoustics reference", block.bytes);
+            return false;
+        }
+        mScratch = scratch;
+        mScratchSize = block.bytes;
+    }
+
+    if (!waitFor(block.bytes)) return false;
+    mRing.read(mScratch, block.bytes);
+
+    if (mDevice->write_reference)
+        mDevice->write_reference(mDevice, mScratch, block.bytes,
+                block.position, &block.timestamp);
+    else if (mDevice->write)
+        mDevice->write(mDevice, mScratch, block.bytes);
+
+    return true;
+}
+
+}       // namespace android
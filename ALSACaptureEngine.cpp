@@ -0,0 +1,327 @@
+/* ALSACaptureEngine.cpp
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LOG_TAG "AudioHardwareALSA"
+#include <utils/Log.h>
+#include <cutils/atomic.h>
+
+#include "AudioHardwareALSA.h"
+
+namespace android
+{
+
+// Periods of captured frames each lane keeps for clients to catch up on.
+static const size_t LANE_PERIODS = 8;
+
+// ----------------------------------------------------------------------------
+
+ALSACaptureEngine::ALSACaptureEngine(AudioHardwareALSA *parent,
+        alsa_handle_t *handle, AudioSystem::audio_in_acoustics acoustics) :
+    Thread(false),
+    mDevice(new AudioStreamInALSA(parent, handle, acoustics)),
+    mHandle(handle),
+    mCapture(0),
+    mStandby(false),
+    mExiting(false),
+    mWritePos(0)
+{
+    // The device stream reads the PCM as is, synchronously; the lanes
+    // convert for the clients.
+    delete mDevice->mRing;
+    mDevice->mRing = 0;
+    mDevice->mFormat = handle->format;
+
+    snd_pcm_uframes_t bufferSize = handle->bufferSize;
+    snd_pcm_uframes_t periodSize = bufferSize / 4;
+
+    if (handle->handle)
+        snd_pcm_get_params(handle->handle, &bufferSize, &periodSize);
+
+    mFrameSize = snd_pcm_format_physical_width(handle->format) / 8 * handle->channels;
+    mPeriodFrames = periodSize;
+    mRingFrames = LANE_PERIODS * periodSize;
+    mPeriodNs = (nsecs_t)periodSize * 1000000000LL / mDevice->deviceRate();
+
+    mCapture = (char *)malloc(mPeriodFrames * mFrameSize);
+
+    LOGD("Sharing the %s capture PCM, %u frame periods",
+            snd_pcm_name(handle->handle), (unsigned int)mPeriodFrames);
+
+    parent->mIdleMonitor->add(mDevice);
+}
+
+ALSACaptureEngine::~ALSACaptureEngine()
+{
+    mDevice->mParent->mIdleMonitor->remove(mDevice);
+    delete mDevice;
+
+    for (size_t i = 0; i < mClients.size(); i++)
+        delete mClients[i];
+
+    for (size_t i = 0; i < mLanes.size(); i++) {
+        free(mLanes[i]->buffer);
+        delete mLanes[i];
+    }
+
+    free(mCapture);
+}
+
+ALSACaptureEngine::client_t *ALSACaptureEngine::findClient(AudioStreamInALSA *stream)
+{
+    for (size_t i = 0; i < mClients.size(); i++)
+        if (mClients[i]->stream == stream) return mClients[i];
+
+    return 0;
+}
+
+status_t ALSACaptureEngine::addClient(AudioStreamInALSA *stream)
+{
+    AutoMutex lock(mLock);
+
+    // One conversion per distinct client format, rate and channel count.
+    // Lanes only convert the sample format: a client at another rate or
+    // channel count than the device has nothing to read from.
+    uint32_t rate = stream->mSampleRate;
+    unsigned int channels = stream->frameSize() /
+            (snd_pcm_format_physical_width(stream->mFormat) / 8);
+
+    if (rate != mDevice->deviceRate() || channels != mHandle->channels) {
+        LOGE("Unable to capture %u Hz, %u channels from a %u Hz, %u channel PCM",
+                rate, channels, mDevice->deviceRate(), mHandle->channels);
+        return BAD_VALUE;
+    }
+
+    lane_t *lane = 0;
+
+    for (size_t i = 0; i < mLanes.size(); i++)
+        if (mLanes[i]->format == stream->mFormat && mLanes[i]->rate == rate &&
+            mLanes[i]->channels == channels)
+            lane = mLanes[i];
+
+    if (!lane) {
+        lane = new lane_t;
+        lane->format = stream->mFormat;
+        lane->rate = rate;
+        lane->channels = channels;
+        lane->frameSize = stream->frameSize();
+        lane->clients = 0;
+        lane->buffer = (char *)malloc(mRingFrames * lane->frameSize);
+
+        if (!lane->buffer ||
+            lane->converter.configure(mHandle->format, lane->format,
+                    mHandle->channels) != NO_ERROR) {
+            LOGE("Unable to capture %s for a client",
+                    snd_pcm_format_name(lane->format));
+            free(lane->buffer);
+            delete lane;
+            return NO_MEMORY;
+        }
+
+        mLanes.add(lane);
+    }
+
+    client_t *client = new client_t;
+
+    client->stream = stream;
+    client->lane = lane;
+    client->cursor = mWritePos;
+    client->active = false;
+    lane->clients++;
+
+    mClients.add(client);
+
+    return NO_ERROR;
+}
+
+size_t ALSACaptureEngine::removeClient(AudioStreamInALSA *stream)
+{
+    AutoMutex lock(mLock);
+
+    for (size_t i = 0; i < mClients.size(); i++) {
+        client_t *client = mClients[i];
+        if (client->stream != stream) continue;
+
+        lane_t *lane = client->lane;
+
+        if (--lane->clients == 0) {
+            for (size_t j = 0; j < mLanes.size(); j++)
+                if (mLanes[j] == lane) {
+                    mLanes.removeAt(j);
+                    break;
+                }
+            free(lane->buffer);
+            delete lane;
+        }
+
+        mClients.removeAt(i);
+        delete client;
+        break;
+    }
+
+    mCond.broadcast();
+
+    return mClients.size();
+}
+
+void ALSACaptureEngine::standby(AudioStreamInALSA *stream)
+{
+    AutoMutex lock(mLock);
+
+    client_t *client = findClient(stream);
+    if (client) client->active = false;
+}
+
+ssize_t ALSACaptureEngine::read(AudioStreamInALSA *stream, void *buffer, size_t bytes)
+{
+    AutoMutex lock(mLock);
+
+    client_t *client = findClient(stream);
+    if (!client) return NO_INIT;
+
+    // A client coming out of standby starts with what is captured next.
+    if (!client->active) {
+        client->active = true;
+        client->cursor = mWritePos;
+        mCond.broadcast();
+    }
+
+    lane_t *lane = client->lane;
+    size_t frames = bytes / lane->frameSize;
+    size_t copied = 0;
+
+    // Wait for the whole request, like a blocking snd_pcm_readi() would,
+    // but give up on a device that stopped delivering altogether.
+    nsecs_t deadline = systemTime() + (nsecs_t)LANE_PERIODS * mPeriodNs;
+
+    while (copied < frames) {
+        uint64_t avail = mWritePos - client->cursor;
+
+        if (avail > mRingFrames) {
+            // Overwritten before this client got to it.
+            android_atomic_add((int32_t)(avail - mRingFrames), &stream->mFramesLost);
+            client->cursor = mWritePos - mRingFrames;
+            avail = mRingFrames;
+        }
+
+        if (!avail) {
+            if (mExiting || systemTime() >= deadline) break;
+            mCond.waitRelative(mLock, mPeriodNs);
+            continue;
+        }
+
+        size_t pos = client->cursor % mRingFrames;
+        size_t n = frames - copied;
+
+        if (n > avail) n = avail;
+        if (n > mRingFrames - pos) n = mRingFrames - pos;
+
+        memcpy((char *)buffer + copied * lane->frameSize,
+                lane->buffer + pos * lane->frameSize, n * lane->frameSize);
+
+        client->cursor += n;
+        copied += n;
+    }
+
+    return copied ? (ssize_t)(copied * lane->frameSize) : (ssize_t)TIMED_OUT;
+}
+
+void ALSACaptureEngine::stop()
+{
+    requestExit();
+    {
+        AutoMutex lock(mLock);
+        mExiting = true;
+        mCond.broadcast();
+    }
+    requestExitAndWait();
+}
+
+bool ALSACaptureEngine::threadLoop()
+{
+    {
+        AutoMutex lock(mLock);
+
+        if (!mCapture) return false;
+
+        bool active = false;
+
+        for (size_t i = 0; i < mClients.size(); i++)
+            if (mClients[i]->active) active = true;
+
+        // Nobody is recording. Stop the PCM until somebody is again.
+        if (!active) {
+            if (!mStandby) {
+                mDevice->standby();
+                mStandby = true;
+            }
+            if (!mExiting) mCond.wait(mLock);
+            return !exitPending();
+        }
+
+        mStandby = false;
+    }
+
+    // Blocks at the rate the device captures, which paces the engine.
+    ssize_t n = mDevice->read(mCapture, mPeriodFrames * mFrameSize);
+
+    if (n <= 0) {
+        // Recovered from an overrun, or the device is failing. Try again a
+        // period later rather than spin on it.
+        if (n < 0) usleep(mPeriodNs / 1000);
+        n = 0;
+    }
+
+    unsigned int lost = mDevice->getInputFramesLost();
+    size_t frames = n / mFrameSize;
+
+    AutoMutex lock(mLock);
+
+    // Convert once per lane, however many clients read it.
+    size_t pos = mWritePos % mRingFrames;
+    size_t first = frames < mRingFrames - pos ? frames : mRingFrames - pos;
+
+    for (size_t i = 0; frames && i < mLanes.size(); i++) {
+        lane_t *lane = mLanes[i];
+        char *dst = lane->buffer + pos * lane->frameSize;
+
+        if (lane->converter.isPassthrough()) {
+            memcpy(dst, mCapture, first * mFrameSize);
+            memcpy(lane->buffer, mCapture + first * mFrameSize,
+                    (frames - first) * mFrameSize);
+        } else {
+            lane->converter.convert(mCapture, dst, first);
+            lane->converter.convert(mCapture + first * mFrameSize,
+                    lane->buffer, frames - first);
+        }
+    }
+
+    mWritePos += frames;
+
+    // What the device lost, every recording client lost.
+    for (size_t i = 0; lost && i < mClients.size(); i++)
+        if (mClients[i]->active)
+            android_atomic_add((int32_t)lost, &mClients[i]->stream->mFramesLost);
+
+    mCond.broadcast();
+
+    return !exitPending();
+}
+
+}       // namespace android
@@ -0,0 +1,786 @@
+/* ALSAConverter.cpp
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#define LOG_TAG "AudioHardwareALSA"
+#include <utils/Log.h>
+
+#include "AudioHardwareALSA.h"
+
+// Define ALSA_CONVERTER_SCALAR to build only the reference kernels.
+#ifndef ALSA_CONVERTER_SCALAR
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CONVERTER_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CONVERTER_SSE
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#define CONVERTER_SSSE3
+#endif
+#endif
+#endif
+
+namespace android
+{
+
+// ----------------------------------------------------------------------------
+// Sample formats. Integer formats convert through a left aligned 32 bit
+// (Q31) intermediate, which is exact in both directions when widening and
+// truncates when narrowing. Anything involving float converts through float.
+// Left shifts go through uint32_t, negative samples would overflow otherwise.
+
+enum {
+    FMT_S8,
+    FMT_S16,
+    FMT_S24,        // 24 bits in the low bytes of 32
+    FMT_S24_3,      // packed 24 bits
+    FMT_S32,
+    FMT_FLOAT,
+    FMT_COUNT
+};
+
+static inline int32_t clampQ31(float f)
+{
+    if (f >= 1.0f) return 0x7fffffff;
+    if (f <= -1.0f) return (int32_t)0x80000000;
+    return (int32_t)(f * 2147483648.0f);
+}
+
+template <int F> struct Sample;
+
+template <> struct Sample<FMT_S8> {
+    enum { size = 1, isFloat = 0 };
+    static inline int32_t toQ31(const uint8_t *p) { return (int32_t)((uint32_t)*p << 24); }
+    static inline void fromQ31(uint8_t *p, int32_t q) { *(int8_t *)p = q >> 24; }
+    static inline float toFloat(const uint8_t *p) { return *(const int8_t *)p * (1.0f / 128); }
+    static inline void fromFloat(uint8_t *p, float f) { fromQ31(p, clampQ31(f)); }
+};
+
+template <> struct Sample<FMT_S16> {
+    enum { size = 2, isFloat = 0 };
+    static inline int32_t toQ31(const uint8_t *p) { return (int32_t)((uint32_t)*(const uint16_t *)p << 16); }
+    static inline void fromQ31(uint8_t *p, int32_t q) { *(int16_t *)p = q >> 16; }
+    static inline float toFloat(const uint8_t *p) { return *(const int16_t *)p * (1.0f / 32768); }
+    static inline void fromFloat(uint8_t *p, float f) {
+        f *= 32768.0f;
+        *(int16_t *)p = f >= 32767.0f ? 32767 : (f <= -32768.0f ? -32768 : (int16_t)f);
+    }
+};
+
+template <> struct Sample<FMT_S24> {
+    enum { size = 4, isFloat = 0 };
+    static inline int32_t toQ31(const uint8_t *p) { return (int32_t)(*(const uint32_t *)p << 8); }
+    static inline void fromQ31(uint8_t *p, int32_t q) { *(int32_t *)p = q >> 8; }
+    static inline float toFloat(const uint8_t *p) { return toQ31(p) * (1.0f / 2147483648.0f); }
+    static inline void fromFloat(uint8_t *p, float f) { fromQ31(p, clampQ31(f)); }
+};
+
+template <> struct Sample<FMT_S24_3> {
+    enum { size = 3, isFloat = 0 };
+    static inline int32_t toQ31(const uint8_t *p) {
+        return (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24);
+    }
+    static inline void fromQ31(uint8_t *p, int32_t q) { p[0] = q >> 8; p[1] = q >> 16; p[2] = q >> 24; }
+    static inline float toFloat(const uint8_t *p) { return toQ31(p) * (1.0f / 2147483648.0f); }
+    static inline void fromFloat(uint8_t *p, float f) { fromQ31(p, clampQ31(f)); }
+};
+
+template <> struct Sample<FMT_S32> {
+    enum { size = 4, isFloat = 0 };
+    static inline int32_t toQ31(const uint8_t *p) { return *(const int32_t *)p; }
+    static inline void fromQ31(uint8_t *p, int32_t q) { *(int32_t *)p = q; }
+    static inline float toFloat(const uint8_t *p) { return *(const int32_t *)p * (1.0f / 2147483648.0f); }
+    static inline void fromFloat(uint8_t *p, float f) { fromQ31(p, clampQ31(f)); }
+};
+
+template <> struct Sample<FMT_FLOAT> {
+    enum { size = 4, isFloat = 1 };
+    static inline int32_t toQ31(const uint8_t *p) { return clampQ31(*(const float *)p); }
+    static inline void fromQ31(uint8_t *p, int32_t q) { *(float *)p = q * (1.0f / 2147483648.0f); }
+    static inline float toFloat(const uint8_t *p) { return *(const float *)p; }
+    static inline void fromFloat(uint8_t *p, float f) { *(float *)p = f; }
+};
+
+// Reference conversion, also used for the tails of the vector kernels.
+template <int From, int To>
+static void convertScalar(const void *in, void *out, size_t samples)
+{
+    const uint8_t *src = (const uint8_t *)in;
+    uint8_t *dst = (uint8_t *)out;
+
+    for (size_t i = 0; i < samples; i++) {
+        if (Sample<From>::isFloat || Sample<To>::isFloat)
+            Sample<To>::fromFloat(dst, Sample<From>::toFloat(src));
+        else
+            Sample<To>::fromQ31(dst, Sample<From>::toQ31(src));
+
+        src += Sample<From>::size;
+        dst += Sample<To>::size;
+    }
+}
+
+#if defined(CONVERTER_NEON) || defined(CONVERTER_SSE)
+// ----------------------------------------------------------------------------
+// Vector kernels. Every pair of S16, S24, S24_3, S32 and float moves eight
+// samples at a time through two vectors of Q31 or float, built by the
+// loaders below and taken apart by the matching storers. Each step is the
+// lane-wise form of the Sample<> operation, so a kernel produces exactly what
+// convertScalar() does. S8 is left scalar, as is S24_3 on x86 without SSSE3.
+
+#ifdef CONVERTER_NEON
+typedef int32x4_t q31x4_t;
+typedef float32x4_t floatx4_t;
+
+static inline floatx4_t q31ToFloat(q31x4_t q) { return vcvtq_n_f32_s32(q, 31); }
+
+// Saturates and truncates like clampQ31().
+static inline q31x4_t floatToQ31(floatx4_t f) { return vcvtq_n_s32_f32(f, 31); }
+#else
+typedef __m128i q31x4_t;
+typedef __m128 floatx4_t;
+
+static inline floatx4_t q31ToFloat(q31x4_t q)
+{
+    return _mm_mul_ps(_mm_cvtepi32_ps(q), _mm_set1_ps(1.0f / 2147483648.0f));
+}
+
+// cvttps turns anything out of range into 0x80000000, which is only right
+// for the negative side; flipping every bit fixes up the positive one.
+static inline q31x4_t floatToQ31(floatx4_t f)
+{
+    __m128i q = _mm_cvttps_epi32(_mm_mul_ps(f, _mm_set1_ps(2147483648.0f)));
+    return _mm_xor_si128(q, _mm_castps_si128(_mm_cmpge_ps(f, _mm_set1_ps(1.0f))));
+}
+#endif
+
+struct q31x8_t {
+    q31x4_t lo, hi;
+};
+
+struct floatx8_t {
+    floatx4_t lo, hi;
+};
+
+template <int F> struct Lanes {
+    enum { supported = 0 };
+};
+
+template <> struct Lanes<FMT_S16> {
+    enum { supported = 1 };
+#ifdef CONVERTER_NEON
+    static inline q31x8_t load(const uint8_t *p) {
+        int16x8_t x = vld1q_s16((const int16_t *)p);
+        q31x8_t q = { vshll_n_s16(vget_low_s16(x), 16), vshll_n_s16(vget_high_s16(x), 16) };
+        return q;
+    }
+    static inline void store(uint8_t *p, q31x8_t q) {
+        vst1q_s16((int16_t *)p, vcombine_s16(vshrn_n_s32(q.lo, 16), vshrn_n_s32(q.hi, 16)));
+    }
+    static inline void storeFloat(uint8_t *p, floatx8_t f) {
+        vst1q_s16((int16_t *)p, vcombine_s16(vqmovn_s32(vcvtq_n_s32_f32(f.lo, 15)),
+                                             vqmovn_s32(vcvtq_n_s32_f32(f.hi, 15))));
+    }
+#else
+    static inline q31x8_t load(const uint8_t *p) {
+        __m128i x = _mm_loadu_si128((const __m128i *)p);
+        q31x8_t q = { _mm_unpacklo_epi16(_mm_setzero_si128(), x),
+                      _mm_unpackhi_epi16(_mm_setzero_si128(), x) };
+        return q;
+    }
+    static inline void store(uint8_t *p, q31x8_t q) {
+        _mm_storeu_si128((__m128i *)p, _mm_packs_epi32(_mm_srai_epi32(q.lo, 16),
+                                                       _mm_srai_epi32(q.hi, 16)));
+    }
+    static inline __m128i toS16(floatx4_t f) {
+        f = _mm_mul_ps(f, _mm_set1_ps(32768.0f));
+        f = _mm_max_ps(_mm_min_ps(f, _mm_set1_ps(32767.0f)), _mm_set1_ps(-32768.0f));
+        return _mm_cvttps_epi32(f);
+    }
+    static inline void storeFloat(uint8_t *p, floatx8_t f) {
+        _mm_storeu_si128((__m128i *)p, _mm_packs_epi32(toS16(f.lo), toS16(f.hi)));
+    }
+#endif
+};
+
+template <> struct Lanes<FMT_S24> {
+    enum { supported = 1 };
+#ifdef CONVERTER_NEON
+    static inline q31x8_t load(const uint8_t *p) {
+        q31x8_t q = { vshlq_n_s32(vld1q_s32((const int32_t *)p), 8),
+                      vshlq_n_s32(vld1q_s32((const int32_t *)p + 4), 8) };
+        return q;
+    }
+    static inline void store(uint8_t *p, q31x8_t q) {
+        vst1q_s32((int32_t *)p, vshrq_n_s32(q.lo, 8));
+        vst1q_s32((int32_t *)p + 4, vshrq_n_s32(q.hi, 8));
+    }
+#else
+    static inline q31x8_t load(const uint8_t *p) {
+        q31x8_t q = { _mm_slli_epi32(_mm_loadu_si128((const __m128i *)p), 8),
+                      _mm_slli_epi32(_mm_loadu_si128((const __m128i *)p + 1), 8) };
+        return q;
+    }
+    static inline void store(uint8_t *p, q31x8_t q) {
+        _mm_storeu_si128((__m128i *)p, _mm_srai_epi32(q.lo, 8));
+        _mm_storeu_si128((__m128i *)p + 1, _mm_srai_epi32(q.hi, 8));
+    }
+#endif
+};
+
+#if defined(CONVERTER_NEON) || defined(CONVERTER_SSSE3)
+template <> struct Lanes<FMT_S24_3> {
+    enum { supported = 1 };
+#ifdef CONVERTER_NEON
+    // Bytes 0-2 of each sample become bytes 1-3 of a Q31 lane.
+    static inline q31x8_t load(const uint8_t *p) {
+        uint8x8x3_t b = vld3_u8(p);
+        uint16x8_t low = vshll_n_u8(b.val[0], 8);
+        uint16x8_t high = vorrq_u16(vmovl_u8(b.val[1]), vshll_n_u8(b.val[2], 8));
+        uint16x8x2_t z = vzipq_u16(low, high);
+        q31x8_t q = { vreinterpretq_s32_u16(z.val[0]), vreinterpretq_s32_u16(z.val[1]) };
+        return q;
+    }
+    static inline void store(uint8_t *p, q31x8_t q) {
+        uint32x4_t lo = vreinterpretq_u32_s32(q.lo);
+        uint32x4_t hi = vreinterpretq_u32_s32(q.hi);
+        uint16x8_t mid = vcombine_u16(vshrn_n_u32(lo, 8), vshrn_n_u32(hi, 8));
+        uint16x8_t top = vcombine_u16(vshrn_n_u32(lo, 16), vshrn_n_u32(hi, 16));
+        uint8x8x3_t b;
+        b.val[0] = vmovn_u16(mid);
+        b.val[1] = vmovn_u16(top);
+        b.val[2] = vshrn_n_u16(top, 8);
+        vst3_u8(p, b);
+    }
+#else
+    // Eight samples are 24 bytes, read as bytes 0-15 and 8-23.
+    static inline q31x8_t load(const uint8_t *p) {
+        __m128i a = _mm_loadu_si128((const __m128i *)p);
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + 8));
+        q31x8_t q = {
+            _mm_shuffle_epi8(a, _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11)),
+            _mm_shuffle_epi8(b, _mm_setr_epi8(-1, 4, 5, 6, -1, 7, 8, 9, -1, 10, 11, 12, -1, 13, 14, 15)),
+        };
+        return q;
+    }
+    static inline void store(uint8_t *p, q31x8_t q) {
+        const __m128i pack = _mm_setr_epi8(1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1);
+        __m128i lo = _mm_shuffle_epi8(q.lo, pack);
+        __m128i hi = _mm_shuffle_epi8(q.hi, pack);
+        _mm_storeu_si128((__m128i *)p, _mm_or_si128(lo, _mm_slli_si128(hi, 12)));
+        _mm_storel_epi64((__m128i *)(p + 16), _mm_srli_si128(hi, 4));
+    }
+#endif
+};
+#endif
+
+template <> struct Lanes<FMT_S32> {
+    enum { supported = 1 };
+#ifdef CONVERTER_NEON
+    static inline q31x8_t load(const uint8_t *p) {
+        q31x8_t q = { vld1q_s32((const int32_t *)p), vld1q_s32((const int32_t *)p + 4) };
+        return q;
+    }
+    static inline void store(uint8_t *p, q31x8_t q) {
+        vst1q_s32((int32_t *)p, q.lo);
+        vst1q_s32((int32_t *)p + 4, q.hi);
+    }
+#else
+    static inline q31x8_t load(const uint8_t *p) {
+        q31x8_t q = { _mm_loadu_si128((const __m128i *)p), _mm_loadu_si128((const __m128i *)p + 1) };
+        return q;
+    }
+    static inline void store(uint8_t *p, q31x8_t q) {
+        _mm_storeu_si128((__m128i *)p, q.lo);
+        _mm_storeu_si128((__m128i *)p + 1, q.hi);
+    }
+#endif
+};
+
+template <> struct Lanes<FMT_FLOAT> {
+    enum { supported = 1 };
+#ifdef CONVERTER_NEON
+    static inline floatx8_t loadFloat(const uint8_t *p) {
+        floatx8_t f = { vld1q_f32((const float *)p), vld1q_f32((const float *)p + 4) };
+        return f;
+    }
+    static inline void storeFloat(uint8_t *p, floatx8_t f) {
+        vst1q_f32((float *)p, f.lo);
+        vst1q_f32((float *)p + 4, f.hi);
+    }
+#else
+    static inline floatx8_t loadFloat(const uint8_t *p) {
+        floatx8_t f = { _mm_loadu_ps((const float *)p), _mm_loadu_ps((const float *)p + 4) };
+        return f;
+    }
+    static inline void storeFloat(uint8_t *p, floatx8_t f) {
+        _mm_storeu_ps((float *)p, f.lo);
+        _mm_storeu_ps((float *)p + 4, f.hi);
+    }
+#endif
+};
+
+// Integer formats reach float through Q31, as Sample<>::toFloat() does,
+// and all but S16 come back through clampQ31().
+template <int F>
+static inline floatx8_t loadFloat(const uint8_t *p)
+{
+    q31x8_t q = Lanes<F>::load(p);
+    floatx8_t f = { q31ToFloat(q.lo), q31ToFloat(q.hi) };
+    return f;
+}
+
+template <>
+inline floatx8_t loadFloat<FMT_FLOAT>(const uint8_t *p)
+{
+    return Lanes<FMT_FLOAT>::loadFloat(p);
+}
+
+template <int F>
+static inline void storeFloat(uint8_t *p, floatx8_t f)
+{
+    q31x8_t q = { floatToQ31(f.lo), floatToQ31(f.hi) };
+    Lanes<F>::store(p, q);
+}
+
+template <>
+inline void storeFloat<FMT_S16>(uint8_t *p, floatx8_t f)
+{
+    Lanes<FMT_S16>::storeFloat(p, f);
+}
+
+template <>
+inline void storeFloat<FMT_FLOAT>(uint8_t *p, floatx8_t f)
+{
+    Lanes<FMT_FLOAT>::storeFloat(p, f);
+}
+
+template <int From, int To, bool Float = Sample<From>::isFloat || Sample<To>::isFloat>
+struct Step {
+    static inline void run(const uint8_t *src, uint8_t *dst) {
+        Lanes<To>::store(dst, Lanes<From>::load(src));
+    }
+};
+
+template <int From, int To>
+struct Step<From, To, true> {
+    static inline void run(const uint8_t *src, uint8_t *dst) {
+        storeFloat<To>(dst, loadFloat<From>(src));
+    }
+};
+
+template <int From, int To, bool Vectorized = Lanes<From>::supported && Lanes<To>::supported>
+struct Converter {
+    static void run(const void *in, void *out, size_t samples) {
+        convertScalar<From, To>(in, out, samples);
+    }
+};
+
+template <int From, int To>
+struct Converter<From, To, true> {
+    static void run(const void *in, void *out, size_t samples) {
+        const uint8_t *src = (const uint8_t *)in;
+        uint8_t *dst = (uint8_t *)out;
+        size_t i = 0;
+
+        for (; i + 8 <= samples; i += 8) {
+            Step<From, To>::run(src, dst);
+            src += 8 * Sample<From>::size;
+            dst += 8 * Sample<To>::size;
+        }
+        convertScalar<From, To>(src, dst, samples - i);
+    }
+};
+
+template <int From, int To>
+static void convert(const void *in, void *out, size_t samples)
+{
+    Converter<From, To>::run(in, out, samples);
+}
+#else
+template <int From, int To>
+static void convert(const void *in, void *out, size_t samples)
+{
+    convertScalar<From, To>(in, out, samples);
+}
+#endif
+
+// ----------------------------------------------------------------------------
+// Frame kernels. Same layout on both sides is a plain sample conversion; a
+// pure reorder moves samples without touching them; anything that sums
+// channels goes through the float gain matrix.
+
+typedef ALSAConverter::matrix_t matrix_t;
+
+template <int From, int To>
+static void convertFrames(const matrix_t &m, const void *in, void *out, size_t frames)
+{
+    convert<From, To>(in, out, frames * m.inChannels);
+}
+
+template <int From, int To>
+static void shuffleFrames(const matrix_t &m, const void *in, void *out, size_t frames)
+{
+    const uint8_t *src = (const uint8_t *)in;
+    uint8_t *dst = (uint8_t *)out;
+
+    for (size_t f = 0; f < frames; f++) {
+        for (unsigned int d = 0; d < m.outChannels; d++) {
+            uint8_t *o = dst + d * Sample<To>::size;
+            int s = m.map[d];
+
+            if (s < 0)
+                Sample<To>::fromFloat(o, 0.0f);
+            else if (Sample<From>::isFloat || Sample<To>::isFloat)
+                Sample<To>::fromFloat(o, Sample<From>::toFloat(src + s * Sample<From>::size));
+            else
+                Sample<To>::fromQ31(o, Sample<From>::toQ31(src + s * Sample<From>::size));
+        }
+
+        src += m.inChannels * Sample<From>::size;
+        dst += m.outChannels * Sample<To>::size;
+    }
+}
+
+// Out is the output channel count when it is known at compile time, which
+// lets the common downmixes to mono and stereo skip the unused outputs.
+template <int From, int To, unsigned int Out>
+static void remixFrames(const matrix_t &m, const void *in, void *out, size_t frames)
+{
+    const uint8_t *src = (const uint8_t *)in;
+    uint8_t *dst = (uint8_t *)out;
+    const unsigned int outChannels = Out ? Out : m.outChannels;
+    float acc[ALSAConverter::MAX_CHANNELS];
+
+    for (size_t f = 0; f < frames; f++) {
+        if (Out == 1) {
+            acc[0] = 0.0f;
+            for (unsigned int s = 0; s < m.inChannels; s++)
+                acc[0] += m.gain[s][0] * Sample<From>::toFloat(src + s * Sample<From>::size);
+        } else {
+#if defined(CONVERTER_NEON)
+            // Each input sample scales one matrix row into all outputs at once.
+            float32x4_t lo = vdupq_n_f32(0.0f);
+            float32x4_t hi = lo;
+
+            for (unsigned int s = 0; s < m.inChannels; s++) {
+                float x = Sample<From>::toFloat(src + s * Sample<From>::size);
+                lo = vmlaq_n_f32(lo, vld1q_f32(m.gain[s]), x);
+                if (outChannels > 4)
+                    hi = vmlaq_n_f32(hi, vld1q_f32(m.gain[s] + 4), x);
+            }
+
+            vst1q_f32(acc, lo);
+            if (outChannels > 4)
+                vst1q_f32(acc + 4, hi);
+#elif defined(CONVERTER_SSE)
+            __m128 lo = _mm_setzero_ps();
+            __m128 hi = lo;
+
+            for (unsigned int s = 0; s < m.inChannels; s++) {
+                __m128 x = _mm_set1_ps(Sample<From>::toFloat(src + s * Sample<From>::size));
+                lo = _mm_add_ps(lo, _mm_mul_ps(_mm_loadu_ps(m.gain[s]), x));
+                if (outChannels > 4)
+                    hi = _mm_add_ps(hi, _mm_mul_ps(_mm_loadu_ps(m.gain[s] + 4), x));
+            }
+
+            _mm_storeu_ps(acc, lo);
+            if (outChannels > 4)
+                _mm_storeu_ps(acc + 4, hi);
+#else
+            for (unsigned int d = 0; d < outChannels; d++)
+                acc[d] = 0.0f;
+
+            for (unsigned int s = 0; s < m.inChannels; s++) {
+                float x = Sample<From>::toFloat(src + s * Sample<From>::size);
+                for (unsigned int d = 0; d < outChannels; d++)
+                    acc[d] += m.gain[s][d] * x;
+            }
+#endif
+        }
+
+        for (unsigned int d = 0; d < outChannels; d++)
+            Sample<To>::fromFloat(dst + d * Sample<To>::size, acc[d]);
+
+        src += m.inChannels * Sample<From>::size;
+        dst += outChannels * Sample<To>::size;
+    }
+}
+
+template <int From, int To>
+static void remixAny(const matrix_t &m, const void *in, void *out, size_t frames)
+{
+    remixFrames<From, To, 0>(m, in, out, frames);
+}
+
+template <int From, int To>
+static void remixMono(const matrix_t &m, const void *in, void *out, size_t frames)
+{
+    remixFrames<From, To, 1>(m, in, out, frames);
+}
+
+template <int From, int To>
+static void remixStereo(const matrix_t &m, const void *in, void *out, size_t frames)
+{
+    remixFrames<From, To, 2>(m, in, out, frames);
+}
+
+typedef void (*kernel_t)(const matrix_t &, const void *, void *, size_t);
+
+#define KERNEL_ROW(kernel, from) \
+    { kernel<from, FMT_S8>, kernel<from, FMT_S16>, kernel<from, FMT_S24>, \
+      kernel<from, FMT_S24_3>, kernel<from, FMT_S32>, kernel<from, FMT_FLOAT> }
+
+#define KERNEL_TABLE(kernel) { \
+    KERNEL_ROW(kernel, FMT_S8), \
+    KERNEL_ROW(kernel, FMT_S16), \
+    KERNEL_ROW(kernel, FMT_S24), \
+    KERNEL_ROW(kernel, FMT_S24_3), \
+    KERNEL_ROW(kernel, FMT_S32), \
+    KERNEL_ROW(kernel, FMT_FLOAT), \
+}
+
+static const kernel_t convertTable[FMT_COUNT][FMT_COUNT] = KERNEL_TABLE(convertFrames);
+static const kernel_t shuffleTable[FMT_COUNT][FMT_COUNT] = KERNEL_TABLE(shuffleFrames);
+static const kernel_t remixTable[FMT_COUNT][FMT_COUNT] = KERNEL_TABLE(remixAny);
+static const kernel_t remixMonoTable[FMT_COUNT][FMT_COUNT] = KERNEL_TABLE(remixMono);
+static const kernel_t remixStereoTable[FMT_COUNT][FMT_COUNT] = KERNEL_TABLE(remixStereo);
+
+static int formatIndex(snd_pcm_format_t format)
+{
+    switch (format) {
+        case SND_PCM_FORMAT_S8:         return FMT_S8;
+        case SND_PCM_FORMAT_S16_LE:     return FMT_S16;
+        case SND_PCM_FORMAT_S24_LE:     return FMT_S24;
+        case SND_PCM_FORMAT_S24_3LE:    return FMT_S24_3;
+        case SND_PCM_FORMAT_S32_LE:     return FMT_S32;
+        case SND_PCM_FORMAT_FLOAT_LE:   return FMT_FLOAT;
+        default:                        return -1;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Downmix matrix. Channels the output has are copied, the rest fold into
+// their nearest neighbours at -3 dB, and outputs fed by more than one input
+// are scaled so the sum cannot clip. LFE is dropped when there is no LFE
+// output, as most downmix specifications do.
+
+static const float MINUS_3DB = 0.70710678f;
+
+static int findChannel(const uint32_t *layout, unsigned int channels, uint32_t channel)
+{
+    for (unsigned int i = 0; i < channels; i++)
+        if (layout[i] == channel) return i;
+
+    return -1;
+}
+
+static bool route(matrix_t &m, const uint32_t *to, unsigned int s,
+        uint32_t channel, float gain)
+{
+    int d = findChannel(to, m.outChannels, channel);
+    if (d < 0) return false;
+
+    m.gain[s][d] += gain;
+    return true;
+}
+
+static void buildMatrix(matrix_t &m, const uint32_t *from, const uint32_t *to)
+{
+    for (unsigned int s = 0; s < m.inChannels; s++) {
+        uint32_t c = from[s];
+
+        if (m.outChannels == 1) {
+            if (c != AudioSystem::CHANNEL_OUT_LOW_FREQUENCY || m.inChannels == 1)
+                m.gain[s][0] = 1.0f;
+            continue;
+        }
+
+        if (m.inChannels == 1) {
+            bool left = route(m, to, s, AudioSystem::CHANNEL_OUT_FRONT_LEFT, 1.0f);
+            bool right = route(m, to, s, AudioSystem::CHANNEL_OUT_FRONT_RIGHT, 1.0f);
+            if (!left && !right)
+                route(m, to, s, AudioSystem::CHANNEL_OUT_FRONT_CENTER, 1.0f);
+            continue;
+        }
+
+        if (c && route(m, to, s, c, 1.0f)) continue;
+
+        switch(c) {
+            case AudioSystem::CHANNEL_OUT_FRONT_CENTER:
+                route(m, to, s, AudioSystem::CHANNEL_OUT_FRONT_LEFT, MINUS_3DB);
+                route(m, to, s, AudioSystem::CHANNEL_OUT_FRONT_RIGHT, MINUS_3DB);
+                break;
+
+            case AudioSystem::CHANNEL_OUT_BACK_LEFT:
+                route(m, to, s, AudioSystem::CHANNEL_OUT_FRONT_LEFT, MINUS_3DB);
+                break;
+
+            case AudioSystem::CHANNEL_OUT_BACK_RIGHT:
+                route(m, to, s, AudioSystem::CHANNEL_OUT_FRONT_RIGHT, MINUS_3DB);
+                break;
+
+            case AudioSystem::CHANNEL_OUT_BACK_CENTER: {
+                bool left = route(m, to, s, AudioSystem::CHANNEL_OUT_BACK_LEFT, MINUS_3DB);
+                bool right = route(m, to, s, AudioSystem::CHANNEL_OUT_BACK_RIGHT, MINUS_3DB);
+                if (!left && !right) {
+                    route(m, to, s, AudioSystem::CHANNEL_OUT_FRONT_LEFT, 0.5f);
+                    route(m, to, s, AudioSystem::CHANNEL_OUT_FRONT_RIGHT, 0.5f);
+                }
+                break;
+            }
+
+            case AudioSystem::CHANNEL_OUT_FRONT_LEFT_OF_CENTER:
+                route(m, to, s, AudioSystem::CHANNEL_OUT_FRONT_LEFT, 1.0f);
+                break;
+
+            case AudioSystem::CHANNEL_OUT_FRONT_RIGHT_OF_CENTER:
+                route(m, to, s, AudioSystem::CHANNEL_OUT_FRONT_RIGHT, 1.0f);
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    for (unsigned int d = 0; d < m.outChannels; d++) {
+        float sum = 0.0f;
+
+        for (unsigned int s = 0; s < m.inChannels; s++)
+            sum += m.gain[s][d];
+
+        if (sum > 1.0f)
+            for (unsigned int s = 0; s < m.inChannels; s++)
+                m.gain[s][d] /= sum;
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+ALSAConverter::ALSAConverter() :
+    mFrom(SND_PCM_FORMAT_UNKNOWN),
+    mTo(SND_PCM_FORMAT_UNKNOWN),
+    mKernel(0)
+{
+    memset(mFromLayout, 0, sizeof(mFromLayout));
+    memset(mToLayout, 0, sizeof(mToLayout));
+    memset(&mMatrix, 0, sizeof(mMatrix));
+}
+
+bool ALSAConverter::isSupported(snd_pcm_format_t format)
+{
+    return formatIndex(format) >= 0;
+}
+
+status_t ALSAConverter::configure(snd_pcm_format_t from, snd_pcm_format_t to,
+        unsigned int channels)
+{
+    uint32_t layout[MAX_CHANNELS];
+
+    // Any distinct positions will do, they only have to match up.
+    for (unsigned int i = 0; i < MAX_CHANNELS; i++)
+        layout[i] = 1 << i;
+
+    return configure(from, to, layout, channels, layout, channels);
+}
+
+status_t ALSAConverter::configure(snd_pcm_format_t from, snd_pcm_format_t to,
+        const uint32_t *fromLayout, unsigned int fromChannels,
+        const uint32_t *toLayout, unsigned int toChannels)
+{
+    if (from == mFrom && to == mTo &&
+        fromChannels == mMatrix.inChannels && toChannels == mMatrix.outChannels &&
+        !memcmp(fromLayout, mFromLayout, fromChannels * sizeof(*fromLayout)) &&
+        !memcmp(toLayout, mToLayout, toChannels * sizeof(*toLayout)))
+        return NO_ERROR;
+
+    int src = formatIndex(from);
+    int dst = formatIndex(to);
+
+    if (src < 0 || dst < 0) {
+        LOGE("No conversion from %s to %s",
+                snd_pcm_format_name(from), snd_pcm_format_name(to));
+        return BAD_VALUE;
+    }
+
+    if (!fromChannels || fromChannels > MAX_CHANNELS ||
+        !toChannels || toChannels > MAX_CHANNELS) {
+        LOGE("No conversion from %u to %u channels", fromChannels, toChannels);
+        return BAD_VALUE;
+    }
+
+    matrix_t m;
+    memset(&m, 0, sizeof(m));
+    m.inChannels = fromChannels;
+    m.outChannels = toChannels;
+
+    buildMatrix(m, fromLayout, toLayout);
+
+    // A column with a single unit gain is a copy of that input.
+    bool shuffle = true;
+    bool identity = fromChannels == toChannels;
+
+    for (unsigned int d = 0; d < toChannels; d++) {
+        m.map[d] = -1;
+
+        for (unsigned int s = 0; s < fromChannels; s++) {
+            if (m.gain[s][d] == 0.0f) continue;
+
+            if (m.gain[s][d] != 1.0f || m.map[d] >= 0)
+                shuffle = false;
+            m.map[d] = s;
+        }
+
+        if (m.map[d] != (int)d) identity = false;
+    }
+
+    mFrom = from;
+    mTo = to;
+    mMatrix = m;
+    memcpy(mFromLayout, fromLayout, fromChannels * sizeof(*fromLayout));
+    memcpy(mToLayout, toLayout, toChannels * sizeof(*toLayout));
+
+    if (identity)
+        mKernel = from == to ? 0 : convertTable[src][dst];
+    else if (shuffle)
+        mKernel = shuffleTable[src][dst];
+    else if (toChannels == 1)
+        mKernel = remixMonoTable[src][dst];
+    else if (toChannels == 2)
+        mKernel = remixStereoTable[src][dst];
+    else
+        mKernel = remixTable[src][dst];
+
+    LOGV("Converting %s/%u to %s/%u with the %s kernel",
+            snd_pcm_format_name(from), fromChannels,
+            snd_pcm_format_name(to), toChannels,
+            identity ? "convert" : (shuffle ? "shuffle" : "remix"));
+
+    return NO_ERROR;
+}
+
+void ALSAConverter::convert(const void *in, void *out, size_t frames) const
+{
+    if (mKernel)
+        mKernel(mMatrix, in, out, frames);
+    else if (in != out)
+        memcpy(out, in, frames * mMatrix.inChannels *
+                (snd_pcm_format_physical_width(mFrom) / 8));
+}
+
+}       // namespace android
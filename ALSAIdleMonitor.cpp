@@ -0,0 +1,150 @@
+/* ALSAIdleMonitor.cpp
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <stdlib.h>
+
+#define LOG_TAG "AudioHardwareALSA"
+#include <utils/Log.h>
+
+#include <cutils/properties.h>
+
+#include "AudioHardwareALSA.h"
+
+namespace android
+{
+
+// ----------------------------------------------------------------------------
+
+ALSAIdleMonitor::ALSAIdleMonitor(alsa_device_t *device) :
+    Thread(false),
+    mDevice(device),
+    mIdleTime(0),
+    mHoldTime(0),
+    mPoolTime(0),
+    mScanning(false),
+    mPending(false)
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    // Streams that move no data for this long get their PCM closed; 0 keeps
+    // PCMs open until the stream is.
+    property_get("alsa.idle.close_ms", value, "5000");
+    mIdleTime = (nsecs_t)atoi(value) * 1000000;
+
+    // How long the wake lock outlives the last write or read. Bursts of
+    // short sounds then keep it instead of cycling it on every standby; 0
+    // lets standby release it right away.
+    property_get("alsa.idle.wakelock_ms", value, "1000");
+    mHoldTime = (nsecs_t)atoi(value) * 1000000;
+
+    // How long the module may keep a closed PCM open for a quick reopen; 0
+    // leaves it until the module needs the room.
+    property_get("alsa.idle.pool_ms", value, "2000");
+    mPoolTime = (nsecs_t)atoi(value) * 1000000;
+
+    if (mIdleTime && mIdleTime < mHoldTime) mIdleTime = mHoldTime;
+}
+
+ALSAIdleMonitor::~ALSAIdleMonitor()
+{
+}
+
+void ALSAIdleMonitor::add(ALSAStreamOps *stream)
+{
+    AutoMutex lock(mLock);
+
+    mStreams.add(stream);
+    mPending = true;
+    mCond.signal();
+}
+
+void ALSAIdleMonitor::remove(ALSAStreamOps *stream)
+{
+    AutoMutex lock(mLock);
+
+    for (size_t i = 0; i < mStreams.size(); i++)
+        if (mStreams[i] == stream) {
+            mStreams.removeAt(i);
+            break;
+        }
+
+    // The stream is about to go away; let a scan that may still hold it
+    // finish first.
+    while (mScanning)
+        mScanCond.wait(mLock);
+}
+
+void ALSAIdleMonitor::signal()
+{
+    AutoMutex lock(mLock);
+
+    mPending = true;
+    mCond.signal();
+}
+
+void ALSAIdleMonitor::stop()
+{
+    requestExit();
+    signal();
+    requestExitAndWait();
+}
+
+bool ALSAIdleMonitor::threadLoop()
+{
+    Vector<ALSAStreamOps *> streams;
+
+    {
+        AutoMutex lock(mLock);
+
+        streams = mStreams;
+        mScanning = true;
+        mPending = false;
+    }
+
+    // Stream locks are taken without ours held: streams call signal() with
+    // their own lock held.
+    nsecs_t now = systemTime();
+    nsecs_t next = 0;
+
+    for (size_t i = 0; i < streams.size(); i++) {
+        nsecs_t deadline = streams[i]->checkIdle(now, mIdleTime, mHoldTime);
+        if (deadline && (!next || deadline < next)) next = deadline;
+    }
+
+    // PCMs parked by the closes above and earlier ones expire too.
+    if (mPoolTime && mDevice && mDevice->trim) {
+        nsecs_t expiry = mDevice->trim(mPoolTime);
+        if (expiry && (!next || expiry < next)) next = expiry;
+    }
+
+    AutoMutex lock(mLock);
+
+    mScanning = false;
+    mScanCond.broadcast();
+
+    // Sleep until the next deadline. Once every stream is closed and lets
+    // go of its wake lock, and nothing is parked, there is none and only
+    // activity wakes us.
+    if (!mPending && !exitPending()) {
+        if (next)
+            mCond.waitRelative(mLock, next - now);
+        else
+            mCond.wait(mLock);
+    }
+
+    return !exitPending();
+}
+
+}       // namespace android
@@ -316,8 +316,21 @@ status_t ALSAMixer::setVolume(uint32_t device, float left, float right)
             if (vol > maxVol) vol = maxVol;
             if (vol < minVol) vol = minVol;
 
+            long volRight = minVol + right * (maxVol - minVol);
+            if (volRight > maxVol) volRight = maxVol;
+            if (volRight < minVol) volRight = minVol;
+
             info->volume = vol;
-            snd_mixer_selem_set_playback_volume_all (info->elem, vol);
+
+            if (snd_mixer_selem_is_playback_mono (info->elem) ||
+                snd_mixer_selem_has_playback_volume_joined (info->elem))
+                snd_mixer_selem_set_playback_volume_all (info->elem, vol);
+            else {
+                snd_mixer_selem_set_playback_volume (info->elem,
+                        SND_MIXER_SCHN_FRONT_LEFT, vol);
+                snd_mixer_selem_set_playback_volume (info->elem,
+                        SND_MIXER_SCHN_FRONT_RIGHT, volRight);
+            }
         }
 
     return NO_ERROR;
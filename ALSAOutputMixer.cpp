@@ -0,0 +1,465 @@
+/* ALSAOutputMixer.cpp
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_TAG "AudioHardwareALSA"
+#include <utils/Log.h>
+
+#include "AudioHardwareALSA.h"
+
+// Define ALSA_OUTPUT_MIXER_SCALAR to build only the reference kernels.
+#ifndef ALSA_OUTPUT_MIXER_SCALAR
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define MIXER_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define MIXER_SSE
+#endif
+#endif
+
+namespace android
+{
+
+// Same as AudioFlinger's output standby delay.
+static const nsecs_t MIXER_STANDBY_NS = 3000000000LL;
+
+// Periods of device frames each track may queue ahead of the mixer.
+static const size_t TRACK_PERIODS = 4;
+
+// Length of the fade a track's queued frames go out with on standby.
+static const unsigned int TRACK_FADE_MS = 5;
+
+// ----------------------------------------------------------------------------
+// Saturating accumulation of one track into the mix, in the device format.
+// The vector loops produce exactly what the scalar tails do.
+
+static void mixS16(int16_t *dst, const int16_t *src, size_t n)
+{
+    size_t i = 0;
+#if defined(MIXER_NEON)
+    for (; i + 8 <= n; i += 8)
+        vst1q_s16(dst + i, vqaddq_s16(vld1q_s16(dst + i), vld1q_s16(src + i)));
+#elif defined(MIXER_SSE)
+    for (; i + 8 <= n; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_adds_epi16(a, b));
+    }
+#endif
+    for (; i < n; i++) {
+        int32_t s = (int32_t)dst[i] + src[i];
+        dst[i] = s > 32767 ? 32767 : (s < -32768 ? -32768 : s);
+    }
+}
+
+static void mixS32(int32_t *dst, const int32_t *src, size_t n, int32_t max)
+{
+    size_t i = 0;
+#if defined(MIXER_NEON)
+    if (max == 0x7fffffff)
+        for (; i + 4 <= n; i += 4)
+            vst1q_s32(dst + i, vqaddq_s32(vld1q_s32(dst + i), vld1q_s32(src + i)));
+#endif
+    for (; i < n; i++) {
+        int64_t s = (int64_t)dst[i] + src[i];
+        dst[i] = s > max ? max : (s < -(int64_t)max - 1 ? -max - 1 : (int32_t)s);
+    }
+}
+
+static void mixFloat(float *dst, const float *src, size_t n)
+{
+    size_t i = 0;
+#if defined(MIXER_NEON)
+    for (; i + 4 <= n; i += 4)
+        vst1q_f32(dst + i, vaddq_f32(vld1q_f32(dst + i), vld1q_f32(src + i)));
+#elif defined(MIXER_SSE)
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_loadu_ps(src + i)));
+#endif
+    // Clipping is left to the float to fixed point conversion downstream.
+    for (; i < n; i++)
+        dst[i] += src[i];
+}
+
+static void mixS8(int8_t *dst, const int8_t *src, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        int32_t s = (int32_t)dst[i] + src[i];
+        dst[i] = s > 127 ? 127 : (s < -128 ? -128 : s);
+    }
+}
+
+static void mixS24_3(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    for (size_t i = 0; i < n; i++, dst += 3, src += 3) {
+        int32_t a = (int32_t)((uint32_t)dst[0] << 8 | (uint32_t)dst[1] << 16 |
+                              (uint32_t)dst[2] << 24) >> 8;
+        int32_t b = (int32_t)((uint32_t)src[0] << 8 | (uint32_t)src[1] << 16 |
+                              (uint32_t)src[2] << 24) >> 8;
+        int32_t s = a + b;
+        if (s > 0x7fffff) s = 0x7fffff;
+        if (s < -0x800000) s = -0x800000;
+        dst[0] = s;
+        dst[1] = s >> 8;
+        dst[2] = s >> 16;
+    }
+}
+
+static void mix(void *dst, const void *src, size_t samples, snd_pcm_format_t format)
+{
+    switch (format) {
+        case SND_PCM_FORMAT_S16_LE:
+            mixS16((int16_t *)dst, (const int16_t *)src, samples);
+            break;
+        case SND_PCM_FORMAT_S32_LE:
+            mixS32((int32_t *)dst, (const int32_t *)src, samples, 0x7fffffff);
+            break;
+        case SND_PCM_FORMAT_S24_LE:
+            mixS32((int32_t *)dst, (const int32_t *)src, samples, 0x7fffff);
+            break;
+        case SND_PCM_FORMAT_FLOAT_LE:
+            mixFloat((float *)dst, (const float *)src, samples);
+            break;
+        case SND_PCM_FORMAT_S8:
+            mixS8((int8_t *)dst, (const int8_t *)src, samples);
+            break;
+        case SND_PCM_FORMAT_S24_3LE:
+            mixS24_3((uint8_t *)dst, (const uint8_t *)src, samples);
+            break;
+        default:
+            break;
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+ALSAOutputMixer::ALSAOutputMixer(AudioHardwareALSA *parent, alsa_handle_t *handle) :
+    Thread(false),
+    mDevice(new AudioStreamOutALSA(parent, handle)),
+    mHandle(handle),
+    mIdleSince(0),
+    mShortSince(0),
+    mStandby(false),
+    mMix(0),
+    mScratch(0),
+    mDeviceFrames(0)
+{
+    // The device stream plays the mix as is: tracks have already been
+    // converted to the device format, layout and rate, and scaled. It
+    // writes synchronously; the mixer thread is its writer thread.
+    delete mDevice->mRing;
+    mDevice->mRing = 0;
+    mDevice->mRaw = true;
+    mDevice->mFormat = handle->format;
+    mDevice->mChannels = alsa_channel_mask(handle->channels);
+    mDevice->mSampleRate = mDevice->deviceRate();
+
+    snd_pcm_uframes_t bufferSize = handle->bufferSize;
+    snd_pcm_uframes_t periodSize = bufferSize / 4;
+
+    if (handle->handle)
+        snd_pcm_get_params(handle->handle, &bufferSize, &periodSize);
+
+    mFrameSize = snd_pcm_format_physical_width(handle->format) / 8 * handle->channels;
+    mPeriodFrames = periodSize;
+    mPeriodNs = (nsecs_t)periodSize * 1000000000LL / mDevice->deviceRate();
+    mFadeFrames = mDevice->deviceRate() * TRACK_FADE_MS / 1000;
+
+    mMix = (char *)malloc(mPeriodFrames * mFrameSize);
+    mScratch = (char *)malloc(mPeriodFrames * mFrameSize);
+
+    LOGD("Mixing output streams on the %s PCM, %u frame periods",
+            snd_pcm_name(handle->handle), (unsigned int)mPeriodFrames);
+
+    parent->mIdleMonitor->add(mDevice);
+}
+
+ALSAOutputMixer::~ALSAOutputMixer()
+{
+    mDevice->mParent->mIdleMonitor->remove(mDevice);
+    delete mDevice;
+    free(mMix);
+    free(mScratch);
+
+    for (size_t i = 0; i < mTracks.size(); i++)
+        free(mTracks[i].fade);
+}
+
+size_t ALSAOutputMixer::trackBufferSize() const
+{
+    return TRACK_PERIODS * mPeriodFrames * mFrameSize;
+}
+
+void ALSAOutputMixer::addTrack(AudioStreamOutALSA *track)
+{
+    AutoMutex lock(mLock);
+
+    track_t t;
+    t.stream = track;
+    t.active = false;
+    t.mixed = false;
+    t.frames = 0;
+    t.deviceEnd = 0;
+    t.fade = 0;
+    t.fadeFrames = 0;
+    t.fadePos = 0;
+
+    mTracks.add(t);
+    mCond.signal();
+}
+
+size_t ALSAOutputMixer::removeTrack(AudioStreamOutALSA *track)
+{
+    AutoMutex lock(mLock);
+
+    for (size_t i = 0; i < mTracks.size(); i++)
+        if (mTracks[i].stream == track) {
+            free(mTracks[i].fade);
+            mTracks.removeAt(i);
+            break;
+        }
+
+    return mTracks.size();
+}
+
+// Called with mLock held.
+ALSAOutputMixer::track_t *ALSAOutputMixer::findTrack(AudioStreamOutALSA *stream)
+{
+    for (size_t i = 0; i < mTracks.size(); i++)
+        if (mTracks[i].stream == stream)
+            return &mTracks.editItemAt(i);
+
+    return 0;
+}
+
+void ALSAOutputMixer::flush(AudioStreamOutALSA *track)
+{
+    AutoMutex lock(mLock);
+
+    track_t *t = findTrack(track);
+
+    // The first few ms of what the track still has queued go out ramped
+    // down, so that it stops without a click.
+    if (t && t->active && mFadeFrames) {
+        if (!t->fade)
+            t->fade = (char *)malloc(mFadeFrames * mFrameSize);
+
+        size_t frames = track->mRing->available() / mFrameSize;
+        if (frames > mFadeFrames) frames = mFadeFrames;
+
+        if (t->fade && frames) {
+            track->mRing->read(t->fade, frames * mFrameSize);
+            alsa_ramp_frames(t->fade, mHandle->format, mHandle->channels, frames, false);
+            t->fadeFrames = frames;
+            t->fadePos = 0;
+            mCond.signal();
+        }
+    }
+
+    track->mRing->flush();
+
+    // A track in standby is left out of the mix until it writes again.
+    if (t) {
+        t->active = false;
+        t->frames = 0;
+        t->deviceEnd = 0;
+    }
+}
+
+status_t ALSAOutputMixer::position(AudioStreamOutALSA *track, uint64_t *frames,
+        struct timespec *timestamp)
+{
+    uint64_t played;
+
+    status_t err = mDevice->getPresentationPosition(&played, timestamp);
+    if (err != NO_ERROR) return err;
+
+    AutoMutex lock(mLock);
+
+    track_t *t = findTrack(track);
+    if (!t) return NO_INIT;
+
+    // Whatever the device still holds past its position since the track's
+    // last frame went in came from the track.
+    uint64_t queued = t->deviceEnd > played ? t->deviceEnd - played : 0;
+    if (queued > t->frames) queued = t->frames;
+
+    *frames = t->frames - queued;
+    return NO_ERROR;
+}
+
+void ALSAOutputMixer::signal()
+{
+    AutoMutex lock(mLock);
+
+    mCond.signal();
+}
+
+void ALSAOutputMixer::stop()
+{
+    requestExit();
+    signal();
+    requestExitAndWait();
+}
+
+// Frames every playing track has queued, up to a period; called with
+// mLock held. A track starts playing when it has data, and one fading out
+// plays until its fade is mixed.
+size_t ALSAOutputMixer::readyFrames(bool *playing)
+{
+    size_t ready = mPeriodFrames;
+
+    *playing = false;
+
+    for (size_t i = 0; i < mTracks.size(); i++) {
+        track_t &t = mTracks.editItemAt(i);
+        size_t frames = t.stream->mRing->available() / mFrameSize;
+
+        if (t.fadeFrames) {
+            *playing = true;
+            if (t.fadeFrames < ready) ready = t.fadeFrames;
+        }
+
+        if (frames) t.active = true;
+        if (!t.active) continue;
+
+        *playing = true;
+        if (frames < ready) ready = frames;
+    }
+
+    return *playing ? ready : 0;
+}
+
+bool ALSAOutputMixer::threadLoop()
+{
+    size_t frames;
+    bool playing;
+
+    {
+        AutoMutex lock(mLock);
+
+        if (!mMix || !mScratch) return false;
+
+        // Each cycle mixes what all playing tracks have, so a track that is
+        // late holds the others back instead of getting silence spliced
+        // into its stream. One that stays dry for a period has underrun and
+        // sits out until it writes again.
+        frames = readyFrames(&playing);
+
+        if (playing && !frames) {
+            nsecs_t now = systemTime();
+
+            if (!mShortSince)
+                mShortSince = now;
+            else if (now - mShortSince >= mPeriodNs) {
+                for (size_t i = 0; i < mTracks.size(); i++) {
+                    track_t &t = mTracks.editItemAt(i);
+                    if (t.active && !t.stream->mRing->available()) {
+                        LOGV("Mixer track %p underran", t.stream);
+                        t.active = false;
+                    }
+                }
+
+                frames = readyFrames(&playing);
+            }
+        }
+
+        if (frames) {
+            size_t bytes = frames * mFrameSize;
+
+            mShortSince = 0;
+            memset(mMix, 0, bytes);
+
+            size_t samples = bytes / (snd_pcm_format_physical_width(mHandle->format) / 8);
+
+            for (size_t i = 0; i < mTracks.size(); i++) {
+                track_t &t = mTracks.editItemAt(i);
+
+                if (t.fadeFrames) {
+                    mix(mMix, t.fade + t.fadePos * mFrameSize, samples, mHandle->format);
+                    t.fadePos += frames;
+                    t.fadeFrames -= frames;
+                }
+
+                if (!t.active) continue;
+
+                t.stream->mRing->read(mScratch, bytes);
+                mix(mMix, mScratch, samples, mHandle->format);
+                t.frames += frames;
+                t.mixed = true;
+
+                AutoMutex ringLock(t.stream->mRingLock);
+                t.stream->mSpaceCond.signal();
+            }
+        } else if (!exitPending()) {
+            mCond.waitRelative(mLock, mPeriodNs);
+        }
+    }
+
+    if (!frames) {
+        if (playing) return !exitPending();
+
+        // Nothing to play. Let the PCM idle into standby once no track has
+        // written for as long as AudioFlinger would wait.
+        nsecs_t now = systemTime();
+
+        mShortSince = 0;
+
+        if (!mIdleSince)
+            mIdleSince = now;
+        else if (!mStandby && now - mIdleSince > MIXER_STANDBY_NS) {
+            mDevice->standby();
+            mStandby = true;
+
+            // The device counts from zero again, with all of it played.
+            AutoMutex lock(mLock);
+            mDeviceFrames = 0;
+
+            for (size_t i = 0; i < mTracks.size(); i++)
+                mTracks.editItemAt(i).deviceEnd = 0;
+        }
+
+        return !exitPending();
+    }
+
+    mIdleSince = 0;
+    mStandby = false;
+
+    // Blocks at the rate the device drains its buffer, which paces the
+    // whole mixer.
+    ssize_t n = mDevice->write(mMix, frames * mFrameSize);
+    if (n < 0)
+        LOGW("Mixer dropped %u frames: %s", frames, snd_strerror(n));
+
+    AutoMutex lock(mLock);
+
+    if (n > 0) mDeviceFrames += n / mFrameSize;
+
+    for (size_t i = 0; i < mTracks.size(); i++) {
+        track_t &t = mTracks.editItemAt(i);
+        if (!t.mixed) continue;
+
+        t.deviceEnd = mDeviceFrames;
+        t.mixed = false;
+    }
+
+    return !exitPending();
+}
+
+}       // namespace android
@@ -0,0 +1,313 @@
+/* ALSAResampler.cpp
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_TAG "AudioHardwareALSA"
+#include <utils/Log.h>
+
+#include "AudioHardwareALSA.h"
+
+// Define ALSA_RESAMPLER_SCALAR to build only the reference kernels.
+#ifndef ALSA_RESAMPLER_SCALAR
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define RESAMPLER_NEON
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#define RESAMPLER_SSE
+#endif
+#endif
+
+namespace android
+{
+
+// Input frames buffered per channel, on top of the filter history.
+static const size_t INPUT_BLOCK = 1024;
+
+// Longest filter of the quality tiers below.
+static const unsigned int MAX_TAPS = 48;
+
+struct quality_spec_t {
+    unsigned int    halfTaps;       // zero crossings on each side; taps are a multiple of 4
+    unsigned int    phases;         // coefficient sets per input sample
+    float           passband;       // fraction of the lower Nyquist frequency kept
+    float           beta;           // Kaiser window shape
+};
+
+static const quality_spec_t qualitySpec[] = {
+    /* QUALITY_LOW    */ {  4,  32, 0.85f, 5.0f },
+    /* QUALITY_MEDIUM */ { 12, 128, 0.91f, 7.0f },
+    /* QUALITY_HIGH   */ { 24, 256, 0.95f, 9.0f },
+};
+
+// Zeroth order modified Bessel function of the first kind.
+static double besselI0(double x)
+{
+    double sum = 1.0, term = 1.0;
+
+    for (int k = 1; k < 32; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+        if (term < sum * 1e-12) break;
+    }
+
+    return sum;
+}
+
+// ----------------------------------------------------------------------------
+// Kernels. The coefficients for an output sample are interpolated between
+// the two nearest phases, then each channel is one dot product over its
+// planar history.
+
+static void interpolate_c(const float *h0, const float *h1, float a, float *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        out[i] = h0[i] + a * (h1[i] - h0[i]);
+}
+
+static float dot_c(const float *x, const float *h, size_t n)
+{
+    float acc = 0.0f;
+
+    for (size_t i = 0; i < n; i++)
+        acc += x[i] * h[i];
+
+    return acc;
+}
+
+static inline void interpolate(const float *h0, const float *h1, float a, float *out, size_t n)
+{
+    size_t i = 0;
+#if defined(RESAMPLER_NEON)
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t v0 = vld1q_f32(h0 + i);
+        vst1q_f32(out + i, vmlaq_n_f32(v0, vsubq_f32(vld1q_f32(h1 + i), v0), a));
+    }
+#elif defined(RESAMPLER_SSE)
+    __m128 va = _mm_set1_ps(a);
+    for (; i + 4 <= n; i += 4) {
+        __m128 v0 = _mm_loadu_ps(h0 + i);
+        _mm_storeu_ps(out + i, _mm_add_ps(v0, _mm_mul_ps(va, _mm_sub_ps(_mm_loadu_ps(h1 + i), v0))));
+    }
+#endif
+    interpolate_c(h0 + i, h1 + i, a, out + i, n - i);
+}
+
+static inline float dot(const float *x, const float *h, size_t n)
+{
+    size_t i = 0;
+    float acc = 0.0f;
+#if defined(RESAMPLER_NEON)
+    float32x4_t v = vdupq_n_f32(0.0f);
+    for (; i + 4 <= n; i += 4)
+        v = vmlaq_f32(v, vld1q_f32(x + i), vld1q_f32(h + i));
+    float32x2_t sum = vadd_f32(vget_low_f32(v), vget_high_f32(v));
+    acc = vget_lane_f32(vpadd_f32(sum, sum), 0);
+#elif defined(RESAMPLER_SSE)
+    __m128 v = _mm_setzero_ps();
+    for (; i + 4 <= n; i += 4)
+        v = _mm_add_ps(v, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(h + i)));
+    float sum[4];
+    _mm_storeu_ps(sum, v);
+    acc = (sum[0] + sum[2]) + (sum[1] + sum[3]);
+#endif
+    return acc + dot_c(x + i, h + i, n - i);
+}
+
+// ----------------------------------------------------------------------------
+
+ALSAResampler::ALSAResampler() :
+    mInRate(0),
+    mOutRate(0),
+    mChannels(0),
+    mQuality(QUALITY_MEDIUM),
+    mTaps(0),
+    mPhases(0),
+    mCoefs(0),
+    mHistory(0),
+    mCapacity(0),
+    mFill(0),
+    mIndex(0),
+    mRemainder(0)
+{
+}
+
+ALSAResampler::~ALSAResampler()
+{
+    free(mCoefs);
+    free(mHistory);
+}
+
+status_t ALSAResampler::configure(uint32_t inRate, uint32_t outRate,
+        unsigned int channels, quality_t quality)
+{
+    if (inRate == mInRate && outRate == mOutRate &&
+        channels == mChannels && quality == mQuality)
+        return NO_ERROR;
+
+    if (!inRate || !outRate || !channels || channels > ALSAConverter::MAX_CHANNELS ||
+        quality < QUALITY_LOW || quality > QUALITY_HIGH)
+        return BAD_VALUE;
+
+    free(mCoefs);
+    free(mHistory);
+    mCoefs = 0;
+    mHistory = 0;
+
+    mInRate = inRate;
+    mOutRate = outRate;
+    mChannels = channels;
+    mQuality = quality;
+
+    if (isPassthrough()) return NO_ERROR;
+
+    const quality_spec_t &spec = qualitySpec[quality];
+    mTaps = spec.halfTaps * 2;
+    mPhases = spec.phases;
+
+    mCapacity = mTaps + INPUT_BLOCK;
+    mCoefs = (float *)malloc((mPhases + 1) * mTaps * sizeof(float));
+    mHistory = (float *)malloc(mCapacity * mChannels * sizeof(float));
+
+    if (!mCoefs || !mHistory) {
+        LOGE("Unable to allocate a %u to %u HZ resampler", inRate, outRate);
+        free(mCoefs);
+        free(mHistory);
+        mCoefs = 0;
+        mHistory = 0;
+        mInRate = mOutRate = 0;
+        return NO_MEMORY;
+    }
+
+    // Windowed sinc, cut off below the lower of the two Nyquist frequencies.
+    // Row p holds the taps for an output that lies p / phases of an input
+    // frame past the centre tap.
+    double cutoff = spec.passband * (outRate < inRate ? (double)outRate / inRate : 1.0);
+    double norm = besselI0(spec.beta);
+
+    for (unsigned int p = 0; p <= mPhases; p++)
+        for (unsigned int k = 0; k < mTaps; k++) {
+            double d = (double)k - (spec.halfTaps - 1) - (double)p / mPhases;
+            double x = d / spec.halfTaps;
+            double w = fabs(x) < 1.0 ? besselI0(spec.beta * sqrt(1.0 - x * x)) / norm : 0.0;
+            double s = d == 0.0 ? 1.0 : sin(M_PI * cutoff * d) / (M_PI * cutoff * d);
+
+            mCoefs[p * mTaps + k] = (float)(cutoff * s * w);
+        }
+
+    LOGI("Resampling %u to %u HZ, %u taps x %u phases", inRate, outRate,
+            mTaps, mPhases);
+
+    reset();
+
+    return NO_ERROR;
+}
+
+void ALSAResampler::reset()
+{
+    if (!mHistory) return;
+
+    // Prime the history so the first output lines up with the first input.
+    mFill = mTaps / 2 - 1;
+    memset(mHistory, 0, mCapacity * mChannels * sizeof(float));
+    mIndex = mFill;
+    mRemainder = 0;
+}
+
+size_t ALSAResampler::outputFrames(size_t inFrames) const
+{
+    if (isPassthrough()) return inFrames;
+
+    return (size_t)(((uint64_t)inFrames * mOutRate + mInRate - 1) / mInRate) + 1;
+}
+
+size_t ALSAResampler::process(const float *in, size_t inFrames,
+        float *out, size_t outFrames)
+{
+    if (isPassthrough()) {
+        size_t n = inFrames < outFrames ? inFrames : outFrames;
+        if (in != out) memcpy(out, in, n * mChannels * sizeof(float));
+        return n;
+    }
+
+    if (!mHistory) return 0;
+
+    unsigned int half = mTaps / 2;
+    uint32_t step = mInRate / mOutRate;
+    uint32_t stepRemainder = mInRate % mOutRate;
+    float coefs[MAX_TAPS];
+    size_t produced = 0;
+    size_t consumed = 0;
+
+    for (;;) {
+        // Append what fits, one planar history per channel.
+        size_t n = inFrames - consumed;
+        if (n > mCapacity - mFill) n = mCapacity - mFill;
+
+        for (unsigned int c = 0; c < mChannels; c++) {
+            float *dst = mHistory + c * mCapacity + mFill;
+            const float *src = in + consumed * mChannels + c;
+            for (size_t i = 0; i < n; i++)
+                dst[i] = src[i * mChannels];
+        }
+        mFill += n;
+        consumed += n;
+
+        // Every output needs half the taps of history on either side.
+        while (produced < outFrames && mIndex + half < mFill) {
+            float phase = (float)mRemainder * mPhases / mOutRate;
+            unsigned int p = (unsigned int)phase;
+            const float *h = mCoefs + p * mTaps;
+
+            interpolate(h, h + mTaps, phase - p, coefs, mTaps);
+
+            const float *x = mHistory + mIndex - (half - 1);
+            for (unsigned int c = 0; c < mChannels; c++)
+                *out++ = dot(x + c * mCapacity, coefs, mTaps);
+
+            produced++;
+            mIndex += step;
+            mRemainder += stepRemainder;
+            if (mRemainder >= mOutRate) {
+                mRemainder -= mOutRate;
+                mIndex++;
+            }
+        }
+
+        // Drop the history no future output will reach.
+        size_t keep = mIndex - (half - 1);
+        if (keep > mFill) keep = mFill;
+        if (keep) {
+            for (unsigned int c = 0; c < mChannels; c++) {
+                float *h = mHistory + c * mCapacity;
+                memmove(h, h + keep, (mFill - keep) * sizeof(float));
+            }
+            mFill -= keep;
+            mIndex -= keep;
+        }
+
+        if (consumed == inFrames || produced == outFrames) break;
+    }
+
+    if (consumed < inFrames)
+        LOGW("Resampler dropped %u input frames", (unsigned int)(inFrames - consumed));
+
+    return produced;
+}
+
+}       // namespace android
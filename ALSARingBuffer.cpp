@@ -0,0 +1,149 @@
+/* ALSARingBuffer.cpp
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_TAG "AudioHardwareALSA"
+#include <utils/Log.h>
+
+#include <cutils/atomic.h>
+
+#include "AudioHardwareALSA.h"
+
+namespace android
+{
+
+// ----------------------------------------------------------------------------
+
+ALSARingBuffer::ALSARingBuffer(size_t size) :
+    mBuffer(0),
+    mSize(0),
+    mReadPos(0),
+    mWritePos(0)
+{
+    // The positions are free running counters, so the size must be a power
+    // of two for the masking (and the 32 bit wrap around) to work.
+    size_t bytes = 1;
+    while (bytes < size) bytes <<= 1;
+
+    mBuffer = (char *)malloc(bytes);
+    if (mBuffer)
+        mSize = bytes;
+    else
+        LOGE("Unable to allocate %u byte ring buffer", bytes);
+}
+
+ALSARingBuffer::~ALSARingBuffer()
+{
+    free(mBuffer);
+}
+
+size_t ALSARingBuffer::available() const
+{
+    uint32_t w = android_atomic_acquire_load(&mWritePos);
+    uint32_t r = android_atomic_acquire_load(&mReadPos);
+    return w - r;
+}
+
+size_t ALSARingBuffer::space() const
+{
+    return mSize - available();
+}
+
+size_t ALSARingBuffer::write(const void *data, size_t bytes)
+{
+    // Only the producer moves the write position.
+    uint32_t w = mWritePos;
+    uint32_t r = android_atomic_acquire_load(&mReadPos);
+
+    size_t room = mSize - (w - r);
+    if (bytes > room) bytes = room;
+
+    size_t offset = w & (mSize - 1);
+    size_t first = mSize - offset;
+    if (first > bytes) first = bytes;
+
+    memcpy(mBuffer + offset, data, first);
+    memcpy(mBuffer, (const char *)data + first, bytes - first);
+
+    android_atomic_release_store(w + bytes, &mWritePos);
+    return bytes;
+}
+
+size_t ALSARingBuffer::read(void *data, size_t bytes)
+{
+    // Only the consumer moves the read position.
+    uint32_t r = mReadPos;
+    uint32_t w = android_atomic_acquire_load(&mWritePos);
+
+    size_t used = w - r;
+    if (bytes > used) bytes = used;
+
+    size_t offset = r & (mSize - 1);
+    size_t first = mSize - offset;
+    if (first > bytes) first = bytes;
+
+    memcpy(data, mBuffer + offset, first);
+    memcpy((char *)data + first, mBuffer, bytes - first);
+
+    android_atomic_release_store(r + bytes, &mReadPos);
+    return bytes;
+}
+
+size_t ALSARingBuffer::readRegion(void **data) const
+{
+    uint32_t r = mReadPos;
+    uint32_t w = android_atomic_acquire_load(&mWritePos);
+
+    size_t offset = r & (mSize - 1);
+    size_t bytes = w - r;
+    if (bytes > mSize - offset) bytes = mSize - offset;
+
+    *data = mBuffer + offset;
+    return bytes;
+}
+
+void ALSARingBuffer::commitRead(size_t bytes)
+{
+    android_atomic_release_store(mReadPos + bytes, &mReadPos);
+}
+
+size_t ALSARingBuffer::writeRegion(void **data) const
+{
+    uint32_t w = mWritePos;
+    uint32_t r = android_atomic_acquire_load(&mReadPos);
+
+    size_t offset = w & (mSize - 1);
+    size_t bytes = mSize - (w - r);
+    if (bytes > mSize - offset) bytes = mSize - offset;
+
+    *data = mBuffer + offset;
+    return bytes;
+}
+
+void ALSARingBuffer::commitWrite(size_t bytes)
+{
+    android_atomic_release_store(mWritePos + bytes, &mWritePos);
+}
+
+void ALSARingBuffer::flush()
+{
+    // Consumer side: discard everything that has been published so far.
+    android_atomic_release_store(android_atomic_acquire_load(&mWritePos),
+            &mReadPos);
+}
+
+}       // namespace android
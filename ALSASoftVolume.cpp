@@ -0,0 +1,288 @@
+/* ALSASoftVolume.cpp
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <math.h>
+#include <stdint.h>
+
+#define LOG_TAG "AudioHardwareALSA"
+#include <utils/Log.h>
+
+#include "AudioHardwareALSA.h"
+
+// Define ALSA_SOFT_VOLUME_SCALAR to build only the reference kernels.
+#ifndef ALSA_SOFT_VOLUME_SCALAR
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SOFT_VOLUME_NEON
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#define SOFT_VOLUME_SSE
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#define SOFT_VOLUME_SSE_FLOAT
+#endif
+#endif
+
+namespace android
+{
+
+// Samples per gain block; a multiple of the SIMD width.
+static const size_t GAIN_BLOCK = 128;
+
+// Exponential ramps cannot start or end at zero; -80 dB is silent enough.
+static const float GAIN_FLOOR = 0.0001f;
+
+// ----------------------------------------------------------------------------
+// Scalar reference kernels. The SIMD kernels below must produce bit-identical
+// results: S16 is Q15 with rounding (vqrdmulh / pmulhrsw semantics for
+// non-negative gains), float is a single IEEE multiply.
+
+// Q15 tops out just below 1.0, so unity takes the one value no
+// non-negative gain uses, and passes samples through untouched.
+static const int16_t Q15_UNITY = -32768;
+
+static inline int16_t mulQ15(int16_t x, int16_t g)
+{
+    if (g == Q15_UNITY) return x;
+
+    int32_t p = ((int32_t)x * g + 0x4000) >> 15;
+    return p > 32767 ? 32767 : (p < -32768 ? -32768 : p);
+}
+
+static void scaleS16_c(const int16_t *in, const int16_t *gain, int16_t *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        out[i] = mulQ15(in[i], gain[i]);
+}
+
+static void scaleF32_c(const float *in, const float *gain, float *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        out[i] = in[i] * gain[i];
+}
+
+static void scaleS16(const int16_t *in, const int16_t *gain, int16_t *out, size_t n)
+{
+    size_t i = 0;
+#if defined(SOFT_VOLUME_NEON)
+    const int16x8_t unity = vdupq_n_s16(Q15_UNITY);
+
+    for (; i + 8 <= n; i += 8) {
+        int16x8_t x = vld1q_s16(in + i);
+        int16x8_t g = vld1q_s16(gain + i);
+        vst1q_s16(out + i, vbslq_s16(vceqq_s16(g, unity), x, vqrdmulhq_s16(x, g)));
+    }
+#elif defined(SOFT_VOLUME_SSE)
+    const __m128i unity = _mm_set1_epi16(Q15_UNITY);
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i g = _mm_loadu_si128((const __m128i *)(gain + i));
+        __m128i pass = _mm_cmpeq_epi16(g, unity);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_or_si128(_mm_and_si128(pass, x),
+                _mm_andnot_si128(pass, _mm_mulhrs_epi16(x, g))));
+    }
+#endif
+    scaleS16_c(in + i, gain + i, out + i, n - i);
+}
+
+static void scaleF32(const float *in, const float *gain, float *out, size_t n)
+{
+    size_t i = 0;
+#if defined(SOFT_VOLUME_NEON)
+    for (; i + 4 <= n; i += 4)
+        vst1q_f32(out + i, vmulq_f32(vld1q_f32(in + i), vld1q_f32(gain + i)));
+#elif defined(SOFT_VOLUME_SSE) || defined(SOFT_VOLUME_SSE_FLOAT)
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(in + i), _mm_loadu_ps(gain + i)));
+#endif
+    scaleF32_c(in + i, gain + i, out + i, n - i);
+}
+
+// Gains that round to 1.0 or above are unity; S16 has no headroom for more.
+static inline int16_t toQ15(float gain)
+{
+    int32_t q = (int32_t)(gain * 32768.0f + 0.5f);
+    return q > 32767 ? Q15_UNITY : (q < 0 ? 0 : q);
+}
+
+// ----------------------------------------------------------------------------
+
+ALSASoftVolume::ALSASoftVolume(unsigned int channels) :
+    mChannels(channels > MAX_CHANNELS ? MAX_CHANNELS : channels),
+    mRamp(RAMP_LINEAR),
+    mMaster(1.0f)
+{
+    for (unsigned int i = 0; i < MAX_CHANNELS; i++)
+        mCurrent[i] = mTarget[i] = 1.0f;
+}
+
+void ALSASoftVolume::setChannels(unsigned int channels)
+{
+    AutoMutex lock(mLock);
+
+    if (channels > MAX_CHANNELS) channels = MAX_CHANNELS;
+
+    // New channels pick up the volume of their side, as in setVolume().
+    for (unsigned int i = mChannels; i < channels; i++) {
+        unsigned int side = mChannels > 1 ? (i & 1) : 0;
+        mTarget[i] = mTarget[side];
+        mCurrent[i] = mCurrent[side];
+    }
+
+    mChannels = channels;
+}
+
+void ALSASoftVolume::setVolume(float left, float right)
+{
+    AutoMutex lock(mLock);
+
+    // Mono gets the average; otherwise even channels follow the left
+    // volume and odd channels the right one.
+    if (mChannels == 1)
+        mTarget[0] = (left + right) / 2;
+    else
+        for (unsigned int i = 0; i < mChannels; i++)
+            mTarget[i] = (i & 1) ? right : left;
+}
+
+void ALSASoftVolume::setChannelVolume(unsigned int channel, float volume)
+{
+    AutoMutex lock(mLock);
+
+    if (channel < mChannels) mTarget[channel] = volume;
+}
+
+void ALSASoftVolume::setMasterVolume(float volume)
+{
+    AutoMutex lock(mLock);
+
+    mMaster = volume;
+}
+
+void ALSASoftVolume::setRamp(ramp_t ramp)
+{
+    AutoMutex lock(mLock);
+
+    mRamp = ramp;
+}
+
+bool ALSASoftVolume::isUnity()
+{
+    AutoMutex lock(mLock);
+
+    for (unsigned int i = 0; i < mChannels; i++)
+        if (mCurrent[i] != 1.0f || mTarget[i] * mMaster != 1.0f)
+            return false;
+
+    return true;
+}
+
+status_t ALSASoftVolume::process(const void *in, void *out, size_t frames,
+        snd_pcm_format_t format)
+{
+    if (format != SND_PCM_FORMAT_S16_LE && format != SND_PCM_FORMAT_FLOAT_LE)
+        return INVALID_OPERATION;
+
+    unsigned int channels;
+    ramp_t ramp;
+    float current[MAX_CHANNELS];
+    float target[MAX_CHANNELS];
+    float step[MAX_CHANNELS];
+    bool ramping = false;
+
+    // Scaling works on a copy, so that setters never wait for it.
+    {
+        AutoMutex lock(mLock);
+
+        channels = mChannels;
+        ramp = mRamp;
+
+        for (unsigned int c = 0; c < channels; c++) {
+            current[c] = mCurrent[c];
+            target[c] = mTarget[c] * mMaster;
+        }
+    }
+
+    // A new target is reached by the end of this buffer, either with a
+    // constant increment or a constant factor per frame.
+    for (unsigned int c = 0; c < channels; c++) {
+        if (current[c] == target[c]) {
+            step[c] = ramp == RAMP_LINEAR ? 0.0f : 1.0f;
+            continue;
+        }
+
+        ramping = true;
+
+        if (ramp == RAMP_LINEAR) {
+            step[c] = (target[c] - current[c]) / frames;
+        } else {
+            float from = current[c] > GAIN_FLOOR ? current[c] : GAIN_FLOOR;
+            float to = target[c] > GAIN_FLOOR ? target[c] : GAIN_FLOOR;
+            current[c] = from;
+            step[c] = powf(to / from, 1.0f / frames);
+        }
+    }
+
+    size_t blockFrames = GAIN_BLOCK / channels;
+    float gainF[GAIN_BLOCK];
+    int16_t gainQ[GAIN_BLOCK];
+    bool filled = false;
+
+    for (size_t done = 0; done < frames; ) {
+        size_t n = frames - done;
+        if (n > blockFrames) n = blockFrames;
+        size_t samples = n * channels;
+
+        // A constant gain block only needs to be built once.
+        if (ramping || !filled) {
+            for (size_t f = 0; f < n; f++)
+                for (unsigned int c = 0; c < channels; c++) {
+                    if (ramping) {
+                        if (ramp == RAMP_LINEAR)
+                            current[c] += step[c];
+                        else
+                            current[c] *= step[c];
+                    }
+                    gainF[f * channels + c] = current[c];
+                }
+
+            if (format == SND_PCM_FORMAT_S16_LE)
+                for (size_t i = 0; i < samples; i++)
+                    gainQ[i] = toQ15(gainF[i]);
+
+            filled = true;
+        }
+
+        if (format == SND_PCM_FORMAT_S16_LE)
+            scaleS16((const int16_t *)in + done * channels, gainQ,
+                    (int16_t *)out + done * channels, samples);
+        else
+            scaleF32((const float *)in + done * channels, gainF,
+                    (float *)out + done * channels, samples);
+
+        done += n;
+    }
+
+    // Land exactly on the target, whatever the rounding on the way.
+    AutoMutex lock(mLock);
+
+    for (unsigned int c = 0; c < channels && c < mChannels; c++)
+        mCurrent[c] = target[c];
+
+    return NO_ERROR;
+}
+
+}       // namespace android
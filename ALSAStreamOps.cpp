@@ -20,6 +20,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <dlfcn.h>
 
@@ -27,6 +28,7 @@
 #include <utils/Log.h>
 #include <utils/String8.h>
 
+#include <cutils/atomic.h>
 #include <cutils/properties.h>
 #include <media/AudioRecord.h>
 #include <hardware_legacy/power.h>
@@ -41,8 +43,30 @@ namespace android
 ALSAStreamOps::ALSAStreamOps(AudioHardwareALSA *parent, alsa_handle_t *handle) :
     mParent(parent),
     mHandle(handle),
-    mPowerLock(false)
+    mPowerLock(false),
+    mShared(false),
+    mLastActive(systemTime()),
+    mIdleDevices(0),
+    mIdleMode(0),
+    mFormat(SND_PCM_FORMAT_S16_LE),
+    mConvertBuffer(0),
+    mConvertBufferSize(0),
+    mLayoutGeneration(0),
+    mLayoutChannels(0)
 {
+    // Clients default to the device format when AudioSystem can name it.
+    if (handle->format == SND_PCM_FORMAT_S8)
+        mFormat = handle->format;
+
+    if (handle->devices & AudioSystem::DEVICE_OUT_ALL)
+        mChannels = alsa_channel_mask(handle->channels);
+    else if (handle->channels == 1)
+        mChannels = AudioSystem::CHANNEL_IN_LEFT;
+    else
+        mChannels = AudioSystem::CHANNEL_IN_LEFT | AudioSystem::CHANNEL_IN_RIGHT;
+
+    // Clients that do not ask for a rate get the one the device runs at.
+    mSampleRate = deviceRate();
 }
 
 ALSAStreamOps::~ALSAStreamOps()
@@ -50,6 +74,7 @@ ALSAStreamOps::~ALSAStreamOps()
     AutoMutex lock(mLock);
 
     close();
+    free(mConvertBuffer);
 }
 
 // use emulated popcount optimization
@@ -79,43 +104,50 @@ status_t ALSAStreamOps::set(int      *format,
                             uint32_t *rate)
 {
     if (channels && *channels != 0) {
-        if (mHandle->channels != popCount(*channels))
-            return BAD_VALUE;
-    } else if (channels) {
-        *channels = 0;
-        if (mHandle->devices & AudioSystem::DEVICE_OUT_ALL)
-            switch(mHandle->channels) {
-                case 4:
-                    *channels |= AudioSystem::CHANNEL_OUT_BACK_LEFT;
-                    *channels |= AudioSystem::CHANNEL_OUT_BACK_RIGHT;
-                    // Fall through...
-                default:
-                case 2:
-                    *channels |= AudioSystem::CHANNEL_OUT_FRONT_RIGHT;
-                    // Fall through...
-                case 1:
-                    *channels |= AudioSystem::CHANNEL_OUT_FRONT_LEFT;
-                    break;
+        unsigned int count = popCount(*channels);
+
+        if (count != mHandle->channels) {
+            // Output streams reorder and downmix in software; capture
+            // streams still have to match the device.
+            if (!(mHandle->devices & AudioSystem::DEVICE_OUT_ALL) ||
+                (*channels & ~AudioSystem::CHANNEL_OUT_ALL) ||
+                count > ALSAConverter::MAX_CHANNELS)
+                return BAD_VALUE;
+
+            // HDMI sinks take surround as is, so renegotiate rather than
+            // downmix. The device may still settle on fewer channels. A
+            // shared PCM stays as the stream that opened it configured it.
+            if (!mShared && count > mHandle->channels &&
+                (mHandle->curDev & AudioSystem::DEVICE_OUT_AUX_DIGITAL)) {
+                uint32_t previous = mHandle->channels;
+
+                mHandle->channels = count;
+                if (open(mHandle->curMode) != NO_ERROR) {
+                    LOGW("Unable to open %u channels, downmixing to %u",
+                            count, previous);
+                    mHandle->channels = previous;
+                    open(mHandle->curMode);
+                }
             }
-        else
-            switch(mHandle->channels) {
-                default:
-                case 2:
-                    *channels |= AudioSystem::CHANNEL_IN_RIGHT;
-                    // Fall through...
-                case 1:
-                    *channels |= AudioSystem::CHANNEL_IN_LEFT;
-                    break;
-            }
-    }
+        }
+
+        mChannels = *channels;
+    } else if (channels)
+        *channels = mChannels;
 
     if (rate && *rate > 0) {
-        if (mHandle->sampleRate != *rate)
+        // Output streams resample to the device rate; capture streams
+        // still have to match it.
+        if (*rate != deviceRate() &&
+            (!(mHandle->devices & AudioSystem::DEVICE_OUT_ALL) ||
+             *rate < 4000 || *rate > 192000))
             return BAD_VALUE;
+
+        mSampleRate = *rate;
     } else if (rate)
-        *rate = mHandle->sampleRate;
+        *rate = mSampleRate;
 
-    snd_pcm_format_t iformat = mHandle->format;
+    snd_pcm_format_t iformat = mFormat;
 
     if (format) {
         switch(*format) {
@@ -130,23 +162,31 @@ status_t ALSAStreamOps::set(int      *format,
                 iformat = SND_PCM_FORMAT_S8;
                 break;
 
+            case ALSA_FORMAT_PCM_32_BIT:
+                iformat = SND_PCM_FORMAT_S32_LE;
+                break;
+
+            case ALSA_FORMAT_PCM_8_24_BIT:
+                iformat = SND_PCM_FORMAT_S24_LE;
+                break;
+
+            case ALSA_FORMAT_PCM_FLOAT:
+                iformat = SND_PCM_FORMAT_FLOAT_LE;
+                break;
+
             default:
                 LOGE("Unknown PCM format %i. Forcing default", *format);
                 break;
         }
 
-        if (mHandle->format != iformat)
+        // Any client format the converter handles is fine; the stream
+        // converts to whatever the device was opened with.
+        if (!ALSAConverter::isSupported(iformat) ||
+            !ALSAConverter::isSupported(mHandle->format))
             return BAD_VALUE;
 
-        switch(iformat) {
-            default:
-            case SND_PCM_FORMAT_S16_LE:
-                *format = AudioSystem::PCM_16_BIT;
-                break;
-            case SND_PCM_FORMAT_S8:
-                *format = AudioSystem::PCM_8_BIT;
-                break;
-        }
+        mFormat = iformat;
+        *format = ALSAStreamOps::format();
     }
 
     return NO_ERROR;
@@ -161,6 +201,8 @@ status_t ALSAStreamOps::setParameters(const String8& keyValuePairs)
     LOGV("setParameters() %s", keyValuePairs.string());
 
     if (param.getInt(key, device) == NO_ERROR) {
+        AutoMutex lock(mLock);
+
         mParent->mALSADevice->route(mHandle, (uint32_t)device, mParent->mode());
         param.remove(key);
     }
@@ -187,6 +229,23 @@ String8 ALSAStreamOps::getParameters(const String8& keys)
 
 uint32_t ALSAStreamOps::sampleRate() const
 {
+    return mSampleRate;
+}
+
+uint32_t ALSAStreamOps::deviceRate() const
+{
+    snd_pcm_hw_params_t *params;
+    unsigned int rate;
+
+    if (!mHandle->handle) return mHandle->sampleRate;
+
+    // Reads alsa-lib's copy of the installed parameters; no ioctl.
+    snd_pcm_hw_params_alloca(&params);
+
+    if (snd_pcm_hw_params_current(mHandle->handle, params) == 0 &&
+        snd_pcm_hw_params_get_rate(params, &rate, 0) == 0)
+        return rate;
+
     return mHandle->sampleRate;
 }
 
@@ -198,9 +257,12 @@ size_t ALSAStreamOps::bufferSize() const
     snd_pcm_uframes_t bufferSize = mHandle->bufferSize;
     snd_pcm_uframes_t periodSize;
 
-    snd_pcm_get_params(mHandle->handle, &bufferSize, &periodSize);
+    // A PCM closed for idling reports what the handle asks for.
+    if (mHandle->handle)
+        snd_pcm_get_params(mHandle->handle, &bufferSize, &periodSize);
 
-    size_t bytes = static_cast<size_t>(snd_pcm_frames_to_bytes(mHandle->handle, bufferSize));
+    // In client frames, which may run at another rate.
+    size_t bytes = (size_t)((uint64_t)bufferSize * mSampleRate / deviceRate()) * frameSize();
 
     // Not sure when this happened, but unfortunately it now
     // appears that the bufferSize must be reported as a
@@ -213,21 +275,29 @@ size_t ALSAStreamOps::bufferSize() const
 
 int ALSAStreamOps::format() const
 {
-    int pcmFormatBitWidth;
     int audioSystemFormat;
 
-    snd_pcm_format_t ALSAFormat = mHandle->format;
-
-    pcmFormatBitWidth = snd_pcm_format_physical_width(ALSAFormat);
-    switch(pcmFormatBitWidth) {
-        case 8:
+    switch(mFormat) {
+        case SND_PCM_FORMAT_S8:
             audioSystemFormat = AudioSystem::PCM_8_BIT;
             break;
 
+        case SND_PCM_FORMAT_S32_LE:
+            audioSystemFormat = ALSA_FORMAT_PCM_32_BIT;
+            break;
+
+        case SND_PCM_FORMAT_S24_LE:
+            audioSystemFormat = ALSA_FORMAT_PCM_8_24_BIT;
+            break;
+
+        case SND_PCM_FORMAT_FLOAT_LE:
+            audioSystemFormat = ALSA_FORMAT_PCM_FLOAT;
+            break;
+
         default:
-            LOG_FATAL("Unknown AudioSystem bit width %i!", pcmFormatBitWidth);
+            LOGE("Unknown AudioSystem format for %s!", snd_pcm_format_name(mFormat));
 
-        case 16:
+        case SND_PCM_FORMAT_S16_LE:
             audioSystemFormat = AudioSystem::PCM_16_BIT;
             break;
     }
@@ -235,42 +305,191 @@ int ALSAStreamOps::format() const
     return audioSystemFormat;
 }
 
+size_t ALSAStreamOps::frameSize() const
+{
+    return snd_pcm_format_physical_width(mFormat) / 8 * popCount(mChannels);
+}
+
+void *ALSAStreamOps::convertBuffer(size_t bytes)
+{
+    if (bytes > mConvertBufferSize) {
+        char *buffer = (char *)realloc(mConvertBuffer, bytes);
+        if (!buffer) return 0;
+
+        mConvertBuffer = buffer;
+        mConvertBufferSize = bytes;
+    }
+
+    return mConvertBuffer;
+}
+
 uint32_t ALSAStreamOps::channels() const
 {
-    unsigned int count = mHandle->channels;
-    uint32_t channels = 0;
-
-    if (mHandle->curDev & AudioSystem::DEVICE_OUT_ALL)
-        switch(count) {
-            case 4:
-                channels |= AudioSystem::CHANNEL_OUT_BACK_LEFT;
-                channels |= AudioSystem::CHANNEL_OUT_BACK_RIGHT;
-                // Fall through...
-            default:
-            case 2:
-                channels |= AudioSystem::CHANNEL_OUT_FRONT_RIGHT;
-                // Fall through...
-            case 1:
-                channels |= AudioSystem::CHANNEL_OUT_FRONT_LEFT;
-                break;
+    return mChannels;
+}
+
+unsigned int ALSAStreamOps::clientLayout(uint32_t *layout) const
+{
+    unsigned int count = 0;
+
+    for (uint32_t bit = 1; bit && count < ALSAConverter::MAX_CHANNELS; bit <<= 1)
+        if (mChannels & bit) layout[count++] = bit;
+
+    return count;
+}
+
+unsigned int ALSAStreamOps::deviceLayout(uint32_t *layout)
+{
+    unsigned int channels = mHandle->channels;
+
+    if (channels > ALSAConverter::MAX_CHANNELS)
+        channels = ALSAConverter::MAX_CHANNELS;
+
+    if (mHandle->generation != mLayoutGeneration || channels != mLayoutChannels) {
+        uint32_t mask = alsa_channel_mask(channels);
+        unsigned int count = 0;
+
+        for (uint32_t bit = 1; bit && count < channels; bit <<= 1)
+            if (mask & bit) mDeviceLayout[count++] = bit;
+
+#ifdef SND_CHMAP_API_VERSION
+        // The module asks for the order above; devices with a fixed map
+        // may report another one, which the converter then reorders to.
+        snd_pcm_chmap_t *map = mHandle->handle ? snd_pcm_get_chmap(mHandle->handle) : 0;
+
+        if (map && map->channels == channels)
+            for (unsigned int i = 0; i < channels; i++) {
+                unsigned int pos = map->pos[i] & SND_CHMAP_POSITION_MASK;
+
+                mDeviceLayout[i] = pos == SND_CHMAP_MONO ? AudioSystem::CHANNEL_OUT_MONO : 0;
+                for (uint32_t bit = 1; bit; bit <<= 1)
+                    if ((bit & AudioSystem::CHANNEL_OUT_ALL) &&
+                        alsa_chmap_position(bit) == pos) {
+                        mDeviceLayout[i] = bit;
+                        break;
+                    }
+            }
+
+        free(map);
+#endif
+
+        mLayoutGeneration = mHandle->generation;
+        mLayoutChannels = channels;
+    }
+
+    memcpy(layout, mDeviceLayout, channels * sizeof(*layout));
+
+    return channels;
+}
+
+static inline const char *powerLockName(const alsa_handle_t *handle)
+{
+    return handle->devices & AudioSystem::DEVICE_OUT_ALL ? "AudioOutLock" : "AudioInLock";
+}
+
+void ALSAStreamOps::resume()
+{
+    mLastActive = systemTime();
+
+    // A stop left a fade playing out; cut what is left of it.
+    if (android_atomic_acquire_load(&mHandle->state) & ALSA_STATE_FADING) {
+        android_atomic_and(~ALSA_STATE_FADING, &mHandle->state);
+
+        if (mHandle->handle) {
+            snd_pcm_drop(mHandle->handle);
+            snd_pcm_prepare(mHandle->handle);
         }
-    else
-        switch(count) {
-            default:
-            case 2:
-                channels |= AudioSystem::CHANNEL_IN_RIGHT;
-                // Fall through...
-            case 1:
-                channels |= AudioSystem::CHANNEL_IN_LEFT;
-                break;
+    }
+
+    applyMode();
+
+    if (mIdleDevices) {
+        // A route change may have reopened it in the meantime.
+        if (!mHandle->handle) {
+            LOGD("Reopening idle PCM for devices %08x", mIdleDevices);
+            mHandle->module->open(mHandle, mIdleDevices, mIdleMode);
         }
+        mIdleDevices = 0;
+    }
 
-    return channels;
+    if (!mPowerLock) {
+        acquire_wake_lock (PARTIAL_WAKE_LOCK, powerLockName(mHandle));
+        mPowerLock = true;
+        mParent->mIdleMonitor->signal();
+    }
+}
+
+// Routes the PCM for the current mode if it changed since. setMode() only
+// flags the handles; the stream applies the mode with mLock held, before
+// its next transfer or from the idle monitor, whichever comes first.
+void ALSAStreamOps::applyMode()
+{
+    if (!(android_atomic_acquire_load(&mHandle->state) & ALSA_STATE_REROUTE))
+        return;
+
+    // Cleared before the mode is read: a switch from here on flags it again.
+    android_atomic_and(~ALSA_STATE_REROUTE, &mHandle->state);
+
+    int mode = mParent->mode();
+
+    if (mIdleDevices)
+        mIdleMode = mode;
+    else if (mHandle->handle)
+        mHandle->module->route(mHandle, mHandle->curDev, mode);
+}
+
+void ALSAStreamOps::releasePowerLock()
+{
+    if (mPowerLock) {
+        release_wake_lock (powerLockName(mHandle));
+        mPowerLock = false;
+    }
+}
+
+// Called by the idle monitor. Returns when the stream next needs a look,
+// or 0 if nothing is left to let go of.
+nsecs_t ALSAStreamOps::checkIdle(nsecs_t now, nsecs_t idleTime, nsecs_t holdTime)
+{
+    AutoMutex lock(mLock);
+
+    // A shared PCM rests with the mixer's device stream.
+    if (mShared) return 0;
+
+    applyMode();
+
+    nsecs_t quiet = now - mLastActive;
+    nsecs_t next = 0;
+
+    if (mPowerLock) {
+        if (quiet >= holdTime)
+            releasePowerLock();
+        else
+            next = mLastActive + holdTime;
+    }
+
+    if (idleTime && mHandle->handle) {
+        if (quiet >= idleTime) {
+            LOGD("Closing %s after %lld ms without data",
+                    snd_pcm_name(mHandle->handle), quiet / 1000000);
+            mIdleDevices = mHandle->curDev;
+            mIdleMode = mHandle->curMode;
+            mHandle->module->close(mHandle);
+        } else if (!next || mLastActive + idleTime < next)
+            next = mLastActive + idleTime;
+    }
+
+    return next;
 }
 
 void ALSAStreamOps::close()
 {
+    // The mixer's device stream closes a shared PCM.
+    if (mShared) return;
+
     mParent->mALSADevice->close(mHandle);
+
+    // The module may have kept the PCM open; the monitor closes it later.
+    mParent->mIdleMonitor->signal();
 }
 
 //
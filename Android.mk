@@ -20,7 +20,15 @@ ifeq ($(strip $(BOARD_USES_ALSA_AUDIO)),true)
 	AudioStreamInALSA.cpp \
 	ALSAStreamOps.cpp \
 	ALSAMixer.cpp \
-	ALSAControl.cpp
+	ALSAControl.cpp \
+	ALSARingBuffer.cpp \
+	ALSAAcousticsTee.cpp \
+	ALSASoftVolume.cpp \
+	ALSAConverter.cpp \
+	ALSAResampler.cpp \
+	ALSAOutputMixer.cpp \
+	ALSACaptureEngine.cpp \
+	ALSAIdleMonitor.cpp
 
   LOCAL_MODULE := libaudio
   LOCAL_MODULE_TAGS := optional
@@ -80,12 +88,37 @@ ifneq ($(ALSA_DEFAULT_SAMPLE_RATE),)
     LOCAL_CFLAGS += -DALSA_DEFAULT_SAMPLE_RATE=$(ALSA_DEFAULT_SAMPLE_RATE)
 endif
 
+ifeq ($(strip $(ALSA_PLAYBACK_MMAP)),true)
+    LOCAL_CFLAGS += -DALSA_PLAYBACK_MMAP
+endif
+
+ifeq ($(strip $(ALSA_CAPTURE_MMAP)),true)
+    LOCAL_CFLAGS += -DALSA_CAPTURE_MMAP
+endif
+
+ifeq ($(strip $(ALSA_PLAYBACK_TSCHED)),true)
+    LOCAL_CFLAGS += -DALSA_PLAYBACK_TSCHED
+endif
+
+ifeq ($(strip $(ALSA_PLAYBACK_NONBLOCK)),true)
+    LOCAL_CFLAGS += -DALSA_PLAYBACK_NONBLOCK
+endif
+
+ifneq ($(ALSA_PCM_POOL_SIZE),)
+    LOCAL_CFLAGS += -DALSA_PCM_POOL_SIZE=$(ALSA_PCM_POOL_SIZE)
+endif
+
+ifneq ($(ALSA_PARAMS_CACHE),)
+    LOCAL_CFLAGS += -DALSA_PARAMS_CACHE=\"$(ALSA_PARAMS_CACHE)\"
+endif
+
   LOCAL_C_INCLUDES += external/alsa-lib/include
 
   LOCAL_SRC_FILES:= alsa_default.cpp
 
   LOCAL_SHARED_LIBRARIES := \
   	libasound \
+  	libcutils \
   	liblog
 
   LOCAL_MODULE:= alsa.default
@@ -114,4 +147,44 @@ endif
 
   include $(BUILD_SHARED_LIBRARY)
 
+# Checks the SIMD kernels of the soft volume against the scalar ones
+
+  include $(CLEAR_VARS)
+
+  LOCAL_CFLAGS := -D_POSIX_SOURCE
+
+  LOCAL_C_INCLUDES += external/alsa-lib/include
+
+  LOCAL_SRC_FILES := tests/ALSASoftVolume_test.cpp
+
+  LOCAL_SHARED_LIBRARIES := \
+    libasound \
+    libcutils \
+    libutils
+
+  LOCAL_MODULE := alsa_softvolume_test
+  LOCAL_MODULE_TAGS := tests
+
+  include $(BUILD_NATIVE_TEST)
+
+# Checks the vector sample conversions against the scalar ones
+
+  include $(CLEAR_VARS)
+
+  LOCAL_CFLAGS := -D_POSIX_SOURCE
+
+  LOCAL_C_INCLUDES += external/alsa-lib/include
+
+  LOCAL_SRC_FILES := tests/ALSAConverter_test.cpp
+
+  LOCAL_SHARED_LIBRARIES := \
+    libasound \
+    libcutils \
+    libutils
+
+  LOCAL_MODULE := alsa_converter_test
+  LOCAL_MODULE_TAGS := tests
+
+  include $(BUILD_NATIVE_TEST)
+
 endif
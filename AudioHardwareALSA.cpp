@@ -27,6 +27,7 @@
 #include <utils/Log.h>
 #include <utils/String8.h>
 
+#include <cutils/atomic.h>
 #include <cutils/properties.h>
 #include <media/AudioRecord.h>
 #include <hardware_legacy/power.h>
@@ -72,6 +73,7 @@ AudioHardwareInterface *AudioHardwareALSA::create() {
 }
 
 AudioHardwareALSA::AudioHardwareALSA() :
+    mMasterVolume(1.0f),
     mALSADevice(0),
     mAcousticDevice(0)
 {
@@ -104,10 +106,14 @@ AudioHardwareALSA::AudioHardwareALSA() :
         else
             LOGE("Acoustics Module not found.");
     }
+
+    mIdleMonitor = new ALSAIdleMonitor(mALSADevice);
+    mIdleMonitor->run("ALSAIdleMonitor", PRIORITY_AUDIO);
 }
 
 AudioHardwareALSA::~AudioHardwareALSA()
 {
+    mIdleMonitor->stop();
     if (mMixer) delete mMixer;
     if (mALSADevice)
         mALSADevice->common.close(&mALSADevice->common);
@@ -134,10 +140,18 @@ status_t AudioHardwareALSA::setVoiceVolume(float volume)
 
 status_t AudioHardwareALSA::setMasterVolume(float volume)
 {
-    if (mMixer)
-        return mMixer->setMasterVolume(volume);
-    else
-        return INVALID_OPERATION;
+    status_t status = mMixer ? mMixer->setMasterVolume(volume)
+                             : (status_t)INVALID_OPERATION;
+
+    // Without a master volume control the output streams apply it in
+    // their software gain stage, which is cheaper than having AudioFlinger
+    // emulate it on every track.
+    if (status == INVALID_OPERATION) {
+        mMasterVolume = volume;
+        status = NO_ERROR;
+    }
+
+    return status;
 }
 
 status_t AudioHardwareALSA::setMode(int mode)
@@ -148,13 +162,15 @@ status_t AudioHardwareALSA::setMode(int mode)
         status = AudioHardwareBase::setMode(mode);
 
         if (status == NO_ERROR) {
-            // take care of mode change.
+            // Rerouting here would pull PCMs out from under transfers in
+            // progress. Flag the handles instead: streams apply the mode
+            // before their next transfer, and the idle monitor does it for
+            // the ones that are quiet (see ALSAStreamOps::applyMode()).
             for(ALSAHandleList::iterator it = mDeviceList.begin();
-                it != mDeviceList.end(); ++it) {
-                status = mALSADevice->route(&(*it), it->curDev, mode);
-                if (status != NO_ERROR)
-                    break;
-            }
+                it != mDeviceList.end(); ++it)
+                android_atomic_or(ALSA_STATE_REROUTE, &it->state);
+
+            mIdleMonitor->signal();
         }
     }
 
@@ -181,25 +197,162 @@ AudioHardwareALSA::openOutputStream(uint32_t devices,
         return out;
     }
 
-    // Find the appropriate alsa device
-    for(ALSAHandleList::iterator it = mDeviceList.begin();
-        it != mDeviceList.end(); ++it)
-        if (it->devices & devices) {
-            err = mALSADevice->open(&(*it), devices, mode());
-            if (err) break;
-            out = new AudioStreamOutALSA(this, &(*it));
+    // Find the appropriate alsa device. Streams start out on the default
+    // profile and may switch with the "profile" stream parameter.
+    alsa_handle_t *handle = findHandle(devices, ALSA_PROFILE_DEFAULT);
+    if (!handle) {
+        if (status) *status = err;
+        return out;
+    }
+
+    // Let an open in progress on this PCM finish, so that its stream is
+    // found below and shared.
+    while (android_atomic_acquire_load(&handle->state) & ALSA_STATE_BUSY)
+        mOpenCond.wait(mLock);
+
+    // Reopening the PCM would pull it out from under the stream already
+    // playing on it. Share it through a mixer instead.
+    AudioStreamOutALSA *playing = findOutput(handle);
+
+    if (playing) {
+        sp<ALSAOutputMixer> mixer = shareOutput(playing, &err);
+
+        if (mixer != 0) {
+            out = new AudioStreamOutALSA(this, handle);
+            out->mShared = true;
+            err = out->set(format, channels, sampleRate);
+            if (err == NO_ERROR) err = out->attachMixer(mixer);
+        }
+    } else {
+        // Opening and configuring the PCM is slow. Streams on other PCMs
+        // open meanwhile; opens of this one wait for it above.
+        android_atomic_or(ALSA_STATE_BUSY, &handle->state);
+        mLock.unlock();
+
+        err = mALSADevice->open(handle, devices, mode());
+        if (err == NO_ERROR) {
+            out = new AudioStreamOutALSA(this, handle);
             err = out->set(format, channels, sampleRate);
-            break;
         }
 
+        mLock.lock();
+        android_atomic_and(~ALSA_STATE_BUSY, &handle->state);
+        mOpenCond.broadcast();
+    }
+
+    if (out) {
+        mOutputs.push_back(out);
+        mIdleMonitor->add(out);
+    }
+
     if (status) *status = err;
     return out;
 }
 
+// The stream playing on a handle, preferring one that already is a track
+// of a mixer.
+AudioStreamOutALSA *AudioHardwareALSA::findOutput(alsa_handle_t *handle)
+{
+    AudioStreamOutALSA *playing = 0;
+
+    for(List<AudioStreamOutALSA *>::iterator it = mOutputs.begin();
+        it != mOutputs.end(); ++it)
+        if ((*it)->mHandle == handle && (!playing || (*it)->outputMixer() != 0))
+            playing = *it;
+
+    return playing;
+}
+
+// The mixer sharing the PCM a stream plays on. The first time round the
+// stream becomes its first track.
+sp<ALSAOutputMixer> AudioHardwareALSA::shareOutput(AudioStreamOutALSA *playing,
+        status_t *err)
+{
+    sp<ALSAOutputMixer> mixer = playing->outputMixer();
+
+    *err = NO_ERROR;
+    if (mixer != 0) return mixer;
+
+    // The mixer plays on the PCM as it is; bring it back if it was closed
+    // for idling.
+    playing->mLock.lock();
+    playing->resume();
+    playing->mLock.unlock();
+
+    mixer = new ALSAOutputMixer(this, playing->mHandle);
+    *err = playing->attachMixer(mixer);
+    if (*err != NO_ERROR) return 0;
+
+    mixer->run("ALSAOutputMixer", PRIORITY_URGENT_AUDIO);
+    return mixer;
+}
+
+// Moves an output stream to another profile of its route. The new PCM is
+// opened the way a stream open would: not while another open of it is in
+// progress, and not at all if a stream already plays on it, which the
+// stream then joins through the mixer.
+status_t AudioHardwareALSA::setOutputProfile(AudioStreamOutALSA *out, int profile)
+{
+    AutoMutex lock(mLock);
+
+    alsa_handle_t *current = out->mHandle;
+    if (profile == current->profile) return NO_ERROR;
+
+    // Other streams play on the same PCM.
+    if (out->mShared) return INVALID_OPERATION;
+
+    alsa_handle_t *handle = findHandle(current->devices, profile);
+    if (!handle) return BAD_VALUE;
+
+    // The ring and the client side of the stream stay as they are, so the
+    // profiles may only differ in their buffering.
+    if (handle->format != current->format ||
+        handle->channels != current->channels ||
+        handle->sampleRate != current->sampleRate)
+        return BAD_VALUE;
+
+    while (android_atomic_acquire_load(&handle->state) & ALSA_STATE_BUSY)
+        mOpenCond.wait(mLock);
+
+    status_t err;
+    AudioStreamOutALSA *playing = findOutput(handle);
+
+    if (playing) {
+        sp<ALSAOutputMixer> mixer = shareOutput(playing, &err);
+        if (mixer != 0) err = out->attachMixer(mixer, handle);
+    } else {
+        // Opens of either PCM wait until the stream has moved.
+        android_atomic_or(ALSA_STATE_BUSY, &current->state);
+        android_atomic_or(ALSA_STATE_BUSY, &handle->state);
+        mLock.unlock();
+
+        err = out->moveTo(handle);
+
+        mLock.lock();
+        android_atomic_and(~ALSA_STATE_BUSY, &current->state);
+        android_atomic_and(~ALSA_STATE_BUSY, &handle->state);
+        mOpenCond.broadcast();
+    }
+
+    if (playing && err == NO_ERROR)
+        LOGD("Output joined the streams mixed on profile %d", profile);
+
+    return err;
+}
+
 void
 AudioHardwareALSA::closeOutputStream(AudioStreamOut* out)
 {
     AutoMutex lock(mLock);
+
+    for(List<AudioStreamOutALSA *>::iterator it = mOutputs.begin();
+        it != mOutputs.end(); ++it)
+        if (*it == out) {
+            mOutputs.erase(it);
+            break;
+        }
+
+    mIdleMonitor->remove(static_cast<AudioStreamOutALSA *>(out));
     delete out;
 }
 
@@ -222,16 +375,76 @@ AudioHardwareALSA::openInputStream(uint32_t devices,
     }
 
     // Find the appropriate alsa device
+    alsa_handle_t *handle = 0;
+
     for(ALSAHandleList::iterator it = mDeviceList.begin();
         it != mDeviceList.end(); ++it)
         if (it->devices & devices) {
-            err = mALSADevice->open(&(*it), devices, mode());
-            if (err) break;
-            in = new AudioStreamInALSA(this, &(*it), acoustics);
-            err = in->set(format, channels, sampleRate);
+            handle = &(*it);
             break;
         }
 
+    if (!handle) {
+        if (status) *status = err;
+        return in;
+    }
+
+    // As for outputs, the PCM opens without holding up other streams.
+    while (android_atomic_acquire_load(&handle->state) & ALSA_STATE_BUSY)
+        mOpenCond.wait(mLock);
+
+    // Reopening the PCM would pull it out from under the stream already
+    // recording on it. Share it through a capture engine instead.
+    AudioStreamInALSA *recording = 0;
+
+    for(List<AudioStreamInALSA *>::iterator it = mInputs.begin();
+        it != mInputs.end(); ++it)
+        if ((*it)->mHandle == handle && (!recording || (*it)->captureEngine() != 0))
+            recording = *it;
+
+    if (recording) {
+        sp<ALSACaptureEngine> engine = recording->captureEngine();
+
+        if (engine == 0) {
+            // The engine captures from the PCM as it is; bring it back if
+            // it was closed for idling.
+            recording->mLock.lock();
+            recording->resume();
+            recording->mLock.unlock();
+
+            engine = new ALSACaptureEngine(this, handle, recording->mAcoustics);
+            err = recording->attachEngine(engine);
+            if (err == NO_ERROR)
+                engine->run("ALSACaptureEngine", PRIORITY_URGENT_AUDIO);
+        } else
+            err = NO_ERROR;
+
+        if (err == NO_ERROR) {
+            in = new AudioStreamInALSA(this, handle, acoustics);
+            in->mShared = true;
+            err = in->set(format, channels, sampleRate);
+            if (err == NO_ERROR) err = in->attachEngine(engine);
+        }
+    } else {
+        android_atomic_or(ALSA_STATE_BUSY, &handle->state);
+        mLock.unlock();
+
+        err = mALSADevice->open(handle, devices, mode());
+        if (err == NO_ERROR) {
+            in = new AudioStreamInALSA(this, handle, acoustics);
+            err = in->set(format, channels, sampleRate);
+        }
+
+        mLock.lock();
+        android_atomic_and(~ALSA_STATE_BUSY, &handle->state);
+        mOpenCond.broadcast();
+    }
+
+    if (in) {
+        mInputs.push_back(in);
+        mIdleMonitor->add(in);
+    }
+
     if (status) *status = err;
     return in;
 }
@@ -240,9 +453,28 @@ void
 AudioHardwareALSA::closeInputStream(AudioStreamIn* in)
 {
     AutoMutex lock(mLock);
+
+    for(List<AudioStreamInALSA *>::iterator it = mInputs.begin();
+        it != mInputs.end(); ++it)
+        if (*it == in) {
+            mInputs.erase(it);
+            break;
+        }
+
+    mIdleMonitor->remove(static_cast<AudioStreamInALSA *>(in));
     delete in;
 }
 
+alsa_handle_t *AudioHardwareALSA::findHandle(uint32_t devices, int profile)
+{
+    for(ALSAHandleList::iterator it = mDeviceList.begin();
+        it != mDeviceList.end(); ++it)
+        if ((it->devices & devices) && it->profile == profile)
+            return &(*it);
+
+    return 0;
+}
+
 status_t AudioHardwareALSA::setMicMute(bool state)
 {
     if (mMixer)
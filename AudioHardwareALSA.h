@@ -19,6 +19,7 @@
 #define ANDROID_AUDIO_HARDWARE_ALSA_H
 
 #include <utils/List.h>
+#include <utils/threads.h>
 #include <hardware_legacy/AudioHardwareBase.h>
 
 #include <alsa/asoundlib.h>
@@ -29,6 +30,8 @@ namespace android
 {
 
 class AudioHardwareALSA;
+class AudioStreamOutALSA;
+class AudioStreamInALSA;
 
 /**
  * The id of ALSA module
@@ -36,6 +39,127 @@ class AudioHardwareALSA;
 #define ALSA_HARDWARE_MODULE_ID "alsa"
 #define ALSA_HARDWARE_NAME      "alsa"
 
+/**
+ * Output profiles. Each profile is a separate alsa_handle_t in the device
+ * list, negotiated with its own buffer and period sizes.
+ */
+enum {
+    ALSA_PROFILE_DEFAULT = 0,
+    ALSA_PROFILE_LOW_LATENCY,
+    ALSA_PROFILE_DEEP_BUFFER,
+};
+
+/**
+ * Stream parameter key used to select the profile of an output stream,
+ * e.g. "profile=low_latency". Takes effect on the next write.
+ */
+#define ALSA_PARAMETER_PROFILE "profile"
+
+/**
+ * Client PCM formats beyond the ones AudioSystem::audio_format knows about.
+ * The values match the PCM sub formats later added to audio_format.
+ */
+#define ALSA_FORMAT_PCM_32_BIT      (AudioSystem::PCM | 0x3)
+#define ALSA_FORMAT_PCM_8_24_BIT    (AudioSystem::PCM | 0x4)
+#define ALSA_FORMAT_PCM_FLOAT       (AudioSystem::PCM | 0x5)
+
+/**
+ * Output channel mask used for a device channel count. Interleaved
+ * channels follow the order of the mask bits.
+ */
+static inline uint32_t alsa_channel_mask(unsigned int channels)
+{
+    switch(channels) {
+        case 1:     return AudioSystem::CHANNEL_OUT_MONO;
+        case 3:     return AudioSystem::CHANNEL_OUT_STEREO |
+                           AudioSystem::CHANNEL_OUT_FRONT_CENTER;
+        case 4:     return AudioSystem::CHANNEL_OUT_QUAD;
+        case 5:     return AudioSystem::CHANNEL_OUT_QUAD |
+                           AudioSystem::CHANNEL_OUT_FRONT_CENTER;
+        case 6:     return AudioSystem::CHANNEL_OUT_5POINT1;
+        case 7:     return AudioSystem::CHANNEL_OUT_5POINT1 |
+                           AudioSystem::CHANNEL_OUT_BACK_CENTER;
+        case 8:     return AudioSystem::CHANNEL_OUT_7POINT1;
+        default:    return AudioSystem::CHANNEL_OUT_STEREO;
+    }
+}
+
+#ifdef SND_CHMAP_API_VERSION
+/**
+ * ALSA channel map position of an AudioSystem output channel bit.
+ */
+static inline unsigned int alsa_chmap_position(uint32_t channel)
+{
+    switch(channel) {
+        case AudioSystem::CHANNEL_OUT_FRONT_LEFT:               return SND_CHMAP_FL;
+        case AudioSystem::CHANNEL_OUT_FRONT_RIGHT:              return SND_CHMAP_FR;
+        case AudioSystem::CHANNEL_OUT_FRONT_CENTER:             return SND_CHMAP_FC;
+        case AudioSystem::CHANNEL_OUT_LOW_FREQUENCY:            return SND_CHMAP_LFE;
+        case AudioSystem::CHANNEL_OUT_BACK_LEFT:                return SND_CHMAP_RL;
+        case AudioSystem::CHANNEL_OUT_BACK_RIGHT:               return SND_CHMAP_RR;
+        case AudioSystem::CHANNEL_OUT_FRONT_LEFT_OF_CENTER:     return SND_CHMAP_FLC;
+        case AudioSystem::CHANNEL_OUT_FRONT_RIGHT_OF_CENTER:    return SND_CHMAP_FRC;
+        case AudioSystem::CHANNEL_OUT_BACK_CENTER:              return SND_CHMAP_RC;
+        default:                                                return SND_CHMAP_UNKNOWN;
+    }
+}
+#endif
+
+/**
+ * Scales one sample in place. S24_LE keeps its sign in bit 23.
+ */
+static inline void alsa_scale_sample(char *p, snd_pcm_format_t format, float gain)
+{
+    switch (format) {
+        case SND_PCM_FORMAT_S8:
+            *(int8_t *)p = (int8_t)(*(int8_t *)p * gain);
+            break;
+        case SND_PCM_FORMAT_S16_LE:
+            *(int16_t *)p = (int16_t)(*(int16_t *)p * gain);
+            break;
+        case SND_PCM_FORMAT_S24_LE: {
+            int32_t s = (int32_t)((uint32_t)*(int32_t *)p << 8) >> 8;
+            *(int32_t *)p = (int32_t)(s * gain);
+            break;
+        }
+        case SND_PCM_FORMAT_S24_3LE: {
+            uint8_t *b = (uint8_t *)p;
+            int32_t s = (int32_t)((uint32_t)b[0] << 8 | (uint32_t)b[1] << 16 |
+                                  (uint32_t)b[2] << 24) >> 8;
+            s = (int32_t)(s * gain);
+            b[0] = (uint8_t)s;
+            b[1] = (uint8_t)(s >> 8);
+            b[2] = (uint8_t)(s >> 16);
+            break;
+        }
+        case SND_PCM_FORMAT_S32_LE:
+            *(int32_t *)p = (int32_t)(*(int32_t *)p * (double)gain);
+            break;
+        case SND_PCM_FORMAT_FLOAT_LE:
+            *(float *)p *= gain;
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Ramps the first frames of a block up from silence, or down into it.
+ */
+static inline void alsa_ramp_frames(void *data, snd_pcm_format_t format,
+        unsigned int channels, snd_pcm_uframes_t frames, bool up)
+{
+    size_t sampleBytes = snd_pcm_format_physical_width(format) / 8;
+
+    for (snd_pcm_uframes_t f = 0; f < frames; f++) {
+        float gain = (float)(up ? f + 1 : frames - f) / (frames + 1);
+
+        for (unsigned int c = 0; c < channels; c++)
+            alsa_scale_sample((char *)data + (f * channels + c) * sampleBytes,
+                    format, gain);
+    }
+}
+
 struct alsa_device_t;
 
 struct alsa_handle_t {
@@ -49,7 +173,22 @@ struct alsa_handle_t {
     uint32_t            sampleRate;
     unsigned int        latency;         // Delay in usec
     unsigned int        bufferSize;      // Size of sample buffer
+    snd_pcm_access_t    access;          // RW or MMAP interleaved transfers
+    unsigned int        periods;         // Desired number of periods per buffer
+    int                 profile;         // ALSA_PROFILE_*
+    bool                tsched;          // Timer scheduled, no period wakeups
+    bool                nonBlock;        // Opened with SND_PCM_NONBLOCK
+    uint32_t            generation;      // New on every open, unique across handles
     void *              modPrivate;
+    volatile int32_t    state;           // ALSA_STATE_*, see below
+};
+
+// Bits of alsa_handle_t::state, only changed with android_atomic_*() so
+// that neither the mode switch nor the stream opens need a stream lock.
+enum {
+    ALSA_STATE_BUSY     = 0x1,  // the PCM is being opened for a new stream
+    ALSA_STATE_REROUTE  = 0x2,  // the mode changed since the PCM was routed
+    ALSA_STATE_FADING   = 0x4,  // a stop left a fade playing out, see drop
 };
 
 typedef List<alsa_handle_t> ALSAHandleList;
@@ -62,6 +201,26 @@ struct alsa_device_t {
     status_t (*close)(alsa_handle_t *);
     status_t (*standby)(alsa_handle_t *);
     status_t (*route)(alsa_handle_t *, uint32_t, int);
+
+    // Optional. Stops the stream without waiting for the buffer to play
+    // out. Queued playback may instead be left fading out into silence,
+    // flagged ALSA_STATE_FADING; the stream drops it before its next
+    // transfer. Otherwise the stream is left ready for the next transfer.
+    status_t (*drop)(alsa_handle_t *);
+
+    // Optional. Closes PCMs the module kept open for reuse longer than the
+    // given age. Returns when the next one is due, on the systemTime()
+    // clock, or 0 if none is kept.
+    nsecs_t (*trim)(nsecs_t);
+
+    // Optional, both or neither. openNext opens a route on a second handle
+    // while the first keeps its PCM playing, for a crossfade. Only the
+    // route's own PCM will do: it fails rather than fall back to another
+    // or close PCMs to make room, and leaves nothing open when it does.
+    // The second handle is then closed with close, or its PCM put in place
+    // of the first's with takeover, which closes that one.
+    status_t (*openNext)(alsa_handle_t *, alsa_handle_t *, uint32_t, int);
+    status_t (*takeover)(alsa_handle_t *, alsa_handle_t *);
 };
 
 /**
@@ -84,11 +243,229 @@ struct acoustic_device_t {
     ssize_t (*write)(acoustic_device_t *, const void *, size_t);
     status_t (*recover)(acoustic_device_t *, int);
 
+    // Playback reference data, called from a HAL thread rather than the
+    // output path. Takes precedence over write when both are present. The
+    // position is the stream frame of the first frame in the block, the
+    // timestamp (CLOCK_MONOTONIC) is when the block reached the HAL.
+    ssize_t (*write_reference)(acoustic_device_t *, const void *, size_t,
+            uint64_t, const struct timespec *);
+
+    // Processes captured data, in the device format, from the first buffer
+    // into the second; they may be the same. With memory mapped capture the
+    // first is the DMA area itself, so the module reads straight from the
+    // hardware's buffer. Not called when read is present.
+    ssize_t (*process)(acoustic_device_t *, const void *, void *, size_t);
+
     void *              modPrivate;
 };
 
 // ----------------------------------------------------------------------------
 
+/**
+ * Lock-free byte ring with exactly one producer and one consumer thread.
+ * Positions are published with release stores and read with acquire loads,
+ * so neither side ever blocks the other.
+ */
+class ALSARingBuffer
+{
+public:
+    ALSARingBuffer(size_t size);
+    virtual                ~ALSARingBuffer();
+
+    bool                    isValid() const { return mBuffer != 0; }
+    size_t                  size() const { return mSize; }
+
+    // bytes ready for the consumer / free for the producer
+    size_t                  available() const;
+    size_t                  space() const;
+
+    // Producer side
+    size_t                  write(const void *data, size_t bytes);
+    size_t                  writeRegion(void **data) const;
+    void                    commitWrite(size_t bytes);
+
+    // Consumer side
+    size_t                  read(void *data, size_t bytes);
+    size_t                  readRegion(void **data) const;
+    void                    commitRead(size_t bytes);
+    void                    flush();
+
+private:
+    char *                  mBuffer;
+    size_t                  mSize;
+    volatile int32_t        mReadPos;
+    volatile int32_t        mWritePos;
+};
+
+/**
+ * Hands playback data to the acoustics module without blocking the output
+ * path: blocks are copied into a lock-free ring along with their stream
+ * position and timestamp, and consumed on a thread of their own.
+ */
+class ALSAAcousticsTee : public Thread
+{
+public:
+    ALSAAcousticsTee(acoustic_device_t *dev, size_t frameSize, size_t bufferSize);
+    virtual                ~ALSAAcousticsTee();
+
+    // Output path side; never blocks. Blocks that do not fit are dropped.
+    void                    publish(const void *buffer, size_t bytes);
+    void                    reset() { mPosition = 0; }
+
+    uint32_t                dropped() const { return mDropped; }
+
+    void                    stop();
+
+private:
+    struct block_t {
+        uint32_t            bytes;
+        uint64_t            position;
+        struct timespec     timestamp;
+    };
+
+    virtual bool            threadLoop();
+    bool                    waitFor(size_t bytes);
+
+    acoustic_device_t *     mDevice;
+    ALSARingBuffer          mRing;
+    size_t                  mFrameSize;
+    uint64_t                mPosition;
+    uint32_t                mDropped;
+
+    char *                  mScratch;
+    size_t                  mScratchSize;
+
+    Mutex                   mLock;
+    Condition               mCond;
+    volatile int32_t        mSleeping;
+};
+
+/**
+ * Software gain stage for routes without a hardware volume element. Gains
+ * are per channel, and a new gain is ramped in across the next buffer so
+ * volume changes do not click.
+ */
+class ALSASoftVolume
+{
+public:
+    enum ramp_t {
+        RAMP_LINEAR,
+        RAMP_EXPONENTIAL,
+    };
+
+    static const unsigned int MAX_CHANNELS = 8;
+
+    ALSASoftVolume(unsigned int channels);
+
+    void                    setChannels(unsigned int channels);
+    void                    setVolume(float left, float right);
+    void                    setChannelVolume(unsigned int channel, float volume);
+    void                    setMasterVolume(float volume);
+    void                    setRamp(ramp_t ramp);
+
+    // true when process() would leave the data untouched
+    bool                    isUnity();
+
+    // Scales S16_LE or FLOAT_LE frames from in to out (which may alias).
+    // S16 has no headroom, so gains above 1.0 are clamped to unity there;
+    // float is scaled as is.
+    status_t                process(const void *in, void *out, size_t frames,
+                                    snd_pcm_format_t format);
+
+private:
+    Mutex                   mLock;          // guards all below; process() works on a copy
+    unsigned int            mChannels;
+    ramp_t                  mRamp;
+    float                   mCurrent[MAX_CHANNELS];
+    float                   mTarget[MAX_CHANNELS];
+    float                   mMaster;
+};
+
+class ALSAConverter
+{
+public:
+    static const unsigned int MAX_CHANNELS = 8;
+
+    // Routing of input channels onto output channels, built by configure().
+    struct matrix_t {
+        unsigned int        inChannels;
+        unsigned int        outChannels;
+        int                 map[MAX_CHANNELS];      // input feeding each output, -1 for none
+        float               gain[MAX_CHANNELS][MAX_CHANNELS];   // [in][out]
+    };
+
+    ALSAConverter();
+
+    // S8, S16_LE, S24_LE, S24_3LE, S32_LE and FLOAT_LE in any combination.
+    static bool             isSupported(snd_pcm_format_t format);
+
+    // Format conversion only, both sides interleave the same channels.
+    status_t                configure(snd_pcm_format_t from, snd_pcm_format_t to,
+                                      unsigned int channels);
+
+    // Format conversion plus reordering and downmixing. A layout lists the
+    // AudioSystem::CHANNEL_OUT_* bit carried by each interleaved position.
+    status_t                configure(snd_pcm_format_t from, snd_pcm_format_t to,
+                                      const uint32_t *fromLayout, unsigned int fromChannels,
+                                      const uint32_t *toLayout, unsigned int toChannels);
+
+    bool                    isPassthrough() const { return !mKernel; }
+
+    // Converts frames from in to out, in one pass.
+    void                    convert(const void *in, void *out, size_t frames) const;
+
+private:
+    snd_pcm_format_t        mFrom;
+    snd_pcm_format_t        mTo;
+    uint32_t                mFromLayout[MAX_CHANNELS];
+    uint32_t                mToLayout[MAX_CHANNELS];
+    matrix_t                mMatrix;
+    void                  (*mKernel)(const matrix_t &, const void *, void *, size_t);
+};
+
+class ALSAResampler
+{
+public:
+    enum quality_t {
+        QUALITY_LOW,
+        QUALITY_MEDIUM,
+        QUALITY_HIGH,
+    };
+
+    ALSAResampler();
+    ~ALSAResampler();
+
+    // Cheap when nothing changed; equal rates make process() a copy.
+    status_t                configure(uint32_t inRate, uint32_t outRate,
+                                      unsigned int channels, quality_t quality);
+    bool                    isPassthrough() const { return mInRate == mOutRate; }
+    void                    reset();
+
+    // Upper bound on the frames process() makes from inFrames.
+    size_t                  outputFrames(size_t inFrames) const;
+
+    // Resamples interleaved float frames. Input is consumed in full as long
+    // as out has room for outputFrames(inFrames). Returns the frames written.
+    size_t                  process(const float *in, size_t inFrames,
+                                    float *out, size_t outFrames);
+
+private:
+    uint32_t                mInRate;
+    uint32_t                mOutRate;
+    unsigned int            mChannels;
+    quality_t               mQuality;
+
+    unsigned int            mTaps;
+    unsigned int            mPhases;
+    float *                 mCoefs;         // (mPhases + 1) rows of mTaps
+
+    float *                 mHistory;       // planar, mCapacity frames per channel
+    size_t                  mCapacity;
+    size_t                  mFill;
+    size_t                  mIndex;         // input frame under the next output
+    uint32_t                mRemainder;     // and how far past it, in 1/mOutRate
+};
+
 class ALSAMixer
 {
 public:
@@ -147,15 +524,226 @@ public:
 
 protected:
     friend class AudioHardwareALSA;
+    friend class ALSAIdleMonitor;
 
     acoustic_device_t *acoustics();
     ALSAMixer *mixer();
 
+    // Frame size of the client format; the device may use another one.
+    size_t              frameSize() const;
+
+    // Scratch space for data in the other format of the two; 0 if the
+    // allocation fails.
+    void *              convertBuffer(size_t bytes);
+
+    // Channel bit of each interleaved position, client and device side.
+    // Both return the channel count.
+    unsigned int        clientLayout(uint32_t *layout) const;
+    unsigned int        deviceLayout(uint32_t *layout);
+
+    // Rate the device was actually opened at.
+    uint32_t            deviceRate() const;
+
+    // Idle handling, see ALSAIdleMonitor. resume() runs with mLock held
+    // before data moves: it reopens a PCM closed for idling and takes the
+    // wake lock.
+    void                resume();
+    void                applyMode();
+    void                releasePowerLock();
+    nsecs_t             checkIdle(nsecs_t now, nsecs_t idleTime, nsecs_t holdTime);
+
     AudioHardwareALSA *     mParent;
     alsa_handle_t *         mHandle;
 
     Mutex                   mLock;
     bool                    mPowerLock;
+    bool                    mShared;        // the PCM belongs to an ALSAOutputMixer
+    nsecs_t                 mLastActive;    // last time data moved
+    uint32_t                mIdleDevices;   // route to reopen after an idle close, or 0
+    int                     mIdleMode;
+
+    snd_pcm_format_t        mFormat;        // client format
+    uint32_t                mChannels;      // client channel mask
+    uint32_t                mSampleRate;    // client rate
+    ALSAConverter           mConverter;
+    char *                  mConvertBuffer;
+    size_t                  mConvertBufferSize;
+
+    uint32_t                mLayoutGeneration;  // open mDeviceLayout was read from
+    unsigned int            mLayoutChannels;
+    uint32_t                mDeviceLayout[ALSAConverter::MAX_CHANNELS];
+};
+
+/**
+ * Puts streams that stopped moving data to rest without waiting for
+ * AudioFlinger: the wake lock goes a little after the last write or read,
+ * the PCM some time later. The next write or read brings both back.
+ */
+class ALSAIdleMonitor : public Thread
+{
+public:
+    ALSAIdleMonitor(alsa_device_t *device);
+    virtual                ~ALSAIdleMonitor();
+
+    void                    add(ALSAStreamOps *stream);
+    void                    remove(ALSAStreamOps *stream);
+
+    // How long the wake lock outlives activity; 0 if standby releases it.
+    nsecs_t                 holdTime() const { return mHoldTime; }
+
+    // A stream became active, so its deadlines moved.
+    void                    signal();
+    void                    stop();
+
+private:
+    virtual bool            threadLoop();
+
+    alsa_device_t *         mDevice;
+    nsecs_t                 mIdleTime;
+    nsecs_t                 mHoldTime;
+    nsecs_t                 mPoolTime;
+
+    Mutex                   mLock;
+    Condition               mCond;
+    Condition               mScanCond;
+    Vector<ALSAStreamOps *> mStreams;
+    bool                    mScanning;      // checking streams without mLock
+    bool                    mPending;       // something changed since the scan began
+};
+
+// ----------------------------------------------------------------------------
+
+/**
+ * Shares one playback PCM between several output streams. Each stream (a
+ * track) queues device frames into its own ring after its own gain; the
+ * mixer thread sums them with saturation and plays the mix through a
+ * private raw stream, which owns the PCM.
+ */
+class ALSAOutputMixer : public Thread
+{
+public:
+    ALSAOutputMixer(AudioHardwareALSA *parent, alsa_handle_t *handle);
+    virtual                ~ALSAOutputMixer();
+
+    AudioStreamOutALSA *    device() { return mDevice; }
+
+    // Ring size a track needs to keep the mixer fed.
+    size_t                  trackBufferSize() const;
+    nsecs_t                 periodNs() const { return mPeriodNs; }
+
+    void                    addTrack(AudioStreamOutALSA *track);
+    size_t                  removeTrack(AudioStreamOutALSA *track);     // tracks left
+
+    // Fades out what a track has queued and drops the rest.
+    void                    flush(AudioStreamOutALSA *track);
+
+    // Device frames of a track that have reached the DAC.
+    status_t                position(AudioStreamOutALSA *track, uint64_t *frames,
+                                     struct timespec *timestamp);
+
+    // A track queued data.
+    void                    signal();
+    void                    stop();
+
+private:
+    struct track_t {
+        AudioStreamOutALSA *stream;
+        bool                active;     // playing; running dry is an underrun
+        bool                mixed;      // in the mix being written
+        uint64_t            frames;     // device frames mixed since standby
+        uint64_t            deviceEnd;  // mDeviceFrames after its last one
+        char *              fade;       // queued frames ramped down by flush()
+        size_t              fadeFrames; // left to mix from fade
+        size_t              fadePos;
+    };
+
+    virtual bool            threadLoop();
+    track_t *               findTrack(AudioStreamOutALSA *stream);
+    size_t                  readyFrames(bool *playing);
+
+    AudioStreamOutALSA *    mDevice;
+    alsa_handle_t *         mHandle;
+    size_t                  mFrameSize;
+    snd_pcm_uframes_t       mPeriodFrames;
+    nsecs_t                 mPeriodNs;
+    size_t                  mFadeFrames;
+
+    // mixer thread only
+    nsecs_t                 mIdleSince;
+    nsecs_t                 mShortSince;    // a playing track ran dry
+    bool                    mStandby;
+    char *                  mMix;
+    char *                  mScratch;
+
+    Mutex                   mLock;          // guards the tracks and their ring consumers
+    Condition               mCond;
+    Vector<track_t>         mTracks;
+    uint64_t                mDeviceFrames;  // written to mDevice since standby
+};
+
+// ----------------------------------------------------------------------------
+
+/**
+ * Shares one capture PCM between several input streams. A private stream
+ * owns the PCM and the engine thread reads it once, converting each period
+ * into one ring (a lane) per client format. Every client reads its lane
+ * through a cursor of its own; one that falls behind by more than the ring
+ * loses the oldest frames.
+ */
+class ALSACaptureEngine : public Thread
+{
+public:
+    ALSACaptureEngine(AudioHardwareALSA *parent, alsa_handle_t *handle,
+                      AudioSystem::audio_in_acoustics acoustics);
+    virtual                ~ALSACaptureEngine();
+
+    AudioStreamInALSA *     device() { return mDevice; }
+
+    status_t                addClient(AudioStreamInALSA *stream);
+    size_t                  removeClient(AudioStreamInALSA *stream);    // clients left
+
+    ssize_t                 read(AudioStreamInALSA *stream, void *buffer, size_t bytes);
+    void                    standby(AudioStreamInALSA *stream);
+    void                    stop();
+
+private:
+    struct lane_t {
+        snd_pcm_format_t    format;
+        uint32_t            rate;
+        unsigned int        channels;
+        size_t              frameSize;
+        char *              buffer;         // mRingFrames frames
+        ALSAConverter       converter;
+        int                 clients;
+    };
+
+    struct client_t {
+        AudioStreamInALSA * stream;
+        lane_t *            lane;
+        uint64_t            cursor;         // next frame to read, in mWritePos terms
+        bool                active;         // reading, not in standby
+    };
+
+    virtual bool            threadLoop();
+    client_t *              findClient(AudioStreamInALSA *stream);
+
+    AudioStreamInALSA *     mDevice;
+    alsa_handle_t *         mHandle;
+    size_t                  mFrameSize;
+    snd_pcm_uframes_t       mPeriodFrames;
+    size_t                  mRingFrames;
+    nsecs_t                 mPeriodNs;
+
+    // engine thread only
+    char *                  mCapture;       // one period in the device format
+    bool                    mStandby;
+
+    Mutex                   mLock;          // guards the lanes, the clients and mWritePos
+    Condition               mCond;
+    bool                    mExiting;
+    uint64_t                mWritePos;      // frames captured into the lanes
+    Vector<lane_t *>        mLanes;
+    Vector<client_t *>      mClients;
 };
 
 // ----------------------------------------------------------------------------
@@ -166,6 +754,8 @@ public:
     AudioStreamOutALSA(AudioHardwareALSA *parent, alsa_handle_t *handle);
     virtual            ~AudioStreamOutALSA();
 
+    status_t            set(int *format, uint32_t *channels, uint32_t *rate);
+
     virtual uint32_t    sampleRate() const
     {
         return ALSAStreamOps::sampleRate();
@@ -192,23 +782,159 @@ public:
 
     virtual status_t    standby();
 
-    virtual status_t    setParameters(const String8& keyValuePairs) {
-        return ALSAStreamOps::setParameters(keyValuePairs);
-    }
-
-    virtual String8     getParameters(const String8& keys) {
-        return ALSAStreamOps::getParameters(keys);
-    }
+    virtual status_t    setParameters(const String8& keyValuePairs);
+    virtual String8     getParameters(const String8& keys);
 
     // return the number of audio frames written by the audio dsp to DAC since
     // the output has exited standby
     virtual status_t    getRenderPosition(uint32_t *dspFrames);
 
+    // return the number of frames presented to the DAC since the output has
+    // exited standby, and the CLOCK_MONOTONIC time at which that was true
+    status_t            getPresentationPosition(uint64_t *frames,
+                                                struct timespec *timestamp);
+
     status_t            open(int mode);
     status_t            close();
 
 private:
-    uint32_t            mFrameCount;
+    // Feeds ALSA from mRing when the stream runs in decoupled mode.
+    class WriterThread : public Thread
+    {
+    public:
+        WriterThread(AudioStreamOutALSA *out) : Thread(false), mOut(out) {}
+
+    private:
+        virtual bool    threadLoop() { return mOut->writerLoop(); }
+
+        AudioStreamOutALSA *mOut;
+    };
+
+    friend class AudioHardwareALSA;
+    friend class ALSAOutputMixer;
+
+    // What write() converts to. Read from the PCM with mLock held and
+    // published under mConfigLock, so that a decoupled write() converts
+    // without touching a PCM the writer thread may be reopening.
+    struct device_config_t {
+        snd_pcm_format_t    format;
+        unsigned int        channels;
+        uint32_t            rate;
+        snd_pcm_uframes_t   periodSize;
+        uint32_t            layout[ALSAConverter::MAX_CHANNELS];
+
+        size_t frameSize() const
+        {
+            return snd_pcm_format_physical_width(format) / 8 * channels;
+        }
+    };
+
+    status_t            attachMixer(const sp<ALSAOutputMixer>& mixer,
+                                    alsa_handle_t *handle = 0);
+    sp<ALSAOutputMixer> outputMixer();
+    void                publishDeviceConfig();
+    void                deviceConfig(device_config_t *config);
+    const void *        convertFrames(const void *buffer, size_t frames,
+                                      const device_config_t& device,
+                                      size_t *deviceFrames);
+    ssize_t             writeFrames(const void *buffer, size_t bytes);
+    ssize_t             writeBacklog();
+    bool                keepBacklog(const void *buffer, size_t bytes);
+    ssize_t             queueFrames(const void *buffer, size_t bytes);
+    bool                writerLoop();
+    void                stopWriter();
+    void                drainRing();
+    status_t            presentationPosition(uint64_t *frames,
+                                             struct timespec *timestamp);
+    status_t            setProfile(int profile);
+    status_t            moveTo(alsa_handle_t *handle);
+    status_t            crossfadeRoute(uint32_t devices, int mode);
+    void                keepTail(const void *buffer, size_t bytes);
+    snd_pcm_uframes_t   keptFrames();
+    void                copyKept(char *data, snd_pcm_uframes_t frames);
+    void                fadeQueued();
+    void                stopPlayback();
+    void                applyStartPolicy();
+    void                prefill();
+    void                scheduleStart(snd_pcm_uframes_t frames, nsecs_t deadline);
+    snd_pcm_sframes_t   tschedWait(snd_pcm_uframes_t frames, nsecs_t deadline);
+    nsecs_t             writeTimeout() const;
+    void                updateClock(snd_pcm_uframes_t queued, nsecs_t now);
+
+    uint64_t            mFrameCount;    // frames handed to ALSA; the mixer counts a track's
+    nsecs_t             mWriteTimeout;  // 0 picks one from the latency
+    bool                mReopenPending;
+    bool                mDrainOnStop;   // standby and close play out the buffer
+
+    // The last buffer's worth of frames written to a read/write PCM, which
+    // a crossfaded route switch replays on the new device and a stop fades
+    // out. Memory mapped PCMs still have them in the DMA area.
+    bool                mCrossfade;
+    char *              mTail;
+    size_t              mTailSize;
+    size_t              mTailPos;
+    size_t              mTailFill;
+
+    // How a stopped PCM starts, read per profile from alsa.playback.start.*
+    // whenever a new PCM is opened.
+    enum {
+        START_FULL,         // once the buffer is full
+        START_PERIODS,      // once mStartArg periods are queued
+        START_PREFILL,      // at once, behind mStartArg ms of silence
+        START_SCHEDULED,    // mStartArg ms after the first write
+    };
+
+    int                 mStartPolicy;
+    unsigned int        mStartArg;
+    uint32_t            mStartGeneration;   // open the policy was applied to
+    snd_pcm_uframes_t   mStartThreshold;
+    nsecs_t             mStartAt;       // pending scheduled start, or 0
+
+    // hardware clock estimate for timer based scheduling
+    float               mHwRate;
+    nsecs_t             mClockTime;
+    uint64_t            mClockFrames;
+
+    sp<ALSAAcousticsTee> mTee;
+
+    ALSASoftVolume      mVolume;
+    char *              mVolumeBuffer;
+    size_t              mVolumeBufferSize;
+
+    // used when the device runs at another rate than the client
+    ALSAResampler       mResampler;
+    ALSAResampler::quality_t mResampleQuality;
+    ALSAConverter       mDeviceConverter;
+    float *             mResampleBuffer;
+    size_t              mResampleBufferSize;
+
+    // Device frames a short write left over. The volume ramp and resampler
+    // had already taken the whole input, so they go out ahead of the next.
+    char *              mBacklog;
+    size_t              mBacklogSize;
+    size_t              mBacklogFill;
+
+    Mutex               mConfigLock;
+    device_config_t     mDeviceConfig;
+
+    // A mixed stream (a track) feeds mMixer through mRing; mRaw marks the
+    // mixer's own stream, which writes the mix as is.
+    sp<ALSAOutputMixer> mMixer;
+    bool                mRaw;
+
+    // mMixer, mRing and mWriter change under mRingLock, mRing also under
+    // mLock; once set, mRing stays for the life of the stream.
+    ALSARingBuffer *    mRing;
+    sp<WriterThread>    mWriter;
+    Mutex               mRingLock;
+    Condition           mDataCond;
+    Condition           mSpaceCond;
+    nsecs_t             mPeriodNs;
+
+    // ring statistics, see dump()
+    size_t              mRingHighWater;
+    uint32_t            mRingFullWaits;
+    uint32_t            mRingEmptyWaits;
 };
 
 class AudioStreamInALSA : public AudioStreamIn, public ALSAStreamOps
@@ -246,10 +972,7 @@ public:
 
     virtual status_t    standby();
 
-    virtual status_t    setParameters(const String8& keyValuePairs)
-    {
-        return ALSAStreamOps::setParameters(keyValuePairs);
-    }
+    virtual status_t    setParameters(const String8& keyValuePairs);
 
     virtual String8     getParameters(const String8& keys)
     {
@@ -264,13 +987,67 @@ public:
 
     status_t            setAcousticParams(void* params);
 
+    // return the number of frames read by the client since the input has
+    // exited standby, and the CLOCK_MONOTONIC time at which the next frame
+    // to be read was captured
+    status_t            getCapturePosition(uint64_t *frames,
+                                           struct timespec *timestamp);
+
     status_t            open(int mode);
     status_t            close();
 
 private:
-    void                resetFramesLost();
+    // Drains ALSA into mRing when the stream runs in decoupled mode.
+    class ReaderThread : public Thread
+    {
+    public:
+        ReaderThread(AudioStreamInALSA *in) : Thread(false), mIn(in) {}
+
+    private:
+        virtual bool    threadLoop() { return mIn->readerLoop(); }
+
+        AudioStreamInALSA *mIn;
+    };
 
-    unsigned int        mFramesLost;
+    friend class AudioHardwareALSA;
+    friend class ALSACaptureEngine;
+
+    status_t            attachEngine(const sp<ALSACaptureEngine>& engine);
+    unsigned int        resetFramesLost();     // the count it cleared
+    ssize_t             readFrames(void *buffer, ssize_t bytes);
+    ssize_t             readRing(void *buffer, size_t bytes);
+    snd_pcm_sframes_t   mmapRead(void *buffer, snd_pcm_uframes_t frames, bool convert,
+                                 nsecs_t deadline);
+    void                countOverrun();
+    nsecs_t             readTimeout() const;
+    bool                readerLoop();
+    void                stopReader();
+    sp<ALSACaptureEngine> captureEngine();
+
+    // Capture ring, filled by mReader and emptied by read(); the stamp
+    // gives the capture time of the ring frame at mStampFrames.
+    ALSARingBuffer *    mRing;
+    sp<ReaderThread>    mReader;
+    char *              mReadBuffer;    // one period, in the client format
+    size_t              mReadBufferSize;
+    Mutex               mRingLock;      // guards the waits and the stamp
+    Condition           mDataCond;
+    nsecs_t             mPeriodNs;
+    uint64_t            mRingFrames;    // frames put in the ring
+    uint64_t            mReadFrames;    // frames read out of it
+    uint64_t            mStampFrames;
+    nsecs_t             mStampTime;
+
+    // Set when the PCM is shared with other input streams; read() then
+    // takes frames from the engine, which owns the PCM. Changes under
+    // mLock and mRingLock; mReader changes under mRingLock.
+    sp<ALSACaptureEngine> mEngine;
+
+    nsecs_t             mReadTimeout;   // 0 picks one from the latency
+
+    // Counted by the reader and the capture engine under their own locks,
+    // so only changed with android_atomic_*().
+    volatile int32_t    mFramesLost;
     AudioSystem::audio_in_acoustics mAcoustics;
 };
 
@@ -344,22 +1121,39 @@ public:
         return mMode;
     }
 
+    alsa_handle_t *     findHandle(uint32_t devices, int profile);
+
 protected:
     virtual status_t    dump(int fd, const Vector<String16>& args);
 
     friend class AudioStreamOutALSA;
     friend class AudioStreamInALSA;
     friend class ALSAStreamOps;
+    friend class ALSAOutputMixer;
+    friend class ALSACaptureEngine;
 
     ALSAMixer *         mMixer;
+    float               mMasterVolume;  // applied in software, see setMasterVolume()
 
     alsa_device_t *     mALSADevice;
     acoustic_device_t * mAcousticDevice;
 
     ALSAHandleList      mDeviceList;
 
+    // Open streams, to find the one already playing or recording on a PCM.
+    List<AudioStreamOutALSA *> mOutputs;
+    List<AudioStreamInALSA *> mInputs;
+
+    sp<ALSAIdleMonitor> mIdleMonitor;
+
 private:
+    // Output sharing and profile switches; called with mLock held.
+    AudioStreamOutALSA *findOutput(alsa_handle_t *handle);
+    sp<ALSAOutputMixer> shareOutput(AudioStreamOutALSA *playing, status_t *err);
+    status_t            setOutputProfile(AudioStreamOutALSA *out, int profile);
+
     Mutex               mLock;
+    Condition           mOpenCond;      // a handle is no longer ALSA_STATE_BUSY
 };
 
 // ----------------------------------------------------------------------------
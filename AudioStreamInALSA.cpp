@@ -20,13 +20,16 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <dlfcn.h>
+#include <time.h>
 
 #define LOG_TAG "AudioHardwareALSA"
 #include <utils/Log.h>
 #include <utils/String8.h>
 
+#include <cutils/atomic.h>
 #include <cutils/properties.h>
 #include <media/AudioRecord.h>
 #include <hardware_legacy/power.h>
@@ -40,9 +43,40 @@ AudioStreamInALSA::AudioStreamInALSA(AudioHardwareALSA *parent,
         alsa_handle_t *handle,
         AudioSystem::audio_in_acoustics audio_acoustics) :
     ALSAStreamOps(parent, handle),
+    mRing(0),
+    mReadBuffer(0),
+    mReadBufferSize(0),
+    mPeriodNs(0),
+    mRingFrames(0),
+    mReadFrames(0),
+    mStampFrames(0),
+    mStampTime(0),
+    mReadTimeout(0),
     mFramesLost(0),
     mAcoustics(audio_acoustics)
 {
+    char value[PROPERTY_VALUE_MAX];
+
+    // A non zero ring depth decouples read() from the PCM: a HAL thread
+    // drains ALSA into mRing and handles recovery, and the caller only
+    // copies out of it.
+    property_get("alsa.capture.ring_ms", value, "0");
+    unsigned int ms = atoi(value);
+
+    if (ms) {
+        mRing = new ALSARingBuffer(ms * mHandle->sampleRate / 1000 * frameSize());
+        if (!mRing->isValid()) {
+            delete mRing;
+            mRing = 0;
+        }
+    }
+
+    // How long read() may gather frames from a device that delivers them
+    // in bits before returning what it has; 0 derives it from the buffer
+    // latency, see readTimeout().
+    property_get("alsa.capture.read_timeout_ms", value, "0");
+    mReadTimeout = (nsecs_t)atoi(value) * 1000000;
+
     acoustic_device_t *aDev = acoustics();
 
     if (aDev) aDev->set_params(aDev, mAcoustics, NULL);
@@ -51,6 +85,8 @@ AudioStreamInALSA::AudioStreamInALSA(AudioHardwareALSA *parent,
 AudioStreamInALSA::~AudioStreamInALSA()
 {
     close();
+    delete mRing;
+    free(mReadBuffer);
 }
 
 status_t AudioStreamInALSA::setGain(float gain)
@@ -60,13 +96,33 @@ status_t AudioStreamInALSA::setGain(float gain)
 
 ssize_t AudioStreamInALSA::read(void *buffer, ssize_t bytes)
 {
-    AutoMutex lock(mLock);
+    sp<ALSACaptureEngine> engine = captureEngine();
+
+    if (engine != 0) return engine->read(this, buffer, bytes);
+
+    // In decoupled mode the reader thread holds mLock while it talks to
+    // ALSA, so the caller only touches the ring and never waits for it.
+    if (mRing) return readRing(buffer, bytes);
+
+    {
+        AutoMutex lock(mLock);
+
+        // attachEngine() may hand the PCM to an engine while we wait for
+        // the lock.
+        if (mEngine == 0) return readFrames(buffer, bytes);
 
-    if (!mPowerLock) {
-        acquire_wake_lock (PARTIAL_WAKE_LOCK, "AudioInLock");
-        mPowerLock = true;
+        engine = mEngine;
     }
 
+    return engine->read(this, buffer, bytes);
+}
+
+ssize_t AudioStreamInALSA::readFrames(void *buffer, ssize_t bytes)
+{
+    resume();
+
+    if (!mHandle->handle) return static_cast<ssize_t>(NO_INIT);
+
     acoustic_device_t *aDev = acoustics();
 
     // If there is an acoustics module read method, then it overrides this
@@ -74,25 +130,387 @@ ssize_t AudioStreamInALSA::read(void *buffer, ssize_t bytes)
     if (aDev && aDev->read)
         return aDev->read(aDev, buffer, bytes);
 
-    snd_pcm_sframes_t n, frames = snd_pcm_bytes_to_frames(mHandle->handle, bytes);
-    status_t          err;
+    snd_pcm_t *       pcm = mHandle->handle;
+    snd_pcm_sframes_t n, frames = bytes / frameSize();
+    snd_pcm_sframes_t got = 0;
+    int               err = 0;
+    void *            data = buffer;
+
+    // Capture in the device format and convert into the caller's buffer.
+    bool convert = mConverter.configure(mHandle->format, mFormat, mHandle->channels) == NO_ERROR &&
+                   !mConverter.isPassthrough();
+
+    // Memory mapped capture converts (or processes) straight out of the DMA
+    // area, so only read/write capture needs the buffer in between.
+    bool mmap = mHandle->access == SND_PCM_ACCESS_MMAP_INTERLEAVED;
+
+    if (convert && !mmap) {
+        data = convertBuffer(snd_pcm_frames_to_bytes(pcm, frames));
+        if (!data) return NO_MEMORY;
+    }
+
+    // A misbehaving driver must not hold the caller for longer than this.
+    // Whatever was read by then is returned as a short read.
+    nsecs_t deadline = systemTime() + readTimeout();
+
+    // Gather until the request is complete. Partial reads keep what they
+    // read, and an overrun only costs the frames the device could not
+    // hold; the stream restarts and the read carries on.
+    while (got < frames) {
+        if (mmap)
+            n = mmapRead((char *)buffer + got * frameSize(), frames - got,
+                    convert, deadline);
+        else
+            n = snd_pcm_readi(pcm, (char *)data + snd_pcm_frames_to_bytes(pcm, got),
+                    frames - got);
+
+        if (n > 0) {
+            got += n;
+            continue;
+        }
+
+        if (n == 0 || n == -EAGAIN) {
+            // Nothing captured yet on a non-blocking PCM.
+            nsecs_t left = deadline - systemTime();
+            if (left <= 0) break;
+            snd_pcm_wait(pcm, (int)((left + 999999) / 1000000));
+            continue;
+        }
+
+        if (n == -EPIPE) {
+            // The device stopped on a full buffer, so all of it is intact.
+            // Mapped access can still take it out before recovery drops it.
+            if (mmap) {
+                snd_pcm_sframes_t saved = mmapRead((char *)buffer + got * frameSize(),
+                        frames - got, convert, 0);
+                if (saved > 0) got += saved;
+            }
+            countOverrun();
+        }
+
+        err = snd_pcm_recover(pcm, n, 0);
+
+        if (aDev && aDev->recover) aDev->recover(aDev, err);
+
+        if (err < 0) {
+            LOGE("Unable to recover capture on %s: %s", snd_pcm_name(pcm),
+                    snd_strerror(err));
+            break;
+        }
+
+        if (systemTime() >= deadline) break;
+    }
+
+    if (!got) return static_cast<ssize_t>(err < 0 ? err : 0);
+
+    if (!mmap) {
+        if (aDev && aDev->process)
+            aDev->process(aDev, data, data, snd_pcm_frames_to_bytes(pcm, got));
+
+        if (convert) mConverter.convert(data, buffer, got);
+    }
+
+    return static_cast<ssize_t>(got * frameSize());
+}
+
+nsecs_t AudioStreamInALSA::readTimeout() const
+{
+    if (mReadTimeout) return mReadTimeout;
+
+    // A healthy device fills the whole buffer within one buffer time.
+    nsecs_t timeout = (nsecs_t)mHandle->latency * 2000;
+    return timeout > 50000000 ? timeout : 50000000;
+}
+
+// Takes captured frames straight out of the DMA buffer of a memory mapped
+// PCM into the caller's buffer, converting them in the same pass. Behaves
+// like snd_pcm_readi(), waiting no later than the deadline: returns the
+// number of frames read, or a negative error code if nothing could be
+// read. A zero deadline takes only what the buffer holds, without starting
+// or waiting, which also works on a stream an overrun stopped.
+snd_pcm_sframes_t AudioStreamInALSA::mmapRead(void *buffer,
+        snd_pcm_uframes_t frames, bool convert, nsecs_t deadline)
+{
+    snd_pcm_t *pcm = mHandle->handle;
+    acoustic_device_t *aDev = acoustics();
+    bool process = aDev && aDev->process;
+    ssize_t frameBytes = snd_pcm_frames_to_bytes(pcm, 1);
+    snd_pcm_uframes_t done = 0;
+    void *scratch = 0;
+    int err;
+
+    // Processed data still needs converting; that takes one buffer between.
+    if (process && convert) {
+        scratch = convertBuffer(frames * frameBytes);
+        if (!scratch) return NO_MEMORY;
+    }
+
+    // Unlike snd_pcm_readi(), mapped access does not start the stream.
+    if (deadline && snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED) {
+        err = snd_pcm_start(pcm);
+        if (err < 0) return err;
+    }
+
+    while (done < frames) {
+        snd_pcm_sframes_t avail = deadline ? snd_pcm_avail_update(pcm) : 1;
+        if (avail < 0) return done ? (snd_pcm_sframes_t)done : avail;
+
+        if (avail == 0) {
+            nsecs_t left = deadline - systemTime();
+            if (mHandle->nonBlock || left <= 0)
+                return done ? (snd_pcm_sframes_t)done : -EAGAIN;
+            err = snd_pcm_wait(pcm, (int)((left + 999999) / 1000000));
+            if (err < 0) return done ? (snd_pcm_sframes_t)done : err;
+            continue;
+        }
+
+        const snd_pcm_channel_area_t *areas;
+        snd_pcm_uframes_t offset;
+        snd_pcm_uframes_t chunk = frames - done;
+
+        err = snd_pcm_mmap_begin(pcm, &areas, &offset, &chunk);
+        if (err < 0) return done ? (snd_pcm_sframes_t)done : err;
+        if (!chunk) break;
+
+        // Interleaved access; every channel shares the first area.
+        const char *src = (const char *)areas[0].addr
+                + (areas[0].first + offset * areas[0].step) / 8;
+        char *dst = (char *)buffer + done * frameSize();
+
+        if (process && convert) {
+            aDev->process(aDev, src, scratch, chunk * frameBytes);
+            mConverter.convert(scratch, dst, chunk);
+        } else if (process)
+            aDev->process(aDev, src, dst, chunk * frameBytes);
+        else if (convert)
+            mConverter.convert(src, dst, chunk);
+        else
+            memcpy(dst, src, chunk * frameBytes);
+
+        snd_pcm_sframes_t n = snd_pcm_mmap_commit(pcm, offset, chunk);
+        if (n < 0) return done ? (snd_pcm_sframes_t)done : n;
+        done += n;
+    }
+
+    return done;
+}
+
+// Adds what an overrun threw away to mFramesLost: the frames left unread in
+// the buffer, which recovering discards, and those the device went on
+// capturing while the stream was stopped. Call before recovering.
+void AudioStreamInALSA::countOverrun()
+{
+    snd_pcm_status_t *status;
+    snd_pcm_status_alloca(&status);
+
+    if (snd_pcm_status(mHandle->handle, status) < 0 ||
+        snd_pcm_status_get_state(status) != SND_PCM_STATE_XRUN)
+        return;
+
+    snd_htimestamp_t now, stopped;
+    snd_pcm_status_get_htstamp(status, &now);
+    snd_pcm_status_get_trigger_htstamp(status, &stopped);
+
+    int64_t ns = (int64_t)(now.tv_sec - stopped.tv_sec) * 1000000000LL
+            + now.tv_nsec - stopped.tv_nsec;
+    uint64_t lost = snd_pcm_status_get_avail(status);
+
+    if (ns > 0) lost += ns * deviceRate() / 1000000000LL;
+
+    LOGW("Capture overrun on %s, %llu frames lost",
+            snd_pcm_name(mHandle->handle), (unsigned long long)lost);
+
+    android_atomic_add((int32_t)lost, &mFramesLost);
+}
+
+ssize_t AudioStreamInALSA::readRing(void *buffer, size_t bytes)
+{
+    sp<ALSACaptureEngine> engine;
+
+    {
+        AutoMutex lock(mRingLock);
+
+        // Once attachEngine() published the engine no reader may start again.
+        engine = mEngine;
+
+        if (engine == 0 && mReader == 0) {
+            snd_pcm_uframes_t bufferSize = mHandle->bufferSize;
+            snd_pcm_uframes_t periodSize = bufferSize / 4;
+
+            if (mHandle->handle)
+                snd_pcm_get_params(mHandle->handle, &bufferSize, &periodSize);
 
-    do {
-        n = snd_pcm_readi(mHandle->handle, buffer, frames);
-        if (n < frames) {
-            if (mHandle->handle) {
-                if (n < 0) {
-                    n = snd_pcm_recover(mHandle->handle, n, 0);
+            if (periodSize * frameSize() > mReadBufferSize) {
+                char *scratch = (char *)realloc(mReadBuffer, periodSize * frameSize());
+                if (!scratch) return NO_MEMORY;
 
-                    if (aDev && aDev->recover) aDev->recover(aDev, n);
-                } else
-                    n = snd_pcm_prepare(mHandle->handle);
+                mReadBuffer = scratch;
+                mReadBufferSize = periodSize * frameSize();
             }
-            return static_cast<ssize_t>(n);
+
+            mPeriodNs = (nsecs_t)periodSize * 1000000000LL / deviceRate();
+            mReader = new ReaderThread(this);
+            mReader->run("ALSAReader", PRIORITY_URGENT_AUDIO);
+        }
+    }
+
+    if (engine != 0) return engine->read(this, buffer, bytes);
+
+    bytes -= bytes % frameSize();
+
+    // Wait for the whole request, like a blocking snd_pcm_readi() would,
+    // but give up on a reader that stopped delivering altogether.
+    nsecs_t timeout = (nsecs_t)(mRing->size() / frameSize())
+            * 1000000000LL / deviceRate() + mPeriodNs;
+    nsecs_t deadline = systemTime() + timeout;
+    size_t copied = 0;
+
+    while (copied < bytes) {
+        size_t n = mRing->read((char *)buffer + copied, bytes - copied);
+
+        if (n) {
+            copied += n;
+            continue;
+        }
+
+        AutoMutex lock(mRingLock);
+        if (!mRing->available()) {
+            if (systemTime() >= deadline) break;
+            mDataCond.waitRelative(mRingLock, mPeriodNs);
+        }
+    }
+
+    AutoMutex lock(mRingLock);
+    mReadFrames += copied / frameSize();
+
+    return copied ? (ssize_t)copied : (ssize_t)TIMED_OUT;
+}
+
+bool AudioStreamInALSA::readerLoop()
+{
+    size_t frameBytes = frameSize();
+    ssize_t n;
+
+    {
+        AutoMutex lock(mLock);
+
+        n = readFrames(mReadBuffer, mReadBufferSize);
+        if (n <= 0) {
+            // Recovered, or the device is failing. Try again a period later
+            // rather than spin on it.
+            if (n < 0) usleep(mPeriodNs / 1000);
+            return true;
         }
-    } while (n == -EAGAIN);
 
-    return static_cast<ssize_t>(snd_pcm_frames_to_bytes(mHandle->handle, n));
+        // The delay is what the device captured after the last frame read.
+        snd_pcm_sframes_t delay = 0;
+        nsecs_t now = systemTime();
+
+        if (snd_pcm_delay(mHandle->handle, &delay) < 0 || delay < 0) delay = 0;
+
+        // A client that does not keep up loses the newest frames; the ones
+        // in the ring are older but whole.
+        size_t space = mRing->space();
+        space -= space % frameBytes;
+
+        size_t queued = mRing->write(mReadBuffer, (size_t)n < space ? n : space);
+        size_t dropped = (n - queued) / frameBytes;
+
+        if (dropped)
+            android_atomic_add((int32_t)dropped, &mFramesLost);
+
+        AutoMutex ringLock(mRingLock);
+
+        // The last frame queued was captured before the dropped ones too.
+        mRingFrames += queued / frameBytes;
+        mStampFrames = mRingFrames;
+        mStampTime = now - (nsecs_t)(delay + dropped) * 1000000000LL / deviceRate();
+        mDataCond.signal();
+    }
+
+    return true;
+}
+
+void AudioStreamInALSA::stopReader()
+{
+    sp<ReaderThread> reader;
+
+    {
+        AutoMutex lock(mRingLock);
+        reader = mReader;
+        if (reader == 0) return;
+    }
+
+    // The reader thread takes mRingLock itself, so wait for it outside.
+    reader->requestExitAndWait();
+
+    AutoMutex lock(mRingLock);
+    if (mReader == reader) mReader.clear();
+}
+
+sp<ALSACaptureEngine> AudioStreamInALSA::captureEngine()
+{
+    AutoMutex lock(mRingLock);
+    return mEngine;
+}
+
+status_t AudioStreamInALSA::getCapturePosition(uint64_t *frames,
+        struct timespec *timestamp)
+{
+    if (!mRing) return INVALID_OPERATION;
+
+    AutoMutex lock(mRingLock);
+
+    if (!mStampTime) return NO_INIT;
+
+    // The ring frames are consecutive, so the stamp places all of them.
+    nsecs_t time = mStampTime - (nsecs_t)(mStampFrames - mReadFrames)
+            * 1000000000LL / deviceRate();
+
+    *frames = mReadFrames;
+    timestamp->tv_sec = time / 1000000000LL;
+    timestamp->tv_nsec = time % 1000000000LL;
+
+    return NO_ERROR;
+}
+
+status_t AudioStreamInALSA::setParameters(const String8& keyValuePairs)
+{
+    // Routing a shared PCM is up to the stream that owns it.
+    sp<ALSACaptureEngine> engine = captureEngine();
+
+    if (engine != 0) return engine->device()->setParameters(keyValuePairs);
+
+    return ALSAStreamOps::setParameters(keyValuePairs);
+}
+
+// Turns the stream into a client of the capture engine: from now on read()
+// copies what the engine thread captures.
+status_t AudioStreamInALSA::attachEngine(const sp<ALSACaptureEngine>& engine)
+{
+    // A client first, so that a read() handed off right away finds itself.
+    status_t err = engine->addClient(this);
+    if (err != NO_ERROR) return err;
+
+    // Publish the engine before stopping the reader: from here on read()
+    // hands off, and readRing() starts no reader thread of its own.
+    {
+        AutoMutex lock(mLock);
+        AutoMutex ringLock(mRingLock);
+
+        mShared = true;
+        mEngine = engine;
+    }
+
+    stopReader();
+
+    AutoMutex lock(mLock);
+
+    if (mRing) mRing->flush();
+
+    releasePowerLock();
+
+    return NO_ERROR;
 }
 
 status_t AudioStreamInALSA::dump(int fd, const Vector<String16>& args)
@@ -116,6 +534,23 @@ status_t AudioStreamInALSA::open(int mode)
 
 status_t AudioStreamInALSA::close()
 {
+    stopReader();
+
+    if (mShared) {
+        sp<ALSACaptureEngine> engine;
+
+        {
+            AutoMutex lock(mLock);
+            AutoMutex ringLock(mRingLock);
+            engine = mEngine;
+            mEngine.clear();
+        }
+
+        // The last client out stops the engine, which closes the PCM.
+        if (engine != 0 && engine->removeClient(this) == 0) engine->stop();
+        return NO_ERROR;
+    }
+
     AutoMutex lock(mLock);
 
     acoustic_device_t *aDev = acoustics();
@@ -124,39 +559,56 @@ status_t AudioStreamInALSA::close()
 
     ALSAStreamOps::close();
 
-    if (mPowerLock) {
-        release_wake_lock ("AudioInLock");
-        mPowerLock = false;
-    }
+    releasePowerLock();
 
     return NO_ERROR;
 }
 
 status_t AudioStreamInALSA::standby()
 {
+    // The engine stops the PCM once none of its clients records.
+    sp<ALSACaptureEngine> engine = captureEngine();
+
+    if (engine != 0) {
+        engine->standby(this);
+        return NO_ERROR;
+    }
+
+    stopReader();
+
     AutoMutex lock(mLock);
 
-    if (mPowerLock) {
-        release_wake_lock ("AudioInLock");
-        mPowerLock = false;
+    if (mRing) {
+        mRing->flush();
+
+        AutoMutex ringLock(mRingLock);
+        mRingFrames = mReadFrames = mStampFrames = 0;
+        mStampTime = 0;
     }
 
+    // Stop capturing, or the buffer overruns while nobody reads and the
+    // next read reports frames lost that nobody wanted.
+    if (mHandle->handle) {
+        snd_pcm_drop(mHandle->handle);
+        snd_pcm_prepare(mHandle->handle);
+    }
+
+    // Left to the idle monitor when it keeps the wake lock across gaps.
+    if (!mParent->mIdleMonitor->holdTime()) releasePowerLock();
+
     return NO_ERROR;
 }
 
-void AudioStreamInALSA::resetFramesLost()
+unsigned int AudioStreamInALSA::resetFramesLost()
 {
-    AutoMutex lock(mLock);
-    mFramesLost = 0;
+    return (unsigned int)android_atomic_and(0, &mFramesLost);
 }
 
 unsigned int AudioStreamInALSA::getInputFramesLost() const
 {
-    unsigned int count = mFramesLost;
     // Stupid interface wants us to have a side effect of clearing the count
     // but is defined as a const to prevent such a thing.
-    ((AudioStreamInALSA *)this)->resetFramesLost();
-    return count;
+    return ((AudioStreamInALSA *)this)->resetFramesLost();
 }
 
 status_t AudioStreamInALSA::setAcousticParams(void *params)
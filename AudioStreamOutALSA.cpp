@@ -20,13 +20,16 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <dlfcn.h>
+#include <time.h>
 
 #define LOG_TAG "AudioHardwareALSA"
 #include <utils/Log.h>
 #include <utils/String8.h>
 
+#include <cutils/atomic.h>
 #include <cutils/properties.h>
 #include <media/AudioRecord.h>
 #include <hardware_legacy/power.h>
@@ -46,15 +49,156 @@ static const int DEFAULT_SAMPLE_RATE = ALSA_DEFAULT_SAMPLE_RATE;
 
 // ----------------------------------------------------------------------------
 
+// Large enough for one frame of any format and channel count we open.
+static const size_t MAX_FRAME_BYTES = 64;
+
+static const char *profileName[] = {
+    /* ALSA_PROFILE_DEFAULT     : */"default",
+    /* ALSA_PROFILE_LOW_LATENCY : */"low_latency",
+    /* ALSA_PROFILE_DEEP_BUFFER : */"deep_buffer",
+};
+
+static const int profileCount = sizeof(profileName) / sizeof(profileName[0]);
+
+// Stops playback for standby and close. Unless asked to play out what is
+// queued, the module drops it or leaves it fading out, so neither blocks for
+// up to a buffer.
+static void stop(alsa_handle_t *handle, bool playOut)
+{
+    if (!handle->handle) return;
+
+    if (!playOut) {
+        if (handle->module->drop)
+            handle->module->drop(handle);
+        else
+            snd_pcm_drop(handle->handle);
+        return;
+    }
+
+    // A drain on a non-blocking PCM returns at once and leaves the stream
+    // draining in the background; we want it to finish.
+    if (handle->nonBlock) snd_pcm_nonblock(handle->handle, 0);
+    snd_pcm_drain(handle->handle);
+    if (handle->nonBlock) snd_pcm_nonblock(handle->handle, 1);
+}
+
+static inline size_t deviceFrameSize(const alsa_handle_t *handle)
+{
+    return snd_pcm_format_physical_width(handle->format) / 8 * handle->channels;
+}
+
 AudioStreamOutALSA::AudioStreamOutALSA(AudioHardwareALSA *parent, alsa_handle_t *handle) :
     ALSAStreamOps(parent, handle),
-    mFrameCount(0)
+    mFrameCount(0),
+    mWriteTimeout(0),
+    mReopenPending(false),
+    mDrainOnStop(false),
+    mCrossfade(true),
+    mTail(0),
+    mTailSize(0),
+    mTailPos(0),
+    mTailFill(0),
+    mStartPolicy(START_FULL),
+    mStartArg(0),
+    mStartGeneration(0),
+    mStartThreshold(0),
+    mStartAt(0),
+    mHwRate(handle->sampleRate),
+    mClockTime(0),
+    mClockFrames(0),
+    mVolume(handle->channels),
+    mVolumeBuffer(0),
+    mVolumeBufferSize(0),
+    mResampleQuality(ALSAResampler::QUALITY_MEDIUM),
+    mResampleBuffer(0),
+    mResampleBufferSize(0),
+    mBacklog(0),
+    mBacklogSize(0),
+    mBacklogFill(0),
+    mRaw(false),
+    mRing(0),
+    mPeriodNs(0),
+    mRingHighWater(0),
+    mRingFullWaits(0),
+    mRingEmptyWaits(0)
 {
+    char value[PROPERTY_VALUE_MAX];
+
+    // A non zero ring depth decouples write() from the PCM: the caller only
+    // copies into mRing and a HAL thread feeds ALSA and handles recovery.
+    property_get("alsa.playback.ring_ms", value, "0");
+    unsigned int ms = atoi(value);
+
+    if (ms) {
+        mRing = new ALSARingBuffer(ms * mHandle->sampleRate / 1000 * deviceFrameSize(mHandle));
+        if (!mRing->isValid()) {
+            delete mRing;
+            mRing = 0;
+        }
+    }
+
+    // The acoustics module gets a copy of the playback data on a thread of
+    // its own, so whatever it does with it adds nothing to output latency.
+    acoustic_device_t *aDev = acoustics();
+
+    if (aDev && (aDev->write || aDev->write_reference)) {
+        property_get("alsa.acoustics.reference_ms", value, "500");
+        ms = atoi(value);
+
+        mTee = new ALSAAcousticsTee(aDev, deviceFrameSize(mHandle),
+                ms * mHandle->sampleRate / 1000 * deviceFrameSize(mHandle));
+        mTee->run("ALSAAcousticsTee", PRIORITY_AUDIO);
+    }
+
+    // Upper bound on the time a single write may take; 0 derives it from
+    // the buffer latency, see writeTimeout().
+    property_get("alsa.playback.write_timeout_ms", value, "0");
+    mWriteTimeout = (nsecs_t)atoi(value) * 1000000;
+
+    // Play out queued data on standby and close instead of fading it out.
+    property_get("alsa.playback.drain", value, "0");
+    mDrainOnStop = atoi(value) != 0;
+
+    // Switch routes by crossfading into a second PCM instead of reopening.
+    property_get("alsa.playback.route_crossfade", value, "1");
+    mCrossfade = atoi(value) != 0;
+
+    // Filter length used when the device rate differs from the client's:
+    // low, medium or high.
+    property_get("alsa.playback.resampler", value, "medium");
+    if (!strcmp(value, "low"))
+        mResampleQuality = ALSAResampler::QUALITY_LOW;
+    else if (!strcmp(value, "high"))
+        mResampleQuality = ALSAResampler::QUALITY_HIGH;
+
+    memset(&mDeviceConfig, 0, sizeof(mDeviceConfig));
+    publishDeviceConfig();
 }
 
 AudioStreamOutALSA::~AudioStreamOutALSA()
 {
     close();
+    delete mRing;
+    free(mTail);
+    free(mVolumeBuffer);
+    free(mResampleBuffer);
+    free(mBacklog);
+}
+
+status_t AudioStreamOutALSA::set(int *format, uint32_t *channels, uint32_t *rate)
+{
+    status_t err = ALSAStreamOps::set(format, channels, rate);
+
+    // The soft volume runs on the client's channels, ahead of any downmix.
+    if (err == NO_ERROR) {
+        uint32_t layout[ALSAConverter::MAX_CHANNELS];
+        mVolume.setChannels(clientLayout(layout));
+
+        // The device may have been renegotiated to another channel count.
+        publishDeviceConfig();
+    }
+
+    return err;
 }
 
 uint32_t AudioStreamOutALSA::channels() const
@@ -63,38 +207,1183 @@ uint32_t AudioStreamOutALSA::channels() const
     return c;
 }
 
+status_t AudioStreamOutALSA::setParameters(const String8& keyValuePairs)
+{
+    AudioParameter param = AudioParameter(keyValuePairs);
+    String8 key = String8(ALSA_PARAMETER_PROFILE);
+    String8 value;
+
+    if (param.get(key, value) == NO_ERROR) {
+        int profile = profileCount;
+
+        for (int i = 0; i < profileCount; i++)
+            if (value == profileName[i]) profile = i;
+
+        if (profile == profileCount) {
+            LOGE("Unknown output profile %s", value.string());
+            return BAD_VALUE;
+        }
+
+        status_t err = setProfile(profile);
+        if (err != NO_ERROR) return err;
+
+        param.remove(key);
+        if (!param.size()) return NO_ERROR;
+    }
+
+    // Routing a shared PCM is up to the stream that owns it.
+    sp<ALSAOutputMixer> mixer = outputMixer();
+    if (mixer != 0) return mixer->device()->setParameters(param.toString());
+
+    String8 routing = String8(AudioParameter::keyRouting);
+    int device;
+
+    if (mCrossfade && param.getInt(routing, device) == NO_ERROR) {
+        AutoMutex lock(mLock);
+
+        status_t err = crossfadeRoute((uint32_t)device, mParent->mode());
+        if (err != NO_ERROR) return err;
+
+        param.remove(routing);
+        if (!param.size()) return NO_ERROR;
+    }
+
+    return ALSAStreamOps::setParameters(param.toString());
+}
+
+String8 AudioStreamOutALSA::getParameters(const String8& keys)
+{
+    AudioParameter param = AudioParameter(ALSAStreamOps::getParameters(keys));
+    String8 key = String8(ALSA_PARAMETER_PROFILE);
+    String8 value;
+
+    if (AudioParameter(keys).get(key, value) == NO_ERROR)
+        param.add(key, String8(profileName[mHandle->profile]));
+
+    return param.toString();
+}
+
+// The PCM of a profile may be in use or being opened for another stream,
+// which only AudioHardwareALSA can tell; it calls moveTo() or attachMixer().
+status_t AudioStreamOutALSA::setProfile(int profile)
+{
+    return mParent->setOutputProfile(this, profile);
+}
+
+// Switches the stream to the PCM of another handle of the same route. Only
+// called while both handles are marked busy, see setOutputProfile().
+status_t AudioStreamOutALSA::moveTo(alsa_handle_t *handle)
+{
+    int profile = handle->profile;
+
+    if (mRing) {
+        drainRing();
+        stopWriter();
+    }
+
+    AutoMutex lock(mLock);
+
+    // A PCM closed for idling comes back on the new profile.
+    uint32_t devices = mIdleDevices ? mIdleDevices : mHandle->curDev;
+    int mode = mIdleDevices ? mIdleMode : mHandle->curMode;
+
+    mHandle->module->close(mHandle);
+    mIdleDevices = 0;
+
+    status_t err = handle->module->open(handle, devices, mode);
+    if (err != NO_ERROR) {
+        LOGE("Unable to open %s output profile", profileName[profile]);
+        mHandle->module->open(mHandle, devices, mode);
+        return err;
+    }
+
+    LOGD("Output switched to the %s profile", profileName[profile]);
+
+    mHandle = handle;
+    mFrameCount = 0;
+    mClockTime = 0;
+    mResampler.reset();
+    mBacklogFill = 0;
+    publishDeviceConfig();
+
+    if (mTee != 0) mTee->reset();
+
+    return NO_ERROR;
+}
+
 status_t AudioStreamOutALSA::setVolume(float left, float right)
 {
-    return mixer()->setVolume (mHandle->curDev, left, right);
+    // The route's hardware volume would apply to every stream in the mix.
+    if (outputMixer() != 0) {
+        mVolume.setVolume(left, right);
+        return NO_ERROR;
+    }
+
+    status_t status = mixer()->setVolume (mHandle->curDev, left, right);
+
+    // No hardware volume on this route; apply it in software.
+    if (status == INVALID_OPERATION) {
+        mVolume.setVolume(left, right);
+        status = NO_ERROR;
+    }
+
+    return status;
+}
+
+// Copy frames straight into the DMA buffer of a memory mapped PCM. Behaves
+// like snd_pcm_writei(): returns the number of frames queued, or a negative
+// error code if nothing could be queued (-EAGAIN if the buffer is full and
+// the PCM is non-blocking).
+static snd_pcm_sframes_t mmapWrite(snd_pcm_t *pcm, const void *buffer,
+        snd_pcm_uframes_t frames, bool nonBlock, snd_pcm_uframes_t startThreshold)
+{
+    snd_pcm_uframes_t bufferSize, periodSize;
+    snd_pcm_uframes_t written = 0;
+    ssize_t frameBytes = snd_pcm_frames_to_bytes(pcm, 1);
+    int err;
+
+    snd_pcm_get_params(pcm, &bufferSize, &periodSize);
+
+    while (written < frames) {
+        snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm);
+        if (avail < 0) return written ? (snd_pcm_sframes_t)written : avail;
+
+        if (avail == 0) {
+            // The buffer is full. A prepared stream that never reached its
+            // start threshold has to be kicked, or we would wait forever.
+            if (snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED) {
+                err = snd_pcm_start(pcm);
+                if (err < 0) return written ? (snd_pcm_sframes_t)written : err;
+            }
+            if (nonBlock) return written ? (snd_pcm_sframes_t)written : -EAGAIN;
+            err = snd_pcm_wait(pcm, -1);
+            if (err < 0) return written ? (snd_pcm_sframes_t)written : err;
+            continue;
+        }
+
+        const snd_pcm_channel_area_t *areas;
+        snd_pcm_uframes_t offset;
+        snd_pcm_uframes_t chunk = frames - written;
+
+        err = snd_pcm_mmap_begin(pcm, &areas, &offset, &chunk);
+        if (err < 0) return written ? (snd_pcm_sframes_t)written : err;
+
+        // Interleaved access; every channel shares the first area.
+        char *dst = (char *)areas[0].addr
+                + (areas[0].first + offset * areas[0].step) / 8;
+        memcpy(dst, (const char *)buffer + written * frameBytes,
+                chunk * frameBytes);
+
+        snd_pcm_sframes_t n = snd_pcm_mmap_commit(pcm, offset, chunk);
+        if (n < 0) return written ? (snd_pcm_sframes_t)written : n;
+        written += n;
+    }
+
+    // snd_pcm_mmap_commit() does not honour the start threshold the way
+    // snd_pcm_writei() does, so apply the one the start policy set.
+    if (snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED) {
+        snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm);
+        if (avail >= 0 && bufferSize - avail >= startThreshold) snd_pcm_start(pcm);
+    }
+
+    return written;
+}
+
+// Length of the crossfade between the old and the new route.
+static const unsigned int ROUTE_FADE_MS = 5;
+
+// Length of the fade out when playback stops without playing out.
+static const unsigned int STOP_FADE_MS = 5;
+
+static uint32_t pcmRate(snd_pcm_t *pcm)
+{
+    snd_pcm_hw_params_t *params;
+    unsigned int rate = 0;
+
+    snd_pcm_hw_params_alloca(&params);
+
+    if (snd_pcm_hw_params_current(pcm, params) == 0)
+        snd_pcm_hw_params_get_rate(params, &rate, 0);
+
+    return rate;
+}
+
+// Puts a status stamp on CLOCK_MONOTONIC. The module asks for monotonic
+// stamps, but older alsa-lib and kernels stamp on the wall clock. The two
+// clocks are decades apart, so the one a stamp is nearer was its clock.
+static snd_htimestamp_t monotonicStamp(snd_htimestamp_t stamp)
+{
+    struct timespec mono, real;
+
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+
+    int64_t s = (int64_t)stamp.tv_sec * 1000000000LL + stamp.tv_nsec;
+    int64_t m = (int64_t)mono.tv_sec * 1000000000LL + mono.tv_nsec;
+    int64_t r = (int64_t)real.tv_sec * 1000000000LL + real.tv_nsec;
+
+    int64_t fromMono = s > m ? s - m : m - s;
+    int64_t fromReal = s > r ? s - r : r - s;
+
+    if (fromMono <= fromReal) return stamp;
+
+    s += m - r;
+    stamp.tv_sec = s / 1000000000LL;
+    stamp.tv_nsec = s % 1000000000LL;
+
+    return stamp;
+}
+
+// Remembers what was written to the PCM, up to one buffer of it.
+void AudioStreamOutALSA::keepTail(const void *buffer, size_t bytes)
+{
+    snd_pcm_uframes_t bufferSize, periodSize;
+    snd_pcm_get_params(mHandle->handle, &bufferSize, &periodSize);
+
+    size_t size = bufferSize * deviceFrameSize(mHandle);
+
+    if (size != mTailSize) {
+        char *tail = (char *)realloc(mTail, size);
+        if (!tail) return;
+
+        mTail = tail;
+        mTailSize = size;
+        mTailPos = 0;
+        mTailFill = 0;
+    }
+
+    if (bytes > mTailSize) {
+        buffer = (const char *)buffer + bytes - mTailSize;
+        bytes = mTailSize;
+    }
+
+    size_t n = mTailSize - mTailPos < bytes ? mTailSize - mTailPos : bytes;
+    memcpy(mTail + mTailPos, buffer, n);
+    memcpy(mTail, (const char *)buffer + n, bytes - n);
+
+    mTailPos = (mTailPos + bytes) % mTailSize;
+    mTailFill = mTailFill + bytes < mTailSize ? mTailFill + bytes : mTailSize;
+}
+
+// Leaves a running read/write stream fading out what it still has queued.
+// The module fades memory mapped streams in place; here the queued frames
+// are rewound and written again from the tail, faded and then silenced.
+void AudioStreamOutALSA::fadeQueued()
+{
+    snd_pcm_t *pcm = mHandle->handle;
+
+    if (!pcm || mHandle->access == SND_PCM_ACCESS_MMAP_INTERLEAVED ||
+        snd_pcm_state(pcm) != SND_PCM_STATE_RUNNING ||
+        (android_atomic_acquire_load(&mHandle->state) & ALSA_STATE_FADING))
+        return;
+
+    size_t frameBytes = deviceFrameSize(mHandle);
+    snd_pcm_uframes_t fade = pcmRate(pcm) * STOP_FADE_MS / 1000;
+    snd_pcm_sframes_t rewindable = snd_pcm_rewindable(pcm);
+
+    // Leave the first fade length alone; the DMA may have fetched it already.
+    if (rewindable <= (snd_pcm_sframes_t)(2 * fade)) return;
+
+    snd_pcm_uframes_t frames = rewindable - fade;
+    if (frames > mTailFill / frameBytes) frames = mTailFill / frameBytes;
+    if (frames < fade) return;
+
+    char *data = (char *)malloc(frames * frameBytes);
+    if (!data) return;
+
+    snd_pcm_sframes_t rewound = snd_pcm_rewind(pcm, frames);
+
+    if (rewound > 0) {
+        // The rewound frames are the last ones written.
+        snd_pcm_uframes_t faded = (snd_pcm_uframes_t)rewound < fade ? rewound : fade;
+        size_t start = (mTailPos + mTailSize - rewound * frameBytes) % mTailSize;
+        size_t bytes = faded * frameBytes;
+        size_t n = mTailSize - start < bytes ? mTailSize - start : bytes;
+
+        memcpy(data, mTail + start, n);
+        memcpy(data + n, mTail, bytes - n);
+
+        alsa_ramp_frames(data, mHandle->format, mHandle->channels, faded, false);
+        snd_pcm_format_set_silence(mHandle->format, data + bytes,
+                (rewound - faded) * mHandle->channels);
+
+        // What was rewound fits again, so this does not block.
+        if (snd_pcm_writei(pcm, data, rewound) == rewound)
+            android_atomic_or(ALSA_STATE_FADING, &mHandle->state);
+    }
+
+    free(data);
+
+    // The device no longer holds what the tail says.
+    mTailFill = 0;
+}
+
+// Stops playback for standby and close, leaving a fade playing out when
+// what is queued is not to be played.
+void AudioStreamOutALSA::stopPlayback()
+{
+    snd_pcm_t *pcm = mHandle->handle;
+
+    // The prefill policy keeps the PCM running on silence. Let it stop once
+    // what is queued has played or faded out; the next write sets the
+    // policy up again.
+    if (pcm && mStartPolicy == START_PREFILL) {
+        snd_pcm_uframes_t bufferSize, periodSize;
+        snd_pcm_sw_params_t *params;
+
+        snd_pcm_sw_params_alloca(&params);
+
+        if (snd_pcm_get_params(pcm, &bufferSize, &periodSize) == 0 &&
+            snd_pcm_sw_params_current(pcm, params) == 0) {
+            snd_pcm_sw_params_set_silence_size(pcm, params, 0);
+            snd_pcm_sw_params_set_stop_threshold(pcm, params, bufferSize);
+            snd_pcm_sw_params(pcm, params);
+        }
+
+        mStartGeneration = 0;
+    }
+
+    if (!mDrainOnStop) fadeQueued();
+
+    stop(mHandle, mDrainOnStop);
+}
+
+// How many of the frames last written can be had again: memory mapped
+// streams still have a buffer of them in the DMA area, read/write ones
+// only what the tail kept.
+snd_pcm_uframes_t AudioStreamOutALSA::keptFrames()
+{
+    if (mHandle->access != SND_PCM_ACCESS_MMAP_INTERLEAVED)
+        return mTailFill / deviceFrameSize(mHandle);
+
+    snd_pcm_uframes_t bufferSize, periodSize;
+    if (snd_pcm_get_params(mHandle->handle, &bufferSize, &periodSize) < 0) return 0;
+
+    return bufferSize;
+}
+
+// Copies the last frames written, up to keptFrames() of them, into data.
+void AudioStreamOutALSA::copyKept(char *data, snd_pcm_uframes_t frames)
+{
+    size_t frameBytes = deviceFrameSize(mHandle);
+    size_t bytes = frames * frameBytes;
+
+    if (mHandle->access != SND_PCM_ACCESS_MMAP_INTERLEAVED) {
+        size_t start = (mTailPos + mTailSize - bytes) % mTailSize;
+        size_t n = mTailSize - start < bytes ? mTailSize - start : bytes;
+
+        memcpy(data, mTail + start, n);
+        memcpy(data + n, mTail, bytes - n);
+        return;
+    }
+
+    // They end where the application pointer is; a zero length transfer
+    // tells where that is in the DMA area.
+    snd_pcm_t *pcm = mHandle->handle;
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset, none = 0;
+    snd_pcm_uframes_t bufferSize, periodSize;
+
+    snd_pcm_get_params(pcm, &bufferSize, &periodSize);
+    snd_pcm_avail_update(pcm);
+
+    if (snd_pcm_mmap_begin(pcm, &areas, &offset, &none) < 0) {
+        memset(data, 0, bytes);
+        return;
+    }
+
+    snd_pcm_mmap_commit(pcm, offset, 0);
+
+    // Interleaved access; every channel shares the first area.
+    const char *base = (const char *)areas[0].addr + areas[0].first / 8;
+    snd_pcm_uframes_t start = (offset + bufferSize - frames) % bufferSize;
+    snd_pcm_uframes_t n = bufferSize - start < frames ? bufferSize - start : frames;
+
+    memcpy(data, base + start * frameBytes, n * frameBytes);
+    memcpy(data + n * frameBytes, base, (frames - n) * frameBytes);
+}
+
+// Switches routes without a gap. The new PCM is opened next to the old
+// one and prefilled with what the old one still has queued, aligned frame
+// for frame: silent for the few milliseconds the old one plays unchanged,
+// then fading in over the stretch the old one fades out on close. Devices
+// that cannot have both open get a plain route change.
+status_t AudioStreamOutALSA::crossfadeRoute(uint32_t devices, int mode)
+{
+    snd_pcm_t *pcm = mHandle->handle;
+
+    if (!pcm || snd_pcm_state(pcm) != SND_PCM_STATE_RUNNING ||
+        !mHandle->module->openNext || !mHandle->module->takeover ||
+        (mHandle->curDev == devices && mHandle->curMode == mode))
+        return mHandle->module->route(mHandle, devices, mode);
+
+    alsa_handle_t next;
+
+    if (mHandle->module->openNext(mHandle, &next, devices, mode) != NO_ERROR) {
+        LOGD("Route %08x cannot open alongside %08x, switching without a crossfade",
+                devices, mHandle->curDev);
+        return mHandle->module->route(mHandle, devices, mode);
+    }
+
+    if (next.format != mHandle->format || next.channels != mHandle->channels ||
+        pcmRate(next.handle) != pcmRate(pcm)) {
+        LOGD("Route %08x opens in another configuration than %08x, switching "
+                "without a crossfade", devices, mHandle->curDev);
+        next.module->close(&next);
+        return mHandle->module->route(mHandle, devices, mode);
+    }
+
+    size_t frameBytes = deviceFrameSize(mHandle);
+    snd_pcm_uframes_t fade = pcmRate(pcm) * ROUTE_FADE_MS / 1000;
+    snd_pcm_sframes_t delay = 0;
+
+    if (snd_pcm_delay(pcm, &delay) < 0) delay = 0;
+
+    snd_pcm_uframes_t pending = delay;
+    if (pending > keptFrames()) pending = keptFrames();
+
+    if (pending > 2 * fade) {
+        // The last pending frames written, frame for frame with the old
+        // route: silence while it still plays unchanged, then the rest,
+        // fading in as the old one fades out.
+        size_t skip = fade * frameBytes;
+        size_t bytes = (pending - fade) * frameBytes;
+        char *prefill = (char *)malloc(skip + bytes);
+
+        if (prefill) {
+            snd_pcm_format_set_silence(next.format, prefill, fade * next.channels);
+            copyKept(prefill + skip, pending - fade);
+
+            alsa_ramp_frames(prefill + skip, next.format, next.channels, fade, true);
+
+            if (next.access == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+                mmapWrite(next.handle, prefill, pending, false, 1);
+            else
+                snd_pcm_writei(next.handle, prefill, pending);
+
+            free(prefill);
+        }
+    }
+
+    if (snd_pcm_state(next.handle) == SND_PCM_STATE_PREPARED)
+        snd_pcm_start(next.handle);
+
+    LOGD("Crossfading route %08x into %08x over %u frames", mHandle->curDev,
+            devices, (unsigned int)pending);
+
+    // The old PCM fades out as it closes; the module fades memory mapped
+    // ones itself.
+    fadeQueued();
+
+    mHandle->module->takeover(mHandle, &next);
+    android_atomic_and(~ALSA_STATE_FADING, &mHandle->state);
+
+    mTailFill = 0;
+    mClockTime = 0;
+    publishDeviceConfig();
+
+    return NO_ERROR;
+}
+
+// Replaces the start and stop thresholds the module set up with the policy
+// configured for the profile, e.g. alsa.playback.start.default=periods:2.
+// Policies are full, periods:<n>, prefill:<ms> and scheduled:<ms>.
+void AudioStreamOutALSA::applyStartPolicy()
+{
+    snd_pcm_t *pcm = mHandle->handle;
+    char key[PROPERTY_KEY_MAX];
+    char value[PROPERTY_VALUE_MAX];
+
+    snprintf(key, sizeof(key), "alsa.playback.start.%s", profileName[mHandle->profile]);
+    property_get(key, value,
+            mHandle->profile == ALSA_PROFILE_LOW_LATENCY ? "periods:1" : "full");
+
+    char *arg = strchr(value, ':');
+    if (arg) *arg++ = 0;
+
+    mStartArg = arg ? atoi(arg) : 0;
+    mStartGeneration = mHandle->generation;
+    mStartAt = 0;
+
+    if (!strcmp(value, "periods"))
+        mStartPolicy = START_PERIODS;
+    else if (!strcmp(value, "prefill"))
+        mStartPolicy = START_PREFILL;
+    else if (!strcmp(value, "scheduled"))
+        mStartPolicy = START_SCHEDULED;
+    else {
+        if (strcmp(value, "full"))
+            LOGW("Unknown start policy %s for the %s profile", value,
+                    profileName[mHandle->profile]);
+        mStartPolicy = START_FULL;
+    }
+
+    snd_pcm_uframes_t bufferSize, periodSize, boundary;
+    snd_pcm_uframes_t stopThreshold;
+    snd_pcm_sw_params_t *params;
+    int err;
+
+    snd_pcm_get_params(pcm, &bufferSize, &periodSize);
+    snd_pcm_sw_params_alloca(&params);
+
+    err = snd_pcm_sw_params_current(pcm, params);
+    if (err < 0) goto done;
+
+    snd_pcm_sw_params_get_boundary(params, &boundary);
+    stopThreshold = bufferSize;
+
+    switch (mStartPolicy) {
+        case START_PERIODS:
+            // Starts early and stops on underrun like the default, so a
+            // late write costs one restart of the same short delay.
+            if (!mStartArg) mStartArg = 1;
+            mStartThreshold = mStartArg * periodSize;
+            if (mStartThreshold > bufferSize) mStartThreshold = bufferSize;
+            break;
+
+        case START_PREFILL:
+            // Never stops: ALSA plays silence through an underrun and the
+            // next write puts the cushion back, see prefill().
+            mStartThreshold = 1;
+            stopThreshold = boundary;
+            snd_pcm_sw_params_set_silence_threshold(pcm, params, 0);
+            snd_pcm_sw_params_set_silence_size(pcm, params, boundary);
+            break;
+
+        case START_SCHEDULED:
+            // Only scheduleStart() starts the PCM.
+            mStartThreshold = boundary;
+            break;
+
+        default:
+            mStartThreshold = bufferSize - 1;
+            break;
+    }
+
+    err = snd_pcm_sw_params_set_start_threshold(pcm, params, mStartThreshold);
+    if (err == 0) err = snd_pcm_sw_params_set_stop_threshold(pcm, params, stopThreshold);
+    if (err == 0) err = snd_pcm_sw_params(pcm, params);
+
+    done:
+    if (err < 0) {
+        LOGE("Unable to apply the %s start policy: %s", value, snd_strerror(err));
+        mStartPolicy = START_FULL;
+        mStartThreshold = bufferSize - 1;
+    } else
+        LOGV("Start policy %s, threshold %lu frames", value, mStartThreshold);
+}
+
+// Prefill policy: a stopped or starved PCM gets mStartArg ms of silence
+// ahead of the data, so the DMA starts with a cushion at once.
+void AudioStreamOutALSA::prefill()
+{
+    snd_pcm_t *pcm = mHandle->handle;
+    snd_pcm_uframes_t bufferSize, periodSize;
+
+    snd_pcm_get_params(pcm, &bufferSize, &periodSize);
+
+    snd_pcm_sframes_t avail = snd_pcm_avail(pcm);
+    if (avail < 0 || (snd_pcm_uframes_t)avail < bufferSize) return;
+
+    // The hardware ran past the last write and played silence meanwhile;
+    // skip ahead to it so new data is not written into the past.
+    if ((snd_pcm_uframes_t)avail > bufferSize)
+        snd_pcm_forward(pcm, avail - bufferSize);
+
+    snd_pcm_uframes_t frames = (snd_pcm_uframes_t)mStartArg * deviceRate() / 1000;
+    if (frames >= bufferSize) frames = bufferSize - periodSize;
+
+    size_t frameBytes = deviceFrameSize(mHandle);
+    char silence[1024];
+    snd_pcm_uframes_t chunk = sizeof(silence) / frameBytes;
+
+    snd_pcm_format_set_silence(mHandle->format, silence,
+            chunk * frameBytes * 8 / snd_pcm_format_physical_width(mHandle->format));
+
+    while (frames) {
+        snd_pcm_sframes_t n = frames < chunk ? frames : chunk;
+
+        if (mHandle->access == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+            n = mmapWrite(pcm, silence, n, mHandle->nonBlock, mStartThreshold);
+        else
+            n = snd_pcm_writei(pcm, silence, n);
+        if (n <= 0) break;
+
+        // The silence plays ahead of the data, so it counts like data in
+        // the presentation position.
+        mFrameCount += n;
+        frames -= n;
+    }
+}
+
+// Scheduled policy: a stopped PCM starts mStartArg ms after the first write,
+// or earlier if the buffer fills up before then and the write deadline
+// does not allow waiting.
+void AudioStreamOutALSA::scheduleStart(snd_pcm_uframes_t frames, nsecs_t deadline)
+{
+    snd_pcm_t *pcm = mHandle->handle;
+
+    if (snd_pcm_state(pcm) != SND_PCM_STATE_PREPARED) {
+        mStartAt = 0;
+        return;
+    }
+
+    nsecs_t now = systemTime();
+    if (!mStartAt) mStartAt = now + (nsecs_t)mStartArg * 1000000;
+
+    snd_pcm_sframes_t avail = snd_pcm_avail(pcm);
+    if (now < mStartAt && avail >= 0 && (snd_pcm_uframes_t)avail >= frames) return;
+
+    nsecs_t wait = (mStartAt < deadline ? mStartAt : deadline) - now;
+    if (wait > 0) usleep(wait / 1000);
+
+    snd_pcm_start(pcm);
+    mStartAt = 0;
 }
 
 ssize_t AudioStreamOutALSA::write(const void *buffer, size_t bytes)
 {
-    AutoMutex lock(mLock);
+    // In decoupled mode the writer thread holds mLock while it talks to
+    // ALSA, so the caller only touches the ring and never waits for it.
+    // attachMixer() may hand the stream a ring while we wait for the lock.
+    bool locked = false;
+
+    mRingLock.lock();
+    bool decoupled = mRing != 0;
+    mRingLock.unlock();
 
-    if (!mPowerLock) {
-        acquire_wake_lock (PARTIAL_WAKE_LOCK, "AudioOutLock");
-        mPowerLock = true;
+    if (!decoupled) {
+        mLock.lock();
+        if (mRing)
+            mLock.unlock();
+        else
+            locked = true;
     }
 
-    acoustic_device_t *aDev = acoustics();
+    // The caller was told the backlog was played; its new data has to wait
+    // until it really is.
+    if (locked && mBacklogFill) {
+        ssize_t n = writeBacklog();
+
+        if (mBacklogFill) {
+            mLock.unlock();
+            return n < 0 ? n : 0;
+        }
+    }
+
+    size_t frames = bytes / frameSize();
+    const void *input = buffer;
+
+    // The writer thread keeps the device side of the conversion up to date
+    // in decoupled mode; with mLock held we read it off the PCM ourselves.
+    device_config_t device;
+
+    if (locked) publishDeviceConfig();
+    deviceConfig(&device);
+
+    // Routes without hardware volume get their gain here, before the data
+    // is split between the acoustics module and the device. The mix has had
+    // it applied per stream already.
+    mVolume.setMasterVolume(mParent->mMasterVolume);
+
+    if (!mRaw && !mVolume.isUnity()) {
+        if (bytes > mVolumeBufferSize) {
+            char *scratch = (char *)realloc(mVolumeBuffer, bytes);
+            if (scratch) {
+                mVolumeBuffer = scratch;
+                mVolumeBufferSize = bytes;
+            }
+        }
+
+        if (bytes <= mVolumeBufferSize &&
+            mVolume.process(buffer, mVolumeBuffer, frames, mFormat) == NO_ERROR)
+            buffer = mVolumeBuffer;
+    }
+
+    // Everything past this point works in the device format.
+    size_t deviceFrames = frames;
+    if (!mRaw) buffer = convertFrames(buffer, frames, device, &deviceFrames);
+
+    if (!buffer) {
+        if (locked) mLock.unlock();
+        return NO_MEMORY;
+    }
+
+    size_t deviceBytes = deviceFrames * device.frameSize();
 
     // For output, we will pass the data on to the acoustics module, but the actual
     // data is expected to be sent to the audio device directly as well.
-    if (aDev && aDev->write)
-        aDev->write(aDev, buffer, bytes);
+    if (mTee != 0 && deviceBytes) mTee->publish(buffer, deviceBytes);
+
+    ssize_t n = 0;
+
+    if (!locked) {
+        if (deviceBytes) n = queueFrames(buffer, deviceBytes);
+    } else {
+        if (deviceBytes) n = writeFrames(buffer, deviceBytes);
+
+        // Processed data cannot be sent again by the caller without going
+        // through the ramp and resampler twice. Keep the rest instead.
+        if (buffer != input && n >= 0 && (size_t)n < deviceBytes &&
+            keepBacklog((const char *)buffer + n, deviceBytes - n))
+            n = deviceBytes;
+
+        mLock.unlock();
+    }
+
+    // Report progress in the caller's bytes. A resampler still filling its
+    // history has taken the input without producing anything yet.
+    if (n >= 0 && (size_t)n == deviceBytes)
+        n = frames * frameSize();
+    else if (n > 0)
+        n = (ssize_t)((uint64_t)(n / device.frameSize()) * frames / deviceFrames) * frameSize();
+
+    return n;
+}
+
+// Takes client frames to the device format, channel layout and rate.
+// Returns the data to play, or 0 if a scratch buffer is not available.
+const void *AudioStreamOutALSA::convertFrames(const void *buffer, size_t frames,
+        const device_config_t& device, size_t *deviceFrames)
+{
+    uint32_t clientChannels[ALSAConverter::MAX_CHANNELS];
+    unsigned int clientCount = clientLayout(clientChannels);
+    unsigned int deviceCount = device.channels;
+
+    *deviceFrames = frames;
+
+    if (mResampler.configure(mSampleRate, device.rate, deviceCount,
+            mResampleQuality) != NO_ERROR || mResampler.isPassthrough()) {
+        if (mConverter.configure(mFormat, device.format, clientChannels, clientCount,
+                device.layout, deviceCount) != NO_ERROR || mConverter.isPassthrough())
+            return buffer;
+
+        void *converted = convertBuffer(frames * device.frameSize());
+        if (converted) mConverter.convert(buffer, converted, frames);
+        return converted;
+    }
+
+    // The device runs at another rate: remix into float, resample, and only
+    // then take the result to the device format.
+    size_t outFrames = mResampler.outputFrames(frames);
+    size_t bytes = (frames + outFrames) * deviceCount * sizeof(float);
+
+    if (bytes > mResampleBufferSize) {
+        float *scratch = (float *)realloc(mResampleBuffer, bytes);
+        if (!scratch) return 0;
+
+        mResampleBuffer = scratch;
+        mResampleBufferSize = bytes;
+    }
+
+    float *mixed = mResampleBuffer;
+    float *resampled = mixed + frames * deviceCount;
+
+    mConverter.configure(mFormat, SND_PCM_FORMAT_FLOAT_LE, clientChannels, clientCount,
+            device.layout, deviceCount);
+    mConverter.convert(buffer, mixed, frames);
+
+    *deviceFrames = mResampler.process(mixed, frames, resampled, outFrames);
+
+    if (mDeviceConverter.configure(SND_PCM_FORMAT_FLOAT_LE, device.format,
+            deviceCount) != NO_ERROR || mDeviceConverter.isPassthrough())
+        return resampled;
+
+    void *converted = convertBuffer(*deviceFrames * device.frameSize());
+    if (converted) mDeviceConverter.convert(resampled, converted, *deviceFrames);
+    return converted;
+}
+
+// Reads the device side of the conversion off the PCM; called with mLock
+// held. A PCM closed for idling keeps what it last had.
+void AudioStreamOutALSA::publishDeviceConfig()
+{
+    if (!mHandle->handle && mDeviceConfig.rate) return;
+
+    device_config_t config;
+    snd_pcm_uframes_t bufferSize = mHandle->bufferSize;
+
+    config.format = mHandle->format;
+    config.channels = deviceLayout(config.layout);
+    config.rate = deviceRate();
+    config.periodSize = bufferSize / 4;
+
+    if (mHandle->handle)
+        snd_pcm_get_params(mHandle->handle, &bufferSize, &config.periodSize);
+
+    AutoMutex lock(mConfigLock);
+    mDeviceConfig = config;
+}
+
+void AudioStreamOutALSA::deviceConfig(device_config_t *config)
+{
+    // A track converts to what the mixer's device stream plays.
+    sp<ALSAOutputMixer> mixer = outputMixer();
+
+    if (mixer != 0) {
+        mixer->device()->deviceConfig(config);
+        return;
+    }
+
+    AutoMutex lock(mConfigLock);
+    *config = mDeviceConfig;
+}
+
+ssize_t AudioStreamOutALSA::queueFrames(const void *buffer, size_t bytes)
+{
+    sp<ALSAOutputMixer> mixer;
+
+    // Decided under the lock attachMixer() takes to hand the PCM over, so
+    // a writer thread never starts on a PCM the mixer owns.
+    {
+        AutoMutex lock(mRingLock);
+        mixer = mMixer;
+
+        if (mWriter == 0 && mixer == 0) {
+            mConfigLock.lock();
+            mPeriodNs = (nsecs_t)mDeviceConfig.periodSize * 1000000000LL / mDeviceConfig.rate;
+            mConfigLock.unlock();
+
+            mWriter = new WriterThread(this);
+            mWriter->run("ALSAWriter", PRIORITY_URGENT_AUDIO);
+        }
+    }
+
+    size_t queued = 0;
+
+    while (queued < bytes) {
+        size_t n = mRing->write((const char *)buffer + queued, bytes - queued);
+
+        if (n) {
+            queued += n;
+
+            size_t fill = mRing->available();
+            if (fill > mRingHighWater) mRingHighWater = fill;
+
+            if (mixer != 0) {
+                mixer->signal();
+                continue;
+            }
+
+            AutoMutex lock(mRingLock);
+            mDataCond.signal();
+            continue;
+        }
+
+        // The ring is full. Pace the caller at the rate the writer thread
+        // drains it, just like a blocking snd_pcm_writei() would.
+        AutoMutex lock(mRingLock);
+        if (!mRing->space()) {
+            mRingFullWaits++;
+            mSpaceCond.waitRelative(mRingLock, mPeriodNs);
+        }
+    }
+
+    return queued;
+}
+
+bool AudioStreamOutALSA::writerLoop()
+{
+    {
+        AutoMutex lock(mRingLock);
+        if (!mRing->available()) {
+            mRingEmptyWaits++;
+            mDataCond.waitRelative(mRingLock, mPeriodNs);
+            return true;
+        }
+    }
+
+    // The consumer side of the ring is only touched with mLock held, which
+    // lets standby() and close() flush it safely.
+    AutoMutex lock(mLock);
+
+    size_t frameBytes = deviceFrameSize(mHandle);
+    snd_pcm_uframes_t periodFrames = mPeriodNs * deviceRate() / 1000000000LL;
+    char frame[MAX_FRAME_BYTES];
+    void *data;
+
+    size_t bytes = mRing->readRegion(&data);
+
+    if (bytes < frameBytes) {
+        // A frame straddles the end of the ring.
+        if (mRing->available() < frameBytes) return true;
+        mRing->read(frame, frameBytes);
+        data = frame;
+        bytes = frameBytes;
+    } else {
+        // Hand ALSA at most one period at a time so that space frees up for
+        // the producer at the period cadence.
+        if (bytes > periodFrames * frameBytes) bytes = periodFrames * frameBytes;
+        bytes -= bytes % frameBytes;
+    }
+
+    ssize_t n = writeFrames(data, bytes);
+
+    if (n < 0) {
+        // Same as the synchronous path: the data is lost, keep going.
+        LOGW("Writer thread dropped %u bytes: %s", bytes, snd_strerror(n));
+        n = bytes;
+    }
+
+    if (data != frame) mRing->commitRead(n);
+
+    // write() converts the next data by what the PCM is now.
+    publishDeviceConfig();
+
+    AutoMutex ringLock(mRingLock);
+    mSpaceCond.signal();
+
+    return true;
+}
+
+// Sleep until the hardware has made room for the given number of frames,
+// using the estimated hardware clock instead of period interrupts. Returns
+// the number of frames that can be written without blocking.
+snd_pcm_sframes_t AudioStreamOutALSA::tschedWait(snd_pcm_uframes_t frames,
+        nsecs_t deadline)
+{
+    snd_pcm_t *pcm = mHandle->handle;
+    snd_pcm_uframes_t bufferSize, periodSize;
+
+    snd_pcm_get_params(pcm, &bufferSize, &periodSize);
+    if (frames > bufferSize) frames = bufferSize;
+
+    for (;;) {
+        snd_pcm_sframes_t avail = snd_pcm_avail(pcm);
+        if (avail < 0) return avail;
+
+        nsecs_t now = systemTime();
+        updateClock(bufferSize - avail, now);
+
+        if ((snd_pcm_uframes_t)avail >= frames || now >= deadline) return avail;
+
+        if (snd_pcm_state(pcm) != SND_PCM_STATE_RUNNING) {
+            // Nothing drains the buffer until it starts. Fill what we can,
+            // and kick a full buffer that never reached its threshold.
+            if (avail) return avail;
+
+            int err = snd_pcm_start(pcm);
+            if (err < 0) return err;
+            continue;
+        }
+
+        nsecs_t wait = (nsecs_t)((frames - avail) * 1000000000.0f / mHwRate);
+        nsecs_t maxWait = (nsecs_t)mHandle->latency * 1000;
+
+        if (wait < 1000000) wait = 1000000;
+        if (wait > maxWait) wait = maxWait;
+        if (wait > deadline - now) wait = deadline - now;
+
+        usleep(wait / 1000);
+    }
+}
+
+// Track the rate at which the hardware actually consumes frames, so timer
+// wakeups line up with the DAC clock rather than the nominal rate.
+void AudioStreamOutALSA::updateClock(snd_pcm_uframes_t queued, nsecs_t now)
+{
+    uint64_t played = mFrameCount > queued ? mFrameCount - queued : 0;
+
+    if (!mClockTime || played < mClockFrames) {
+        mClockTime = now;
+        mClockFrames = played;
+        return;
+    }
+
+    nsecs_t elapsed = now - mClockTime;
+    if (elapsed < 100000000) return;
+
+    float rate = (played - mClockFrames) * 1000000000.0f / elapsed;
+    float nominal = deviceRate();
+
+    // Ignore windows spanning a start, an underrun or a pause.
+    if (rate > nominal * 0.9f && rate < nominal * 1.1f)
+        mHwRate += (rate - mHwRate) * 0.25f;
+
+    mClockTime = now;
+    mClockFrames = played;
+}
+
+void AudioStreamOutALSA::drainRing()
+{
+    {
+        AutoMutex lock(mRingLock);
+        if (mWriter == 0 && mMixer == 0) return;
+    }
+
+    device_config_t device;
+    deviceConfig(&device);
+
+    // Let the writer thread, or the mixer, play out what has been queued, bounded by the
+    // time a full ring takes at the nominal rate.
+    nsecs_t timeout = (nsecs_t)(mRing->size() / device.frameSize())
+            * 1000000000LL / device.rate + mPeriodNs;
+    nsecs_t deadline = systemTime() + timeout;
+
+    AutoMutex lock(mRingLock);
+    while (mRing->available() && systemTime() < deadline)
+        mSpaceCond.waitRelative(mRingLock, mPeriodNs);
+}
+
+void AudioStreamOutALSA::stopWriter()
+{
+    sp<WriterThread> writer;
+
+    {
+        AutoMutex lock(mRingLock);
+        writer = mWriter;
+        if (writer == 0) return;
+
+        writer->requestExit();
+        mDataCond.broadcast();
+    }
+
+    // The writer thread takes mRingLock itself, so wait for it outside.
+    writer->requestExitAndWait();
+
+    AutoMutex lock(mRingLock);
+    if (mWriter == writer) mWriter.clear();
+}
+
+sp<ALSAOutputMixer> AudioStreamOutALSA::outputMixer()
+{
+    AutoMutex lock(mRingLock);
+    return mMixer;
+}
+
+// Turns the stream into a track of the mixer: from now on write() queues
+// device frames for the mixer thread, which owns the PCM. A stream moving
+// over from another handle closes its own PCM first.
+status_t AudioStreamOutALSA::attachMixer(const sp<ALSAOutputMixer>& mixer,
+        alsa_handle_t *handle)
+{
+    bool writing;
+
+    // Publish the mixer before anything else: from here on write() only
+    // queues, and queueFrames() starts no writer thread of its own.
+    {
+        AutoMutex lock(mLock);
+        AutoMutex ringLock(mRingLock);
+
+        if (!mRing) {
+            ALSARingBuffer *ring = new ALSARingBuffer(mixer->trackBufferSize());
+            if (!ring->isValid()) {
+                LOGE("Unable to allocate a mixer track");
+                delete ring;
+                return NO_MEMORY;
+            }
+            mRing = ring;
+        }
+
+        writing = mWriter != 0;
+        mShared = true;
+        mPeriodNs = mixer->periodNs();
+        mMixer = mixer;
+    }
+
+    // A writer thread already running plays out what it has queued.
+    if (writing) {
+        drainRing();
+        stopWriter();
+    }
+
+    // The mixer's device stream feeds the acoustics module the mix.
+    if (mTee != 0) {
+        mTee->stop();
+        mTee.clear();
+    }
+
+    AutoMutex lock(mLock);
+
+    if (handle && handle != mHandle) {
+        stopPlayback();
+        mHandle->module->close(mHandle);
+
+        mHandle = handle;
+        mIdleDevices = 0;
+        mFrameCount = 0;
+        mClockTime = 0;
+        mResampler.reset();
+    }
+
+    mBacklogFill = 0;
+    releasePowerLock();
+
+    mixer->addTrack(this);
+
+    return NO_ERROR;
+}
+
+ssize_t AudioStreamOutALSA::writeFrames(const void *buffer, size_t bytes)
+{
+    acoustic_device_t *aDev = acoustics();
 
     snd_pcm_sframes_t n;
     size_t            sent = 0;
-    status_t          err;
+
+    // A misbehaving driver must not hold the caller for longer than this.
+    // Whatever was queued by then is reported back as a partial write.
+    nsecs_t deadline = systemTime() + writeTimeout();
+
+    resume();
+
+    if (mReopenPending) {
+        mReopenPending = false;
+        mHandle->module->open(mHandle, mHandle->curDev, mHandle->curMode);
+
+        if (aDev && aDev->recover) aDev->recover(aDev, -EBADFD);
+    }
+
+    if (!mHandle->handle) return static_cast<ssize_t>(NO_INIT);
+
+    if (mHandle->generation != mStartGeneration) applyStartPolicy();
+    if (mStartPolicy == START_PREFILL) prefill();
 
     do {
-        n = snd_pcm_writei(mHandle->handle,
-                           (char *)buffer + sent,
-                           snd_pcm_bytes_to_frames(mHandle->handle, bytes - sent));
+        if (systemTime() >= deadline) {
+            LOGW("Write timed out after %u of %u bytes", sent, bytes);
+            break;
+        }
+
+        snd_pcm_uframes_t frames =
+                snd_pcm_bytes_to_frames(mHandle->handle, bytes - sent);
+
+        if (mStartPolicy == START_SCHEDULED) scheduleStart(frames, deadline);
+
+        // Period interrupts are off for timer scheduled streams, so nothing
+        // would wake a blocking write. Only hand ALSA what fits right now.
+        n = mHandle->tsched ? tschedWait(frames, deadline) : frames;
+
+        if (n >= 0) {
+            if ((snd_pcm_uframes_t)n < frames) frames = n;
+
+            if (mHandle->access == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+                n = mmapWrite(mHandle->handle, (char *)buffer + sent, frames,
+                        mHandle->nonBlock, mStartThreshold);
+            else
+                n = snd_pcm_writei(mHandle->handle, (char *)buffer + sent, frames);
+        }
+
+        if (n == -EAGAIN) {
+            // Non-blocking PCM with a full buffer. Wait for room, but no
+            // longer than the deadline allows.
+            nsecs_t left = deadline - systemTime();
+            if (left <= 0) continue;
+
+            n = snd_pcm_wait(mHandle->handle, left / 1000000 + 1);
+            if (n >= 0) continue;
+        }
+
         if (n == -EBADFD) {
             // Somehow the stream is in a bad state. The driver probably
             // has a bug and snd_pcm_recover() doesn't seem to handle this.
+            // Reopening takes a while; leave it to the next write if this
+            // one is out of time.
+            if (systemTime() >= deadline) {
+                mReopenPending = true;
+                break;
+            }
+
             mHandle->module->open(mHandle, mHandle->curDev, mHandle->curMode);
 
             if (aDev && aDev->recover) aDev->recover(aDev, n);
@@ -107,21 +1396,101 @@ ssize_t AudioStreamOutALSA::write(const void *buffer, size_t bytes)
 
                 if (aDev && aDev->recover) aDev->recover(aDev, n);
 
-                if (n) return static_cast<ssize_t>(n);
+                if (n) return sent ? sent : static_cast<ssize_t>(n);
             }
         }
         else {
+            size_t written = snd_pcm_frames_to_bytes(mHandle->handle, n);
+
+            // Read/write streams fade and crossfade from the tail; memory
+            // mapped ones have what they wrote in the DMA area.
+            if (mHandle->access != SND_PCM_ACCESS_MMAP_INTERLEAVED &&
+                (mCrossfade || !mDrainOnStop))
+                keepTail((char *)buffer + sent, written);
+
             mFrameCount += n;
-            sent += static_cast<ssize_t>(snd_pcm_frames_to_bytes(mHandle->handle, n));
+            sent += static_cast<ssize_t>(written);
         }
 
     } while (mHandle->handle && sent < bytes);
 
+    if (!sent && bytes && systemTime() >= deadline)
+        return static_cast<ssize_t>(TIMED_OUT);
+
     return sent;
 }
 
+// Called with mLock held.
+ssize_t AudioStreamOutALSA::writeBacklog()
+{
+    ssize_t n = writeFrames(mBacklog, mBacklogFill);
+
+    if (n > 0) {
+        mBacklogFill -= n;
+        memmove(mBacklog, mBacklog + n, mBacklogFill);
+    }
+
+    return n;
+}
+
+bool AudioStreamOutALSA::keepBacklog(const void *buffer, size_t bytes)
+{
+    if (bytes > mBacklogSize) {
+        char *scratch = (char *)realloc(mBacklog, bytes);
+        if (!scratch) return false;
+
+        mBacklog = scratch;
+        mBacklogSize = bytes;
+    }
+
+    memcpy(mBacklog, buffer, bytes);
+    mBacklogFill = bytes;
+    return true;
+}
+
+nsecs_t AudioStreamOutALSA::writeTimeout() const
+{
+    if (mWriteTimeout) return mWriteTimeout;
+
+    // A healthy device frees the whole buffer within one buffer time.
+    nsecs_t timeout = (nsecs_t)mHandle->latency * 2000;
+    return timeout > 50000000 ? timeout : 50000000;
+}
+
 status_t AudioStreamOutALSA::dump(int fd, const Vector<String16>& args)
 {
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    String8 result;
+    sp<ALSAOutputMixer> mixer = outputMixer();
+    bool writing;
+
+    {
+        AutoMutex lock(mRingLock);
+        writing = mWriter != 0;
+    }
+
+    if (mixer != 0) {
+        snprintf(buffer, SIZE, "Output mixed on a shared PCM\n");
+        result.append(buffer);
+    }
+
+    if (mRing) {
+        snprintf(buffer, SIZE, "Output ring: %u of %u bytes queued, high water %u\n",
+                mRing->available(), mRing->size(), mRingHighWater);
+        result.append(buffer);
+        snprintf(buffer, SIZE, "Output ring: writer %s, %u full waits, %u empty waits\n",
+                writing ? "running" : "idle", mRingFullWaits, mRingEmptyWaits);
+        result.append(buffer);
+    }
+
+    if (mTee != 0) {
+        snprintf(buffer, SIZE, "Acoustics reference: %u blocks dropped\n",
+                mTee->dropped());
+        result.append(buffer);
+    }
+
+    ::write(fd, result.string(), result.size());
     return NO_ERROR;
 }
 
@@ -134,36 +1503,74 @@ status_t AudioStreamOutALSA::open(int mode)
 
 status_t AudioStreamOutALSA::close()
 {
+    if (mRing) {
+        if (mDrainOnStop) drainRing();
+        stopWriter();
+    }
+
+    if (mTee != 0) mTee->stop();
+
+    if (mShared) {
+        sp<ALSAOutputMixer> mixer = outputMixer();
+
+        // The last track out stops the mixer, which closes the PCM.
+        if (mixer != 0 && mixer->removeTrack(this) == 0) mixer->stop();
+
+        AutoMutex lock(mRingLock);
+        mMixer.clear();
+        return NO_ERROR;
+    }
+
     AutoMutex lock(mLock);
 
-    snd_pcm_drain (mHandle->handle);
+    if (mRing) mRing->flush();
+
+    stopPlayback();
     ALSAStreamOps::close();
+    mBacklogFill = 0;
 
-    if (mPowerLock) {
-        release_wake_lock ("AudioOutLock");
-        mPowerLock = false;
-    }
+    releasePowerLock();
 
     return NO_ERROR;
 }
 
 status_t AudioStreamOutALSA::standby()
 {
+    if (mRing && mDrainOnStop) drainRing();
+
+    // The PCM goes to standby when the mixer runs out of data.
+    sp<ALSAOutputMixer> mixer = outputMixer();
+
+    if (mixer != 0) {
+        mixer->flush(this);
+
+        AutoMutex lock(mLock);
+        mResampler.reset();
+        return NO_ERROR;
+    }
+
     AutoMutex lock(mLock);
 
+    if (mRing) mRing->flush();
+
     if (mHandle->module->standby)
     // allow hw specific modules to imlement unique standby
     // if needed
         mHandle->module->standby(mHandle);
     else
-        snd_pcm_drain (mHandle->handle);
+        stopPlayback();
 
-    if (mPowerLock) {
-        release_wake_lock ("AudioOutLock");
-        mPowerLock = false;
-    }
+    // Sounds often come in bursts; the idle monitor keeps the wake lock
+    // across short gaps instead.
+    if (!mParent->mIdleMonitor->holdTime()) releasePowerLock();
 
     mFrameCount = 0;
+    mClockTime = 0;
+    mStartAt = 0;
+    mResampler.reset();
+    mBacklogFill = 0;
+
+    if (mTee != 0) mTee->reset();
 
     return NO_ERROR;
 }
@@ -180,7 +1587,93 @@ uint32_t AudioStreamOutALSA::latency() const
 // the output has exited standby
 status_t AudioStreamOutALSA::getRenderPosition(uint32_t *dspFrames)
 {
-    *dspFrames = mFrameCount;
+    AutoMutex lock(mLock);
+
+    uint64_t frames;
+    struct timespec timestamp;
+
+    status_t err = presentationPosition(&frames, &timestamp);
+    if (err == NO_ERROR) *dspFrames = static_cast<uint32_t>(frames);
+
+    return err;
+}
+
+status_t AudioStreamOutALSA::getPresentationPosition(uint64_t *frames,
+        struct timespec *timestamp)
+{
+    AutoMutex lock(mLock);
+
+    return presentationPosition(frames, timestamp);
+}
+
+status_t AudioStreamOutALSA::presentationPosition(uint64_t *frames,
+        struct timespec *timestamp)
+{
+    // A track's frames are counted by the mixer, which owns the PCM.
+    sp<ALSAOutputMixer> mixer = outputMixer();
+
+    if (mixer != 0) {
+        device_config_t device;
+        deviceConfig(&device);
+
+        status_t err = mixer->position(this, frames, timestamp);
+        if (err == NO_ERROR && device.rate != mSampleRate)
+            *frames = *frames * mSampleRate / device.rate;
+
+        return err;
+    }
+
+    if (!mHandle->handle) return NO_INIT;
+
+    snd_pcm_status_t *status;
+    snd_pcm_status_alloca(&status);
+
+    int err = snd_pcm_status(mHandle->handle, status);
+    if (err < 0) {
+        LOGE("Unable to get PCM status: %s", snd_strerror(err));
+        return INVALID_OPERATION;
+    }
+
+    // Frames still queued between us and the DAC. The kernel only reports a
+    // delay while the DMA is running; before that everything written is
+    // still in the buffer, and after an underrun all of it has played.
+    snd_pcm_sframes_t delay = 0;
+    snd_htimestamp_t tstamp = { 0, 0 };
+
+    switch (snd_pcm_status_get_state(status)) {
+        case SND_PCM_STATE_RUNNING:
+        case SND_PCM_STATE_DRAINING:
+            delay = snd_pcm_status_get_delay(status);
+            snd_pcm_status_get_htstamp(status, &tstamp);
+            break;
+
+        case SND_PCM_STATE_PREPARED: {
+            snd_pcm_uframes_t bufferSize, periodSize;
+            snd_pcm_get_params(mHandle->handle, &bufferSize, &periodSize);
+            delay = bufferSize - snd_pcm_status_get_avail(status);
+            break;
+        }
+
+        default:
+            break;
+    }
+
+    // Positions are reported on CLOCK_MONOTONIC; use the current time if
+    // the device did not provide a stamp.
+    if (tstamp.tv_sec == 0 && tstamp.tv_nsec == 0)
+        clock_gettime(CLOCK_MONOTONIC, &tstamp);
+    else
+        tstamp = monotonicStamp(tstamp);
+
+    if (delay < 0) delay = 0;
+
+    *frames = mFrameCount > (uint64_t)delay ? mFrameCount - delay : 0;
+    *timestamp = tstamp;
+
+    // mFrameCount counts device frames; report them at the client rate.
+    uint32_t rate = deviceRate();
+    if (rate != mSampleRate) *frames = *frames * mSampleRate / rate;
+
     return NO_ERROR;
 }
 
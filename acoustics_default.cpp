@@ -67,7 +67,7 @@ static int s_device_open(const hw_module_t* module, const char* name,
     dev->cleanup = s_cleanup;
     dev->set_params = s_set_params;
 
-    // read, write, and recover are optional methods...
+    // read, write, recover, write_reference and process are optional methods...
 
     *device = &dev->common;
     return 0;
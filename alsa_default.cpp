@@ -15,8 +15,16 @@
  ** limitations under the License.
  */
 
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
 #define LOG_TAG "ALSAModule"
 #include <utils/Log.h>
+#include <cutils/atomic.h>
 
 #include "AudioHardwareALSA.h"
 #include <media/AudioRecord.h>
@@ -33,6 +41,41 @@
 #define ALSA_DEFAULT_SAMPLE_RATE 44100 // in Hz
 #endif
 
+#ifdef ALSA_PLAYBACK_MMAP
+#define ALSA_PLAYBACK_ACCESS SND_PCM_ACCESS_MMAP_INTERLEAVED
+#else
+#define ALSA_PLAYBACK_ACCESS SND_PCM_ACCESS_RW_INTERLEAVED
+#endif
+
+#ifdef ALSA_CAPTURE_MMAP
+#define ALSA_CAPTURE_ACCESS SND_PCM_ACCESS_MMAP_INTERLEAVED
+#else
+#define ALSA_CAPTURE_ACCESS SND_PCM_ACCESS_RW_INTERLEAVED
+#endif
+
+#ifdef ALSA_PLAYBACK_NONBLOCK
+#define ALSA_PLAYBACK_NONBLOCKING true
+#else
+#define ALSA_PLAYBACK_NONBLOCKING false
+#endif
+
+#ifdef ALSA_PLAYBACK_TSCHED
+#define ALSA_PLAYBACK_TIMER_SCHEDULED true
+#else
+#define ALSA_PLAYBACK_TIMER_SCHEDULED false
+#endif
+
+// Closed PCMs kept open and configured for reuse; 0 disables the pool.
+#ifndef ALSA_PCM_POOL_SIZE
+#define ALSA_PCM_POOL_SIZE 4
+#endif
+
+// Where negotiated hardware parameters are remembered; "" keeps them in
+// memory only.
+#ifndef ALSA_PARAMS_CACHE
+#define ALSA_PARAMS_CACHE "/data/misc/audio/alsa_params"
+#endif
+
 namespace android
 {
 
@@ -41,7 +84,11 @@ static int s_device_close(hw_device_t*);
 static status_t s_init(alsa_device_t *, ALSAHandleList &);
 static status_t s_open(alsa_handle_t *, uint32_t, int);
 static status_t s_close(alsa_handle_t *);
+static status_t s_drop(alsa_handle_t *);
 static status_t s_route(alsa_handle_t *, uint32_t, int);
+static status_t s_openNext(alsa_handle_t *, alsa_handle_t *, uint32_t, int);
+static status_t s_takeover(alsa_handle_t *, alsa_handle_t *);
+static nsecs_t s_trim(nsecs_t);
 
 static hw_module_methods_t s_module_methods = {
     open            : s_device_open
@@ -77,13 +124,20 @@ static int s_device_open(const hw_module_t* module, const char* name,
     dev->open = s_open;
     dev->close = s_close;
     dev->route = s_route;
+    dev->drop = s_drop;
+    dev->trim = s_trim;
+    dev->openNext = s_openNext;
+    dev->takeover = s_takeover;
 
     *device = &dev->common;
     return 0;
 }
 
+static bool poolClear();
+
 static int s_device_close(hw_device_t* device)
 {
+    poolClear();
     free(device);
     return 0;
 }
@@ -108,7 +162,56 @@ static alsa_handle_t _defaultsOut = {
     sampleRate  : DEFAULT_SAMPLE_RATE,
     latency     : 200000, // Desired Delay in usec
     bufferSize  : DEFAULT_SAMPLE_RATE / 5, // Desired Number of samples
+    access      : ALSA_PLAYBACK_ACCESS,
+    periods     : 4,
+    profile     : ALSA_PROFILE_DEFAULT,
+    tsched      : ALSA_PLAYBACK_TIMER_SCHEDULED,
+    nonBlock    : ALSA_PLAYBACK_NONBLOCKING,
+    generation  : 0,
+    modPrivate  : 0,
+    state       : 0,
+};
+
+static alsa_handle_t _defaultsOutLowLatency = {
+    module      : 0,
+    devices     : AudioSystem::DEVICE_OUT_ALL,
+    curDev      : 0,
+    curMode     : 0,
+    handle      : 0,
+    format      : SND_PCM_FORMAT_S16_LE, // AudioSystem::PCM_16_BIT
+    channels    : 2,
+    sampleRate  : DEFAULT_SAMPLE_RATE,
+    latency     : 10000, // Desired Delay in usec: 2 periods of 5 ms
+    bufferSize  : 512, // Desired Number of samples
+    access      : ALSA_PLAYBACK_ACCESS,
+    periods     : 2,
+    profile     : ALSA_PROFILE_LOW_LATENCY,
+    tsched      : false,
+    nonBlock    : ALSA_PLAYBACK_NONBLOCKING,
+    generation  : 0,
+    modPrivate  : 0,
+    state       : 0,
+};
+
+static alsa_handle_t _defaultsOutDeepBuffer = {
+    module      : 0,
+    devices     : AudioSystem::DEVICE_OUT_ALL,
+    curDev      : 0,
+    curMode     : 0,
+    handle      : 0,
+    format      : SND_PCM_FORMAT_S16_LE, // AudioSystem::PCM_16_BIT
+    channels    : 2,
+    sampleRate  : DEFAULT_SAMPLE_RATE,
+    latency     : 1000000, // Desired Delay in usec: 2 periods of 500 ms
+    bufferSize  : DEFAULT_SAMPLE_RATE, // Desired Number of samples
+    access      : ALSA_PLAYBACK_ACCESS,
+    periods     : 2,
+    profile     : ALSA_PROFILE_DEEP_BUFFER,
+    tsched      : ALSA_PLAYBACK_TIMER_SCHEDULED,
+    nonBlock    : ALSA_PLAYBACK_NONBLOCKING,
+    generation  : 0,
     modPrivate  : 0,
+    state       : 0,
 };
 
 static alsa_handle_t _defaultsIn = {
@@ -122,7 +225,14 @@ static alsa_handle_t _defaultsIn = {
     sampleRate  : AudioRecord::DEFAULT_SAMPLE_RATE,
     latency     : 250000, // Desired Delay in usec
     bufferSize  : 2048, // Desired Number of samples
+    access      : ALSA_CAPTURE_ACCESS,
+    periods     : 4,
+    profile     : ALSA_PROFILE_DEFAULT,
+    tsched      : false,
+    nonBlock    : false,
+    generation  : 0,
     modPrivate  : 0,
+    state       : 0,
 };
 
 struct device_suffix_t {
@@ -151,9 +261,11 @@ snd_pcm_stream_t direction(alsa_handle_t *handle)
             : SND_PCM_STREAM_CAPTURE;
 }
 
-const char *deviceName(alsa_handle_t *handle, uint32_t device, int mode)
+// Builds the most specific name for a route into devString, which holds
+// ALSA_NAME_MAX characters.
+static void deviceName(alsa_handle_t *handle, uint32_t device, int mode,
+                       char *devString)
 {
-    static char devString[ALSA_NAME_MAX];
     int hasDevExt = 0;
 
     strcpy(devString, devicePrefix[direction(handle)]);
@@ -179,8 +291,111 @@ const char *deviceName(alsa_handle_t *handle, uint32_t device, int mode)
         ;
         break;
     };
+}
+
+// ----------------------------------------------------------------------------
+// Each route is mapped to a PCM name once: the most specific name the
+// alsa-lib configuration defines, dropping suffixes from the full name
+// until one is, and "default" if none is. The map lasts as long as the
+// module; PCMs added to the configuration later are not picked up.
+
+struct pcm_route_t {
+    snd_pcm_stream_t    stream;
+    uint32_t            devices;
+    int                 mode;
+    char                name[ALSA_NAME_MAX];
+};
+
+static List<pcm_route_t> pcmRoutes;
+static pthread_mutex_t pcmRoutesLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns the configuration snd_pcm_open() goes by, or 0. The global tree
+// may be reloaded and freed by an open on another thread, so it is only
+// searched through a reference. Older alsa-lib cannot hand one out; there
+// a private copy is loaded instead.
+static snd_config_t *configGet()
+{
+    snd_config_t *top = 0;
+
+#if SND_LIB_VERSION >= 0x01001c
+    if (snd_config_update_ref(&top) < 0) return 0;
+#else
+    snd_config_update_t *update = 0;
+
+    if (snd_config_update_r(&top, &update, NULL) < 0) return 0;
+    snd_config_update_free(update);
+#endif
+
+    return top;
+}
 
-    return devString;
+static void configPut(snd_config_t *top)
+{
+#if SND_LIB_VERSION >= 0x01001c
+    snd_config_unref(top);
+#else
+    snd_config_delete(top);
+#endif
+}
+
+static bool pcmDefined(snd_config_t *top, const char *name)
+{
+    char key[ALSA_NAME_MAX + 4];
+    snd_config_t *node;
+
+    snprintf(key, sizeof(key), "pcm.%s", name);
+
+    return snd_config_search(top, key, &node) == 0;
+}
+
+// Copies the name of the PCM to open for a route into name, which holds
+// ALSA_NAME_MAX characters.
+static void pcmName(alsa_handle_t *handle, uint32_t devices, int mode, char *name)
+{
+    snd_pcm_stream_t stream = direction(handle);
+
+    pthread_mutex_lock(&pcmRoutesLock);
+
+    List<pcm_route_t>::iterator it = pcmRoutes.begin();
+
+    while (it != pcmRoutes.end() &&
+           (it->stream != stream || it->devices != devices || it->mode != mode))
+        ++it;
+
+    if (it != pcmRoutes.end()) {
+        strcpy(name, it->name);
+        pthread_mutex_unlock(&pcmRoutesLock);
+        return;
+    }
+
+    pcm_route_t route;
+    snd_config_t *top = configGet();
+
+    route.stream = stream;
+    route.devices = devices;
+    route.mode = mode;
+    deviceName(handle, devices, mode, route.name);
+
+    // Without a configuration, try the full name and look again next time.
+    while (top && !pcmDefined(top, route.name)) {
+        char *tail = strrchr(route.name, '_');
+        if (!tail) {
+            strcpy(route.name, "default");
+            break;
+        }
+        *tail = 0;
+    }
+
+    if (top) {
+        LOGV("Devices %08x in mode %d map to PCM %s", devices, mode, route.name);
+
+        pcmRoutes.push_back(route);
+        configPut(top);
+    }
+
+    strcpy(name, route.name);
+
+    pthread_mutex_unlock(&pcmRoutesLock);
 }
 
 const char *streamName(alsa_handle_t *handle)
@@ -218,9 +433,18 @@ status_t setHardwareParams(alsa_handle_t *handle)
         goto done;
     }
 
-    // Set the interleaved read and write format.
+    // Set the interleaved read and write format. Memory mapped access lets
+    // the stream copy straight into the DMA buffer, but not every device
+    // (or plugin chain) supports it, so fall back to plain read/write.
     err = snd_pcm_hw_params_set_access(handle->handle, hardwareParams,
-            SND_PCM_ACCESS_RW_INTERLEAVED);
+            handle->access);
+    if (err < 0 && handle->access != SND_PCM_ACCESS_RW_INTERLEAVED) {
+        LOGW("Unable to configure PCM mmap access, using read/write: %s",
+                snd_strerror(err));
+        handle->access = SND_PCM_ACCESS_RW_INTERLEAVED;
+        err = snd_pcm_hw_params_set_access(handle->handle, hardwareParams,
+                handle->access);
+    }
     if (err < 0) {
         LOGE("Unable to configure PCM read/write format: %s",
                 snd_strerror(err));
@@ -229,6 +453,33 @@ status_t setHardwareParams(alsa_handle_t *handle)
 
     err = snd_pcm_hw_params_set_format(handle->handle, hardwareParams,
             handle->format);
+    if (err < 0) {
+        // Codecs that only take wider (or packed) samples get them from the
+        // stream's converter rather than from an alsa-lib plug layer.
+        static const snd_pcm_format_t fallback[] = {
+            SND_PCM_FORMAT_S16_LE,
+            SND_PCM_FORMAT_S32_LE,
+            SND_PCM_FORMAT_S24_LE,
+            SND_PCM_FORMAT_S24_3LE,
+            SND_PCM_FORMAT_FLOAT_LE,
+        };
+
+        for (size_t i = 0; i < sizeof(fallback) / sizeof(fallback[0]); i++) {
+            if (fallback[i] == handle->format ||
+                snd_pcm_hw_params_test_format(handle->handle, hardwareParams,
+                        fallback[i]) < 0)
+                continue;
+
+            LOGW("PCM format %s unsupported, using %s", formatName,
+                    snd_pcm_format_name(fallback[i]));
+            handle->format = fallback[i];
+            formatName = snd_pcm_format_name(handle->format);
+            formatDesc = snd_pcm_format_description(handle->format);
+            err = snd_pcm_hw_params_set_format(handle->handle, hardwareParams,
+                    handle->format);
+            break;
+        }
+    }
     if (err < 0) {
         LOGE("Unable to configure PCM format %s (%s): %s",
                 formatName, formatDesc, snd_strerror(err));
@@ -239,6 +490,19 @@ status_t setHardwareParams(alsa_handle_t *handle)
 
     err = snd_pcm_hw_params_set_channels(handle->handle, hardwareParams,
             handle->channels);
+    if (err < 0) {
+        // The stream converter reorders or downmixes to whatever the
+        // device settles on.
+        unsigned int channels = handle->channels;
+
+        err = snd_pcm_hw_params_set_channels_near(handle->handle,
+                hardwareParams, &channels);
+        if (err >= 0) {
+            LOGW("Unable to set channel count to %i, using %u",
+                    handle->channels, channels);
+            handle->channels = channels;
+        }
+    }
     if (err < 0) {
         LOGE("Unable to set channel count to %i: %s",
                 handle->channels, snd_strerror(err));
@@ -248,6 +512,11 @@ status_t setHardwareParams(alsa_handle_t *handle)
     LOGV("Using %i %s for %s.", handle->channels,
             handle->channels == 1 ? "channel" : "channels", streamName());
 
+    // Playback streams resample in the HAL when the device cannot run at the
+    // requested rate, so keep alsa-lib's rate plugin out of the chain.
+    if (direction(handle) == SND_PCM_STREAM_PLAYBACK)
+        snd_pcm_hw_params_set_rate_resample(handle->handle, hardwareParams, 0);
+
     err = snd_pcm_hw_params_set_rate_near(handle->handle, hardwareParams,
             &requestedRate, 0);
 
@@ -256,8 +525,7 @@ status_t setHardwareParams(alsa_handle_t *handle)
                 streamName(handle), handle->sampleRate, snd_strerror(err));
     else if (requestedRate != handle->sampleRate)
         // Some devices have a fixed sample rate, and can not be changed.
-        // This may cause resampling problems; i.e. PCM playback will be too
-        // slow or fast.
+        // Output streams resample to it; capture runs at the device rate.
         LOGW("Requested rate (%u HZ) does not match actual rate (%u HZ)",
                 handle->sampleRate, requestedRate);
     else
@@ -276,63 +544,129 @@ status_t setHardwareParams(alsa_handle_t *handle)
     }
 #endif
 
-    // Make sure we have at least the size we originally wanted
-    err = snd_pcm_hw_params_set_buffer_size_near(handle->handle, hardwareParams,
-            &bufferSize);
+    if (handle->profile == ALSA_PROFILE_LOW_LATENCY) {
+        // Ask for a few small periods, but never less than the smallest
+        // period the device claims to service.
+        snd_pcm_uframes_t periodSize = (snd_pcm_uframes_t)handle->sampleRate
+                * (latency / handle->periods) / 1000000;
+        snd_pcm_uframes_t minPeriodSize;
+        unsigned int periods = handle->periods;
 
-    if (err < 0) {
-        LOGE("Unable to set buffer size to %d:  %s",
-                (int)bufferSize, snd_strerror(err));
-        goto done;
-    }
+        err = snd_pcm_hw_params_get_period_size_min(hardwareParams,
+                &minPeriodSize, NULL);
+        if (err == 0 && periodSize < minPeriodSize) periodSize = minPeriodSize;
 
-    // Setup buffers for latency
-    err = snd_pcm_hw_params_set_buffer_time_near(handle->handle,
-            hardwareParams, &latency, NULL);
-    if (err < 0) {
-        /* That didn't work, set the period instead */
-        unsigned int periodTime = latency / 4;
-        err = snd_pcm_hw_params_set_period_time_near(handle->handle,
-                hardwareParams, &periodTime, NULL);
+        err = snd_pcm_hw_params_set_period_size_near(handle->handle,
+                hardwareParams, &periodSize, NULL);
         if (err < 0) {
-            LOGE("Unable to set the period time for latency: %s", snd_strerror(err));
+            LOGE("Unable to set the period size to %lu: %s", periodSize, snd_strerror(err));
             goto done;
         }
-        snd_pcm_uframes_t periodSize;
-        err = snd_pcm_hw_params_get_period_size(hardwareParams, &periodSize,
-                NULL);
+        err = snd_pcm_hw_params_set_periods_near(handle->handle,
+                hardwareParams, &periods, NULL);
         if (err < 0) {
-            LOGE("Unable to get the period size for latency: %s", snd_strerror(err));
+            LOGE("Unable to set the period count to %u: %s", periods, snd_strerror(err));
             goto done;
         }
-        bufferSize = periodSize * 4;
-        if (bufferSize < handle->bufferSize) bufferSize = handle->bufferSize;
-        err = snd_pcm_hw_params_set_buffer_size_near(handle->handle,
-                hardwareParams, &bufferSize);
+        err = snd_pcm_hw_params_get_buffer_size(hardwareParams, &bufferSize);
         if (err < 0) {
-            LOGE("Unable to set the buffer size for latency: %s", snd_strerror(err));
+            LOGE("Unable to get the buffer size for latency: %s", snd_strerror(err));
+            goto done;
+        }
+        err = snd_pcm_hw_params_get_buffer_time(hardwareParams, &latency, NULL);
+        if (err < 0) {
+            LOGE("Unable to get the buffer time for latency: %s", snd_strerror(err));
+            goto done;
+        }
+        LOGV("Low latency: %u periods of %lu frames", periods, periodSize);
+    } else if (handle->profile == ALSA_PROFILE_DEEP_BUFFER) {
+        // Take as much buffer as the device allows, up to the requested
+        // time, and split it into a few large periods so the CPU only wakes
+        // up a couple of times per buffer.
+        unsigned int periods = handle->periods;
+
+        err = snd_pcm_hw_params_set_buffer_time_near(handle->handle,
+                hardwareParams, &latency, NULL);
+        if (err < 0) {
+            LOGE("Unable to set the buffer time to %u usec: %s", latency, snd_strerror(err));
+            goto done;
+        }
+        err = snd_pcm_hw_params_set_periods_near(handle->handle,
+                hardwareParams, &periods, NULL);
+        if (err < 0) {
+            LOGE("Unable to set the period count to %u: %s", periods, snd_strerror(err));
             goto done;
         }
-    } else {
-        // OK, we got buffer time near what we expect. See what that did for bufferSize.
         err = snd_pcm_hw_params_get_buffer_size(hardwareParams, &bufferSize);
         if (err < 0) {
             LOGE("Unable to get the buffer size for latency: %s", snd_strerror(err));
             goto done;
         }
-        // Does set_buffer_time_near change the passed value? It should.
         err = snd_pcm_hw_params_get_buffer_time(hardwareParams, &latency, NULL);
         if (err < 0) {
             LOGE("Unable to get the buffer time for latency: %s", snd_strerror(err));
             goto done;
         }
-        unsigned int periodTime = latency / 4;
-        err = snd_pcm_hw_params_set_period_time_near(handle->handle,
-                hardwareParams, &periodTime, NULL);
+        LOGV("Deep buffer: %u periods in %u usec", periods, latency);
+    } else {
+        // Make sure we have at least the size we originally wanted
+        err = snd_pcm_hw_params_set_buffer_size_near(handle->handle, hardwareParams,
+                &bufferSize);
+
         if (err < 0) {
-            LOGE("Unable to set the period time for latency: %s", snd_strerror(err));
+            LOGE("Unable to set buffer size to %d:  %s",
+                    (int)bufferSize, snd_strerror(err));
             goto done;
         }
+
+        // Setup buffers for latency
+        err = snd_pcm_hw_params_set_buffer_time_near(handle->handle,
+                hardwareParams, &latency, NULL);
+        if (err < 0) {
+            /* That didn't work, set the period instead */
+            unsigned int periodTime = latency / handle->periods;
+            err = snd_pcm_hw_params_set_period_time_near(handle->handle,
+                    hardwareParams, &periodTime, NULL);
+            if (err < 0) {
+                LOGE("Unable to set the period time for latency: %s", snd_strerror(err));
+                goto done;
+            }
+            snd_pcm_uframes_t periodSize;
+            err = snd_pcm_hw_params_get_period_size(hardwareParams, &periodSize,
+                    NULL);
+            if (err < 0) {
+                LOGE("Unable to get the period size for latency: %s", snd_strerror(err));
+                goto done;
+            }
+            bufferSize = periodSize * handle->periods;
+            if (bufferSize < handle->bufferSize) bufferSize = handle->bufferSize;
+            err = snd_pcm_hw_params_set_buffer_size_near(handle->handle,
+                    hardwareParams, &bufferSize);
+            if (err < 0) {
+                LOGE("Unable to set the buffer size for latency: %s", snd_strerror(err));
+                goto done;
+            }
+        } else {
+            // OK, we got buffer time near what we expect. See what that did for bufferSize.
+            err = snd_pcm_hw_params_get_buffer_size(hardwareParams, &bufferSize);
+            if (err < 0) {
+                LOGE("Unable to get the buffer size for latency: %s", snd_strerror(err));
+                goto done;
+            }
+            // Does set_buffer_time_near change the passed value? It should.
+            err = snd_pcm_hw_params_get_buffer_time(hardwareParams, &latency, NULL);
+            if (err < 0) {
+                LOGE("Unable to get the buffer time for latency: %s", snd_strerror(err));
+                goto done;
+            }
+            unsigned int periodTime = latency / handle->periods;
+            err = snd_pcm_hw_params_set_period_time_near(handle->handle,
+                    hardwareParams, &periodTime, NULL);
+            if (err < 0) {
+                LOGE("Unable to set the period time for latency: %s", snd_strerror(err));
+                goto done;
+            }
+        }
     }
 
     LOGV("Buffer size: %d", (int)bufferSize);
@@ -341,6 +675,22 @@ status_t setHardwareParams(alsa_handle_t *handle)
     handle->bufferSize = bufferSize;
     handle->latency = latency;
 
+    // With timer based scheduling the stream refills the buffer from a
+    // timer, so the period interrupts would only cause needless wakeups.
+    if (handle->tsched) {
+        if (snd_pcm_hw_params_can_disable_period_wakeup(hardwareParams))
+            err = snd_pcm_hw_params_set_period_wakeup(handle->handle,
+                    hardwareParams, 0);
+        else
+            err = -ENOSYS;
+
+        if (err < 0) {
+            LOGW("Unable to disable period wakeups, using interrupts: %s",
+                    snd_strerror(err));
+            handle->tsched = false;
+        }
+    }
+
     // Commit the hardware parameters back to the device.
     err = snd_pcm_hw_params(handle->handle, hardwareParams);
     if (err < 0) LOGE("Unable to set hardware parameters: %s", snd_strerror(err));
@@ -358,7 +708,7 @@ status_t setSoftwareParams(alsa_handle_t *handle)
 
     snd_pcm_uframes_t bufferSize = 0;
     snd_pcm_uframes_t periodSize = 0;
-    snd_pcm_uframes_t startThreshold, stopThreshold;
+    snd_pcm_uframes_t startThreshold, stopThreshold, availMin;
 
     if (snd_pcm_sw_params_malloc(&softwareParams) < 0) {
         LOG_ALWAYS_FATAL("Failed to allocate ALSA software parameters!");
@@ -375,7 +725,12 @@ status_t setSoftwareParams(alsa_handle_t *handle)
     // Configure ALSA to start the transfer when the buffer is almost full.
     snd_pcm_get_params(handle->handle, &bufferSize, &periodSize);
 
-    if (handle->devices & AudioSystem::DEVICE_OUT_ALL) {
+    if (handle->profile == ALSA_PROFILE_LOW_LATENCY) {
+        // The whole buffer is only a couple of periods, so start as soon as
+        // the first period is queued and wake up for every period.
+        startThreshold = periodSize;
+        stopThreshold = bufferSize;
+    } else if (handle->devices & AudioSystem::DEVICE_OUT_ALL) {
         // For playback, configure ALSA to start the transfer when the
         // buffer is full.
         startThreshold = bufferSize - 1;
@@ -403,13 +758,42 @@ status_t setSoftwareParams(alsa_handle_t *handle)
         goto done;
     }
 
+    // Timestamp status reports at the last hardware pointer update, so the
+    // delay and the timestamp returned by snd_pcm_status() describe the
+    // same instant.
+    err = snd_pcm_sw_params_set_tstamp_mode(handle->handle, softwareParams,
+            SND_PCM_TSTAMP_ENABLE);
+    if (err < 0) {
+        LOGE("Unable to enable timestamps: %s", snd_strerror(err));
+        goto done;
+    }
+
+#if SND_LIB_VERSION >= 0x01001c
+    // On the clock presentation positions are reported on. Without it the
+    // stamps are wall clock time, which the stream converts.
+    if (snd_pcm_sw_params_set_tstamp_type(handle->handle, softwareParams,
+            SND_PCM_TSTAMP_TYPE_MONOTONIC) < 0)
+        LOGW("No monotonic timestamps on %s", streamName(handle));
+#endif
+
+    // No silence filling; a stream that wants it turns it on itself.
+    err = snd_pcm_sw_params_set_silence_threshold(handle->handle, softwareParams, 0);
+    if (err == 0)
+        err = snd_pcm_sw_params_set_silence_size(handle->handle, softwareParams, 0);
+    if (err < 0) {
+        LOGE("Unable to turn off silence filling: %s", snd_strerror(err));
+        goto done;
+    }
+
     // Allow the transfer to start when at least periodSize samples can be
-    // processed.
+    // processed. Timer scheduled streams never wait inside ALSA, so there
+    // is nothing to wake up for until the whole buffer is free.
+    availMin = handle->tsched ? bufferSize : periodSize;
     err = snd_pcm_sw_params_set_avail_min(handle->handle, softwareParams,
-            periodSize);
+            availMin);
     if (err < 0) {
         LOGE("Unable to configure available minimum to %lu: %s",
-                periodSize, snd_strerror(err));
+                availMin, snd_strerror(err));
         goto done;
     }
 
@@ -424,12 +808,76 @@ status_t setSoftwareParams(alsa_handle_t *handle)
     return err;
 }
 
+// ----------------------------------------------------------------------------
+// An open writes what it negotiated back into the handle, so by the next
+// open the handle no longer says what was asked for. The request is kept
+// here, next to the result, for the pool and the parameter cache to be
+// keyed on.
+
+struct handle_private_t {
+    bool                opened;
+    bool                spare;          // allocated by s_openNext()
+    alsa_handle_t       request;
+    alsa_handle_t       result;
+};
+
+// One for each handle s_init() hands out.
+static handle_private_t handlePrivate[4];
+
+// Copies what an open negotiates from one handle to another.
+static void takeResult(alsa_handle_t *handle, const alsa_handle_t *result)
+{
+    handle->access = result->access;
+    handle->format = result->format;
+    handle->channels = result->channels;
+    handle->bufferSize = result->bufferSize;
+    handle->latency = result->latency;
+    handle->tsched = result->tsched;
+}
+
+// Puts back the request of every field the last open negotiated and the
+// caller has not changed since.
+static void restoreRequest(alsa_handle_t *handle)
+{
+    handle_private_t *priv = (handle_private_t *)handle->modPrivate;
+    if (!priv || !priv->opened) return;
+
+    const alsa_handle_t *request = &priv->request;
+    const alsa_handle_t *result = &priv->result;
+
+    if (handle->access == result->access) handle->access = request->access;
+    if (handle->format == result->format) handle->format = request->format;
+    if (handle->channels == result->channels) handle->channels = request->channels;
+    if (handle->bufferSize == result->bufferSize) handle->bufferSize = request->bufferSize;
+    if (handle->latency == result->latency) handle->latency = request->latency;
+    if (handle->tsched == result->tsched) handle->tsched = request->tsched;
+}
+
+static void rememberRequest(alsa_handle_t *handle, const alsa_handle_t *request)
+{
+    handle_private_t *priv = (handle_private_t *)handle->modPrivate;
+    if (!priv) return;
+
+    priv->request = *request;
+    priv->request.handle = 0;
+    priv->result = *handle;
+    priv->result.handle = 0;
+    priv->opened = true;
+}
+
 // ----------------------------------------------------------------------------
 
 static status_t s_init(alsa_device_t *module, ALSAHandleList &list)
 {
     list.clear();
 
+    memset(handlePrivate, 0, sizeof(handlePrivate));
+
+    _defaultsOut.modPrivate = &handlePrivate[0];
+    _defaultsOutLowLatency.modPrivate = &handlePrivate[1];
+    _defaultsOutDeepBuffer.modPrivate = &handlePrivate[2];
+    _defaultsIn.modPrivate = &handlePrivate[3];
+
     snd_pcm_uframes_t bufferSize = _defaultsOut.bufferSize;
 
     for (size_t i = 1; (bufferSize & ~i) != 0; i <<= 1)
@@ -440,6 +888,17 @@ static status_t s_init(alsa_device_t *module, ALSAHandleList &list)
 
     list.push_back(_defaultsOut);
 
+    // The low latency and deep buffer profiles keep their exact buffer
+    // sizes; they are negotiated from the period layout rather than rounded
+    // to a power of two.
+    _defaultsOutLowLatency.module = module;
+
+    list.push_back(_defaultsOutLowLatency);
+
+    _defaultsOutDeepBuffer.module = module;
+
+    list.push_back(_defaultsOutDeepBuffer);
+
     bufferSize = _defaultsIn.bufferSize;
 
     for (size_t i = 1; (bufferSize & ~i) != 0; i <<= 1)
@@ -453,53 +912,707 @@ static status_t s_init(alsa_device_t *module, ALSAHandleList &list)
     return NO_ERROR;
 }
 
-static status_t s_open(alsa_handle_t *handle, uint32_t devices, int mode)
+// Ask for the channels in AudioSystem order, so streams do not need to
+// reorder them. Devices with a fixed map keep it and streams reorder to it.
+static void setChannelMap(alsa_handle_t *handle)
+{
+#ifdef SND_CHMAP_API_VERSION
+    if (direction(handle) != SND_PCM_STREAM_PLAYBACK) return;
+
+    snd_pcm_chmap_query_t **maps = snd_pcm_query_chmaps(handle->handle);
+    bool settable = false;
+
+    for (int i = 0; maps && maps[i]; i++)
+        if (maps[i]->map.channels == handle->channels &&
+            maps[i]->type != SND_CHMAP_TYPE_FIXED)
+            settable = true;
+
+    snd_pcm_free_chmaps(maps);
+
+    if (!settable) return;
+
+    uint32_t mask = alsa_channel_mask(handle->channels);
+    snd_pcm_chmap_t *map = (snd_pcm_chmap_t *)malloc(sizeof(*map) +
+            handle->channels * sizeof(map->pos[0]));
+    if (!map) return;
+
+    map->channels = 0;
+
+    for (uint32_t bit = 1; bit && map->channels < handle->channels; bit <<= 1)
+        if (mask & bit)
+            map->pos[map->channels++] = handle->channels == 1 ?
+                    SND_CHMAP_MONO : alsa_chmap_position(bit);
+
+    int err = snd_pcm_set_chmap(handle->handle, map);
+    if (err < 0)
+        LOGW("Unable to set %u channel map: %s", handle->channels,
+                snd_strerror(err));
+
+    free(map);
+#endif
+}
+
+// Length of the fade applied to queued playback when it is cut short.
+static const unsigned int FADE_MS = 5;
+
+// Scales frames in place from full level down to silence.
+static void fadeFrames(char *data, snd_pcm_format_t format, unsigned int channels,
+        snd_pcm_uframes_t offset, snd_pcm_uframes_t frames, snd_pcm_uframes_t length)
+{
+    size_t sampleBytes = snd_pcm_format_physical_width(format) / 8;
+
+    for (snd_pcm_uframes_t f = 0; f < frames; f++) {
+        float gain = 1.0f - (float)(offset + f + 1) / length;
+
+        for (unsigned int c = 0; c < channels; c++)
+            alsa_scale_sample(data + (f * channels + c) * sampleBytes, format, gain);
+    }
+}
+
+// The rate the PCM was configured with; handle->sampleRate is only what
+// was asked for.
+static unsigned int pcmRate(alsa_handle_t *handle)
+{
+    snd_pcm_hw_params_t *params;
+    unsigned int rate;
+
+    snd_pcm_hw_params_alloca(&params);
+
+    if (snd_pcm_hw_params_current(handle->handle, params) == 0 &&
+        snd_pcm_hw_params_get_rate(params, &rate, 0) == 0)
+        return rate;
+
+    return handle->sampleRate;
+}
+
+// Fades out what a running memory mapped playback stream still has queued,
+// a few milliseconds past the hardware pointer, and silences the rest. The
+// frames are still in the DMA buffer, so rewinding lets us rewrite them.
+// Returns whether the fade is in; it plays out without anyone waiting.
+static bool fadeOut(alsa_handle_t *handle)
+{
+    snd_pcm_t *pcm = handle->handle;
+    snd_pcm_uframes_t fade = pcmRate(handle) * FADE_MS / 1000;
+
+    snd_pcm_sframes_t rewindable = snd_pcm_rewindable(pcm);
+
+    // Leave the first fade length alone; the DMA may have fetched it already.
+    if (rewindable <= (snd_pcm_sframes_t)(2 * fade)) return false;
+
+    snd_pcm_sframes_t rewound = snd_pcm_rewind(pcm, rewindable - fade);
+    if (rewound <= 0) return false;
+
+    // Everything rewound is written again, so the application pointer ends
+    // up where it was and nothing but silence follows the fade.
+    snd_pcm_uframes_t total = rewound;
+    snd_pcm_uframes_t done = 0;
+
+    while (done < total) {
+        const snd_pcm_channel_area_t *areas;
+        snd_pcm_uframes_t offset;
+        snd_pcm_uframes_t frames = total - done;
+
+        if (snd_pcm_mmap_begin(pcm, &areas, &offset, &frames) < 0 || !frames) break;
+
+        // Interleaved access; every channel shares the first area.
+        char *data = (char *)areas[0].addr + (areas[0].first + offset * areas[0].step) / 8;
+        snd_pcm_uframes_t faded = done < fade ? fade - done : 0;
+
+        if (faded > frames) faded = frames;
+        if (faded)
+            fadeFrames(data, handle->format, handle->channels, done, faded, fade);
+        if (frames > faded)
+            snd_pcm_format_set_silence(handle->format,
+                    data + snd_pcm_frames_to_bytes(pcm, faded),
+                    (frames - faded) * handle->channels);
+
+        if (snd_pcm_mmap_commit(pcm, offset, frames) < 0) break;
+        done += frames;
+    }
+
+    return done >= fade;
+}
+
+// Leaves a running playback stream fading out, if it is not already.
+// Returns whether it is. Read/write streams are faded by the stream, which
+// has the data, see AudioStreamOutALSA::fadeQueued().
+static bool fadeQueued(alsa_handle_t *handle)
+{
+    if (android_atomic_acquire_load(&handle->state) & ALSA_STATE_FADING)
+        return true;
+
+    if (direction(handle) != SND_PCM_STREAM_PLAYBACK ||
+        handle->access != SND_PCM_ACCESS_MMAP_INTERLEAVED ||
+        snd_pcm_state(handle->handle) != SND_PCM_STATE_RUNNING ||
+        !fadeOut(handle))
+        return false;
+
+    android_atomic_or(ALSA_STATE_FADING, &handle->state);
+    return true;
+}
+
+static status_t s_drop(alsa_handle_t *handle)
+{
+    if (!handle->handle) return NO_ERROR;
+
+    // A fade plays out on its own, behind the caller's back.
+    if (fadeQueued(handle)) return NO_ERROR;
+
+    snd_pcm_drop(handle->handle);
+
+    // Ready for the next write, which then needs no recovery.
+    return snd_pcm_prepare(handle->handle);
+}
+
+// ----------------------------------------------------------------------------
+// Opening and configuring a PCM takes long enough to be heard on a route
+// change. Closed PCMs are parked, stopped, under the name they were opened
+// for and the parameters they were configured with; an open that asks for
+// the same again takes one back. The least recently parked go first.
+
+struct pcm_pool_entry_t {
+    snd_pcm_t *         pcm;
+    char                name[ALSA_NAME_MAX];
+    alsa_handle_t       request;
+    alsa_handle_t       result;
+    nsecs_t             parked;         // CLOCK_MONOTONIC, as systemTime()
+};
+
+static List<pcm_pool_entry_t> pcmPool;
+static pthread_mutex_t pcmPoolLock = PTHREAD_MUTEX_INITIALIZER;
+
+static nsecs_t monotonicTime()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (nsecs_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static bool sameConfig(const alsa_handle_t *a, const alsa_handle_t *b)
+{
+    return a->format == b->format &&
+           a->channels == b->channels &&
+           a->sampleRate == b->sampleRate &&
+           a->latency == b->latency &&
+           a->bufferSize == b->bufferSize &&
+           a->access == b->access &&
+           a->periods == b->periods &&
+           a->profile == b->profile &&
+           a->tsched == b->tsched &&
+           a->nonBlock == b->nonBlock;
+}
+
+static void poolPut(alsa_handle_t *handle, snd_pcm_t *pcm, const char *name)
+{
+    if (ALSA_PCM_POOL_SIZE <= 0) {
+        snd_pcm_close(pcm);
+        return;
+    }
+
+    pcm_pool_entry_t entry;
+
+    entry.pcm = pcm;
+    strncpy(entry.name, name, ALSA_NAME_MAX - 1);
+    entry.name[ALSA_NAME_MAX - 1] = 0;
+    entry.result = *handle;
+    entry.result.handle = 0;
+    entry.request = entry.result;
+    restoreRequest(&entry.request);
+    entry.parked = monotonicTime();
+
+    pthread_mutex_lock(&pcmPoolLock);
+
+    pcmPool.push_back(entry);
+
+    while (pcmPool.size() > ALSA_PCM_POOL_SIZE) {
+        snd_pcm_close(pcmPool.begin()->pcm);
+        pcmPool.erase(pcmPool.begin());
+    }
+
+    pthread_mutex_unlock(&pcmPoolLock);
+}
+
+// Takes back a PCM parked for the handle's request, and configures the
+// handle as the PCM is.
+static snd_pcm_t *poolGet(alsa_handle_t *handle, const char *name)
+{
+    snd_pcm_t *pcm = 0;
+
+    pthread_mutex_lock(&pcmPoolLock);
+
+    for (List<pcm_pool_entry_t>::iterator it = pcmPool.begin();
+         it != pcmPool.end(); ++it)
+        if (!strcmp(it->name, name) && sameConfig(&it->request, handle)) {
+            pcm = it->pcm;
+            takeResult(handle, &it->result);
+            pcmPool.erase(it);
+            break;
+        }
+
+    pthread_mutex_unlock(&pcmPoolLock);
+
+    return pcm;
+}
+
+// Closes the PCMs parked longer than maxAge, so an idle device does not
+// stay open for an open that never comes. Returns when the next one is due.
+static nsecs_t s_trim(nsecs_t maxAge)
+{
+    nsecs_t now = monotonicTime();
+    nsecs_t next = 0;
+
+    pthread_mutex_lock(&pcmPoolLock);
+
+    for (List<pcm_pool_entry_t>::iterator it = pcmPool.begin();
+         it != pcmPool.end(); ) {
+        if (now - it->parked >= maxAge) {
+            LOGD("Closing %s, parked for %lld ms", it->name,
+                    (now - it->parked) / 1000000);
+            snd_pcm_close(it->pcm);
+            it = pcmPool.erase(it);
+            continue;
+        }
+
+        if (!next || it->parked + maxAge < next) next = it->parked + maxAge;
+        ++it;
+    }
+
+    pthread_mutex_unlock(&pcmPoolLock);
+
+    return next;
+}
+
+// Closes every parked PCM. Returns whether there were any.
+static bool poolClear()
+{
+    pthread_mutex_lock(&pcmPoolLock);
+
+    bool cleared = !pcmPool.empty();
+
+    for (List<pcm_pool_entry_t>::iterator it = pcmPool.begin();
+         it != pcmPool.end(); ++it)
+        snd_pcm_close(it->pcm);
+    pcmPool.clear();
+
+    pthread_mutex_unlock(&pcmPoolLock);
+
+    return cleared;
+}
+
+// Stops the PCM of a handle and closes it, or parks it for reuse.
+static status_t closePcm(alsa_handle_t *handle, bool park)
+{
+    status_t err = NO_ERROR;
+    snd_pcm_t *h = handle->handle;
+
+    if (h) {
+        // Closing is on the route change and mode switch paths; do not make
+        // them wait for the buffer to play out. Callers that want it played
+        // drain first. A parked PCM fades out in the background; one that
+        // really goes is cut.
+        bool fading = park && fadeQueued(handle);
+        android_atomic_and(~ALSA_STATE_FADING, &handle->state);
+
+        if (park) {
+            if (!fading) snd_pcm_drop(h);
+
+            char name[ALSA_NAME_MAX];
+
+            // A stream may have changed the thresholds, or left silence
+            // filling on; the next one gets the module's.
+            setSoftwareParams(handle);
+
+            pcmName(handle, handle->curDev, handle->curMode, name);
+            poolPut(handle, h, name);
+        } else
+            err = snd_pcm_close(h);
+    }
+
+    handle->handle = 0;
+    handle->curDev = 0;
+    handle->curMode = 0;
+
+    return err;
+}
+
+// ----------------------------------------------------------------------------
+// Negotiating hardware parameters takes several rounds of trial and error
+// on every open. The configuration each request settled on is remembered,
+// keyed by the PCM name and the request, and applied in one step on later
+// opens. It is kept in a file so it also survives reboots, and the file is
+// ignored once the sound cards present no longer match the ones it was
+// written for.
+
+struct hw_params_entry_t {
+    char                name[ALSA_NAME_MAX];
+    alsa_handle_t       request;
+    alsa_handle_t       result;
+    unsigned int        rate;
+    snd_pcm_uframes_t   periodSize;
+};
+
+static const size_t HW_PARAMS_CACHE_MAX = 32;
+
+// Bumped whenever the line format changes; files of another version are
+// discarded.
+static const unsigned int HW_PARAMS_VERSION = 2;
+
+static List<hw_params_entry_t> hwParamsCache;
+static pthread_mutex_t hwParamsLock = PTHREAD_MUTEX_INITIALIZER;
+static bool hwParamsLoaded = false;
+static uint32_t hwParamsCards = 0;
+
+static uint32_t hashString(uint32_t hash, const char *s)
+{
+    // FNV-1a
+    while (s && *s) {
+        hash ^= (uint8_t)*s++;
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+// Identifies the sound cards present, their drivers and the alsa-lib they
+// are driven through; any of these changing can change what negotiates.
+static uint32_t cardIdentity()
+{
+    uint32_t hash = hashString(2166136261u, snd_asoundlib_version());
+    snd_ctl_card_info_t *info;
+    int card = -1;
+
+    snd_ctl_card_info_alloca(&info);
+
+    while (snd_card_next(&card) == 0 && card >= 0) {
+        char name[16];
+        snd_ctl_t *ctl;
+
+        snprintf(name, sizeof(name), "hw:%d", card);
+        if (snd_ctl_open(&ctl, name, 0) < 0) continue;
+
+        if (snd_ctl_card_info(ctl, info) == 0) {
+            hash = hashString(hash, snd_ctl_card_info_get_id(info));
+            hash = hashString(hash, snd_ctl_card_info_get_driver(info));
+            hash = hashString(hash, snd_ctl_card_info_get_longname(info));
+            hash = hashString(hash, snd_ctl_card_info_get_mixername(info));
+            hash = hashString(hash, snd_ctl_card_info_get_components(info));
+        }
+
+        snd_ctl_close(ctl);
+    }
+
+    return hash;
+}
+
+// Reads the cache file, once. Must be called with hwParamsLock held.
+static void hwParamsLoad()
+{
+    if (hwParamsLoaded) return;
+    hwParamsLoaded = true;
+
+    hwParamsCards = cardIdentity();
+
+    if (!ALSA_PARAMS_CACHE[0]) return;
+
+    FILE *file = fopen(ALSA_PARAMS_CACHE, "r");
+    if (!file) return;
+
+    unsigned int version, cards;
+    if (fscanf(file, "version %u cards %x\n", &version, &cards) != 2 ||
+        version != HW_PARAMS_VERSION || cards != hwParamsCards) {
+        LOGI("Sound cards or format changed, discarding %s", ALSA_PARAMS_CACHE);
+        fclose(file);
+        return;
+    }
+
+    hw_params_entry_t entry;
+    int format, access, profile, tsched, nonBlock;
+    int resultFormat, resultAccess, resultTsched;
+    unsigned long bufferSize, periodSize;
+
+    memset(&entry, 0, sizeof(entry));
+
+    while (hwParamsCache.size() < HW_PARAMS_CACHE_MAX &&
+           fscanf(file, "%127s %d %u %u %u %u %d %u %d %d %d = %d %d %u %u %lu %lu %u %d\n",
+                entry.name, &format, &entry.request.channels,
+                &entry.request.sampleRate, &entry.request.latency,
+                &entry.request.bufferSize, &access, &entry.request.periods,
+                &profile, &tsched, &nonBlock, &resultAccess, &resultFormat,
+                &entry.result.channels, &entry.rate, &periodSize, &bufferSize,
+                &entry.result.latency, &resultTsched) == 19) {
+        entry.request.format = (snd_pcm_format_t)format;
+        entry.request.access = (snd_pcm_access_t)access;
+        entry.request.profile = profile;
+        entry.request.tsched = tsched;
+        entry.request.nonBlock = nonBlock;
+        entry.result.access = (snd_pcm_access_t)resultAccess;
+        entry.result.format = (snd_pcm_format_t)resultFormat;
+        entry.result.tsched = resultTsched;
+        entry.periodSize = periodSize;
+        entry.result.bufferSize = bufferSize;
+
+        hwParamsCache.push_back(entry);
+    }
+
+    fclose(file);
+
+    LOGV("Loaded %u negotiated configurations", (unsigned int)hwParamsCache.size());
+}
+
+// Rewrites the cache file. Must be called with hwParamsLock held.
+static void hwParamsSave()
+{
+    if (!ALSA_PARAMS_CACHE[0]) return;
+
+    char temp[PATH_MAX];
+    snprintf(temp, sizeof(temp), "%s.tmp", ALSA_PARAMS_CACHE);
+
+    FILE *file = fopen(temp, "w");
+    if (!file) {
+        LOGW("Unable to write %s: %s", temp, strerror(errno));
+        return;
+    }
+
+    fprintf(file, "version %u cards %08x\n", HW_PARAMS_VERSION, hwParamsCards);
+
+    for (List<hw_params_entry_t>::iterator it = hwParamsCache.begin();
+         it != hwParamsCache.end(); ++it)
+        fprintf(file, "%s %d %u %u %u %u %d %u %d %d %d = %d %d %u %u %lu %lu %u %d\n",
+                it->name, it->request.format, it->request.channels,
+                it->request.sampleRate, it->request.latency,
+                it->request.bufferSize, it->request.access,
+                it->request.periods, it->request.profile, it->request.tsched,
+                it->request.nonBlock,
+                it->result.access, it->result.format, it->result.channels,
+                it->rate, (unsigned long)it->periodSize,
+                (unsigned long)it->result.bufferSize, it->result.latency,
+                it->result.tsched);
+
+    if (fclose(file) != 0 || rename(temp, ALSA_PARAMS_CACHE) != 0) {
+        LOGW("Unable to write %s: %s", ALSA_PARAMS_CACHE, strerror(errno));
+        unlink(temp);
+    }
+}
+
+// Configures the PCM as remembered for this request, without negotiating.
+static status_t applyHardwareParams(alsa_handle_t *handle,
+                                    const hw_params_entry_t *entry)
+{
+    snd_pcm_hw_params_t *hardwareParams;
+    snd_pcm_t *pcm = handle->handle;
+    int err;
+
+    snd_pcm_hw_params_alloca(&hardwareParams);
+
+    if ((err = snd_pcm_hw_params_any(pcm, hardwareParams)) < 0 ||
+        (err = snd_pcm_hw_params_set_access(pcm, hardwareParams,
+                entry->result.access)) < 0 ||
+        (err = snd_pcm_hw_params_set_format(pcm, hardwareParams,
+                entry->result.format)) < 0 ||
+        (err = snd_pcm_hw_params_set_channels(pcm, hardwareParams,
+                entry->result.channels)) < 0)
+        return err;
+
+    if (direction(handle) == SND_PCM_STREAM_PLAYBACK)
+        snd_pcm_hw_params_set_rate_resample(pcm, hardwareParams, 0);
+
+    if ((err = snd_pcm_hw_params_set_rate(pcm, hardwareParams,
+                entry->rate, 0)) < 0 ||
+        (err = snd_pcm_hw_params_set_period_size(pcm, hardwareParams,
+                entry->periodSize, 0)) < 0 ||
+        (err = snd_pcm_hw_params_set_buffer_size(pcm, hardwareParams,
+                entry->result.bufferSize)) < 0)
+        return err;
+
+    if (entry->result.tsched &&
+        (err = snd_pcm_hw_params_set_period_wakeup(pcm, hardwareParams, 0)) < 0)
+        return err;
+
+    if ((err = snd_pcm_hw_params(pcm, hardwareParams)) < 0)
+        return err;
+
+    takeResult(handle, &entry->result);
+
+    return NO_ERROR;
+}
+
+// Applies the configuration remembered for the handle's request on this
+// PCM, if there is one. Returns whether the PCM is configured.
+static bool hwParamsRecall(alsa_handle_t *handle, const char *name)
+{
+    pthread_mutex_lock(&hwParamsLock);
+
+    hwParamsLoad();
+
+    bool applied = false;
+
+    for (List<hw_params_entry_t>::iterator it = hwParamsCache.begin();
+         it != hwParamsCache.end(); ++it) {
+        if (strcmp(it->name, name) || !sameConfig(&it->request, handle))
+            continue;
+
+        int err = applyHardwareParams(handle, &(*it));
+        if (err == NO_ERROR)
+            applied = true;
+        else {
+            // The driver no longer takes it; negotiate afresh.
+            LOGW("Remembered configuration of %s rejected: %s", name,
+                    snd_strerror(err));
+            hwParamsCache.erase(it);
+            hwParamsSave();
+        }
+        break;
+    }
+
+    pthread_mutex_unlock(&hwParamsLock);
+
+    return applied;
+}
+
+// Remembers what a request negotiated to on this PCM.
+static void hwParamsStore(const alsa_handle_t *request, alsa_handle_t *handle,
+                          const char *name)
+{
+    hw_params_entry_t entry;
+    snd_pcm_hw_params_t *hardwareParams;
+    snd_pcm_uframes_t bufferSize;
+
+    snd_pcm_hw_params_alloca(&hardwareParams);
+
+    if (snd_pcm_hw_params_current(handle->handle, hardwareParams) < 0 ||
+        snd_pcm_hw_params_get_rate(hardwareParams, &entry.rate, 0) < 0 ||
+        snd_pcm_hw_params_get_period_size(hardwareParams, &entry.periodSize, 0) < 0 ||
+        snd_pcm_hw_params_get_buffer_size(hardwareParams, &bufferSize) < 0)
+        return;
+
+    strncpy(entry.name, name, ALSA_NAME_MAX - 1);
+    entry.name[ALSA_NAME_MAX - 1] = 0;
+    entry.request = *request;
+    entry.request.handle = 0;
+    entry.result = *handle;
+    entry.result.handle = 0;
+    entry.result.bufferSize = bufferSize;
+
+    pthread_mutex_lock(&hwParamsLock);
+
+    hwParamsLoad();
+
+    for (List<hw_params_entry_t>::iterator it = hwParamsCache.begin();
+         it != hwParamsCache.end(); ++it)
+        if (!strcmp(it->name, name) && sameConfig(&it->request, request)) {
+            hwParamsCache.erase(it);
+            break;
+        }
+
+    hwParamsCache.push_back(entry);
+
+    while (hwParamsCache.size() > HW_PARAMS_CACHE_MAX)
+        hwParamsCache.erase(hwParamsCache.begin());
+
+    hwParamsSave();
+
+    pthread_mutex_unlock(&hwParamsLock);
+}
+
+// Source of alsa_handle_t::generation.
+static volatile int32_t pcmGeneration = 0;
+
+// Opens the PCM for a route on the handle. Next to another PCM that keeps
+// playing, only the route's own PCM will do: the hardware may be busy with
+// the other one, which neither clearing the pool nor "default" changes.
+static status_t openPcm(alsa_handle_t *handle, uint32_t devices, int mode,
+                        bool alongside)
 {
-    // Close off previously opened device.
-    // It would be nice to determine if the underlying device actually
-    // changes, but we might be recovering from an error or manipulating
-    // mixer settings (see asound.conf).
-    //
-    s_close(handle);
+    // Close off previously opened device. Reopening the same route is how
+    // callers recover from errors and renegotiate parameters, so that PCM
+    // really goes; anything else may be parked for a later route switch.
+    bool reopen = handle->handle && handle->curDev == devices &&
+                  handle->curMode == mode;
+
+    closePcm(handle, !reopen);
+
+    // Whatever streams read off the previous PCM is stale now, even if the
+    // next one comes back at the same address.
+    handle->generation = (uint32_t)android_atomic_inc(&pcmGeneration) + 1;
 
     LOGD("open called for devices %08x in mode %d...", devices, mode);
 
+    // Both the pool and the parameter cache go by what was asked for.
+    restoreRequest(handle);
+    alsa_handle_t request = *handle;
+
     const char *stream = streamName(handle);
-    const char *devName = deviceName(handle, devices, mode);
+    char devName[ALSA_NAME_MAX];
+
+    pcmName(handle, devices, mode, devName);
 
     int err;
 
-    for (;;) {
-        // The PCM stream is opened in blocking mode, per ALSA defaults.  The
-        // AudioFlinger seems to assume blocking mode too, so asynchronous mode
-        // should not be used.
-        err = snd_pcm_open(&handle->handle, devName, direction(handle),
-                SND_PCM_ASYNC);
-        if (err == 0) break;
+    snd_pcm_t *parked = poolGet(handle, devName);
+
+    if (parked) {
+        // It may still be playing out a fade.
+        snd_pcm_drop(parked);
+        err = snd_pcm_prepare(parked);
+        if (err == 0) {
+            LOGI("Reusing ALSA %s device %s", stream, devName);
+            handle->handle = parked;
+            handle->curDev = devices;
+            handle->curMode = mode;
+            rememberRequest(handle, &request);
+            return NO_ERROR;
+        }
+        snd_pcm_close(parked);
 
-        // See if there is a less specific name we can try.
-        // Note: We are changing the contents of a const char * here.
-        char *tail = strrchr(devName, '_');
-        if (!tail) break;
-        *tail = 0;
+        // Negotiate from the request again.
+        takeResult(handle, &request);
     }
 
-    if (err < 0) {
-        // None of the Android defined audio devices exist. Open a generic one.
-        devName = "default";
-        err = snd_pcm_open(&handle->handle, devName, direction(handle), 0);
+    // Non-blocking handles wait for the device themselves, with a deadline
+    // on every write, so a wedged driver cannot hold the caller.
+    int openMode = handle->nonBlock ? SND_PCM_NONBLOCK : 0;
+
+    // The PCM stream is opened in blocking mode, per ALSA defaults.  The
+    // AudioFlinger seems to assume blocking mode too, so asynchronous mode
+    // should not be used.
+    err = snd_pcm_open(&handle->handle, devName, direction(handle),
+            SND_PCM_ASYNC | openMode);
+
+    // A parked PCM may be holding the hardware under another name.
+    if (err == -EBUSY && !alongside && poolClear())
+        err = snd_pcm_open(&handle->handle, devName, direction(handle),
+                SND_PCM_ASYNC | openMode);
+
+    if (err < 0 && !alongside && strcmp(devName, "default")) {
+        // The PCM is configured but its device is not there. Open a generic
+        // one.
+        LOGW("Unable to open ALSA %s device %s: %s", stream, devName,
+                snd_strerror(err));
+        strcpy(devName, "default");
+        err = snd_pcm_open(&handle->handle, devName, direction(handle), openMode);
     }
 
     if (err < 0) {
         LOGE("Failed to Initialize any ALSA %s device: %s",
                 stream, strerror(err));
+        handle->handle = 0;
         return NO_INIT;
     }
 
-    err = setHardwareParams(handle);
+    if (hwParamsRecall(handle, devName))
+        err = NO_ERROR;
+    else {
+        err = setHardwareParams(handle);
+
+        if (err == NO_ERROR) hwParamsStore(&request, handle, devName);
+    }
+
+    if (err == NO_ERROR) rememberRequest(handle, &request);
 
     if (err == NO_ERROR) err = setSoftwareParams(handle);
 
+    if (err == NO_ERROR) setChannelMap(handle);
+
     LOGI("Initialized ALSA %s device %s", stream, devName);
 
     handle->curDev = devices;
@@ -508,21 +1621,86 @@ static status_t s_open(alsa_handle_t *handle, uint32_t devices, int mode)
     return err;
 }
 
+static status_t s_open(alsa_handle_t *handle, uint32_t devices, int mode)
+{
+    return openPcm(handle, devices, mode, false);
+}
+
+// Frees the private block of a handle set up by s_openNext().
+static void releaseSpare(alsa_handle_t *handle)
+{
+    handle_private_t *priv = (handle_private_t *)handle->modPrivate;
+
+    if (priv && priv->spare) {
+        delete priv;
+        handle->modPrivate = 0;
+    }
+}
+
 static status_t s_close(alsa_handle_t *handle)
 {
-    status_t err = NO_ERROR;
-    snd_pcm_t *h = handle->handle;
-    handle->handle = 0;
-    handle->curDev = 0;
-    handle->curMode = 0;
-    if (h) {
-        snd_pcm_drain(h);
-        err = snd_pcm_close(h);
+    status_t err = closePcm(handle, true);
+
+    releaseSpare(handle);
+
+    return err;
+}
+
+// The second handle gets a private block of its own, so that each PCM is
+// parked and cached under its own request and result.
+static status_t s_openNext(alsa_handle_t *handle, alsa_handle_t *next,
+                           uint32_t devices, int mode)
+{
+    *next = *handle;
+    next->handle = 0;
+    next->curDev = 0;
+    next->curMode = 0;
+    next->state = 0;
+
+    if (handle->modPrivate) {
+        handle_private_t *priv =
+                new handle_private_t(*(handle_private_t *)handle->modPrivate);
+
+        priv->spare = true;
+        next->modPrivate = priv;
     }
 
+    status_t err = openPcm(next, devices, mode, true);
+
+    if (err != NO_ERROR) s_close(next);
+
     return err;
 }
 
+// Closes the handle's PCM, fading it out, and puts the one s_openNext()
+// opened in its place. The state word is left alone; a mode switch may
+// flag it at any time.
+static status_t s_takeover(alsa_handle_t *handle, alsa_handle_t *next)
+{
+    alsa_handle_t previous = *handle;
+
+    closePcm(&previous, true);
+
+    takeResult(handle, next);
+    handle->handle = next->handle;
+    handle->curDev = next->curDev;
+    handle->curMode = next->curMode;
+    handle->generation = next->generation;
+
+    handle_private_t *priv = (handle_private_t *)handle->modPrivate;
+    handle_private_t *spare = (handle_private_t *)next->modPrivate;
+
+    if (priv && spare) {
+        *priv = *spare;
+        priv->spare = false;
+    }
+
+    releaseSpare(next);
+    next->handle = 0;
+
+    return NO_ERROR;
+}
+
 static status_t s_route(alsa_handle_t *handle, uint32_t devices, int mode)
 {
     LOGD("route called for devices %08x in mode %d...", devices, mode);
@@ -0,0 +1,112 @@
+/* ALSAConverter_test.cpp
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+// The vector sample conversions of ALSAConverter must match convertScalar()
+// bit for bit, for every format pair.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <gtest/gtest.h>
+
+#include "../ALSAConverter.cpp"
+
+namespace android
+{
+
+// Odd lengths leave a scalar tail behind the vector loop.
+static const size_t SAMPLES = 1021;
+
+static const char *formatNames[FMT_COUNT] = {
+    "S8", "S16", "S24", "S24_3", "S32", "FLOAT"
+};
+
+// Random samples in the low bytes of 32 bits for S24, and floats reaching
+// past full scale in both directions, with the exact limits thrown in.
+template <int F>
+static void fill(uint8_t *p, size_t samples)
+{
+    for (size_t i = 0; i < samples; i++, p += Sample<F>::size) {
+        uint32_t r = (uint32_t)rand() << 16 ^ (uint32_t)rand();
+
+        if (F == FMT_FLOAT) {
+            static const float limits[] = { 1.0f, -1.0f, 0.99999994f, -0.99999994f };
+            float f = i < 4 ? limits[i] : (float)rand() / RAND_MAX * 3.0f - 1.5f;
+            memcpy(p, &f, sizeof(f));
+        } else if (F == FMT_S24) {
+            int32_t s = (int32_t)(r << 8) >> 8;
+            memcpy(p, &s, sizeof(s));
+        } else {
+            memcpy(p, &r, Sample<F>::size);
+        }
+    }
+}
+
+template <int From, int To>
+static void check()
+{
+    uint8_t in[SAMPLES * 4];
+    uint8_t out[SAMPLES * 4], ref[SAMPLES * 4];
+
+    fill<From>(in, SAMPLES);
+
+    for (size_t n = SAMPLES - 16; n <= SAMPLES; n++) {
+        memset(out, 0x55, sizeof(out));
+        memset(ref, 0x55, sizeof(ref));
+
+        convert<From, To>(in, out, n);
+        convertScalar<From, To>(in, ref, n);
+
+        // Compare past the end too, nothing may be written there.
+        ASSERT_EQ(0, memcmp(out, ref, sizeof(out)))
+                << formatNames[From] << " to " << formatNames[To] << ", " << n << " samples";
+    }
+}
+
+template <int From>
+static void checkRow()
+{
+    check<From, FMT_S8>();
+    check<From, FMT_S16>();
+    check<From, FMT_S24>();
+    check<From, FMT_S24_3>();
+    check<From, FMT_S32>();
+    check<From, FMT_FLOAT>();
+}
+
+TEST(ALSAConverter, KernelsMatchReference)
+{
+    srand(1);
+
+    for (int pass = 0; pass < 16; pass++) {
+        checkRow<FMT_S8>();
+        checkRow<FMT_S16>();
+        checkRow<FMT_S24>();
+        checkRow<FMT_S24_3>();
+        checkRow<FMT_S32>();
+        checkRow<FMT_FLOAT>();
+    }
+}
+
+TEST(ALSAConverter, NegativePackedSamples)
+{
+    const uint8_t min[3] = { 0x00, 0x00, 0x80 };
+    const uint8_t minusOne[3] = { 0xff, 0xff, 0xff };
+
+    EXPECT_EQ((int32_t)0x80000000, Sample<FMT_S24_3>::toQ31(min));
+    EXPECT_EQ(-256, Sample<FMT_S24_3>::toQ31(minusOne));
+}
+
+}       // namespace android
@@ -0,0 +1,211 @@
+/* ALSASoftVolume_test.cpp
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+// The SIMD kernels of ALSASoftVolume must match the scalar ones bit for
+// bit. The reference kernels are what an ALSA_SOFT_VOLUME_SCALAR build
+// runs, so building the file in gives both paths in one binary.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <gtest/gtest.h>
+
+#include "../ALSASoftVolume.cpp"
+
+namespace android
+{
+
+// Odd lengths leave a scalar tail behind the vector loop.
+static const size_t SAMPLES = 1021;
+
+static int16_t randomS16()
+{
+    return (int16_t)(rand() & 0xffff);
+}
+
+static float randomF32()
+{
+    return (float)rand() / RAND_MAX * 4.0f - 2.0f;
+}
+
+TEST(ALSASoftVolume, S16KernelMatchesReference)
+{
+    int16_t in[SAMPLES], gain[SAMPLES];
+    int16_t out[SAMPLES], ref[SAMPLES];
+
+    srand(1);
+
+    for (int pass = 0; pass < 64; pass++) {
+        for (size_t i = 0; i < SAMPLES; i++) {
+            in[i] = randomS16();
+            gain[i] = toQ15((float)rand() / RAND_MAX);
+        }
+
+        // Full scale inputs and the extreme gains.
+        in[0] = -32768;
+        in[1] = 32767;
+        gain[0] = gain[1] = 32767;
+        gain[2] = 0;
+        gain[3] = gain[4] = Q15_UNITY;
+        in[4] = -32768;
+
+        size_t n = SAMPLES - pass;
+
+        scaleS16(in, gain, out, n);
+        scaleS16_c(in, gain, ref, n);
+
+        ASSERT_EQ(0, memcmp(out, ref, n * sizeof(*out))) << "pass " << pass;
+    }
+}
+
+TEST(ALSASoftVolume, F32KernelMatchesReference)
+{
+    float in[SAMPLES], gain[SAMPLES];
+    float out[SAMPLES], ref[SAMPLES];
+
+    srand(2);
+
+    for (int pass = 0; pass < 64; pass++) {
+        for (size_t i = 0; i < SAMPLES; i++) {
+            in[i] = randomF32();
+            gain[i] = (float)rand() / RAND_MAX;
+        }
+
+        size_t n = SAMPLES - pass;
+
+        scaleF32(in, gain, out, n);
+        scaleF32_c(in, gain, ref, n);
+
+        ASSERT_EQ(0, memcmp(out, ref, n * sizeof(*out))) << "pass " << pass;
+    }
+}
+
+// Runs a volume change through process() and checks every frame against
+// the reference kernel fed the gains process() used. Those are read back
+// by scaling ones, which a float multiply returns exactly.
+static void checkRamp(ALSASoftVolume::ramp_t ramp, unsigned int channels,
+        float from, float to, size_t frames)
+{
+    size_t samples = frames * channels;
+    float *ones = new float[samples];
+    float *gain = new float[samples];
+    int16_t *gainQ = new int16_t[samples];
+    int16_t *inS16 = new int16_t[samples];
+    int16_t *outS16 = new int16_t[samples];
+    int16_t *refS16 = new int16_t[samples];
+    float *inF32 = new float[samples];
+    float *outF32 = new float[samples];
+    float *refF32 = new float[samples];
+
+    for (size_t i = 0; i < samples; i++) {
+        ones[i] = 1.0f;
+        inS16[i] = randomS16();
+        inF32[i] = randomF32();
+    }
+
+    // Three objects in the same state follow the same ramp.
+    ALSASoftVolume probe(channels), s16(channels), f32(channels);
+    ALSASoftVolume *volumes[] = { &probe, &s16, &f32 };
+
+    for (int v = 0; v < 3; v++) {
+        volumes[v]->setRamp(ramp);
+        volumes[v]->setVolume(from, from);
+    }
+
+    probe.process(ones, gain, 1, SND_PCM_FORMAT_FLOAT_LE);
+    s16.process(inS16, outS16, 1, SND_PCM_FORMAT_S16_LE);
+    f32.process(inF32, outF32, 1, SND_PCM_FORMAT_FLOAT_LE);
+
+    for (int v = 0; v < 3; v++)
+        volumes[v]->setVolume(to, to);
+
+    probe.process(ones, gain, frames, SND_PCM_FORMAT_FLOAT_LE);
+    s16.process(inS16, outS16, frames, SND_PCM_FORMAT_S16_LE);
+    f32.process(inF32, outF32, frames, SND_PCM_FORMAT_FLOAT_LE);
+
+    for (size_t i = 0; i < samples; i++)
+        gainQ[i] = toQ15(gain[i]);
+
+    scaleS16_c(inS16, gainQ, refS16, samples);
+    scaleF32_c(inF32, gain, refF32, samples);
+
+    EXPECT_EQ(0, memcmp(outS16, refS16, samples * sizeof(*outS16)))
+            << "S16, " << channels << " channels, " << from << " to " << to;
+    EXPECT_EQ(0, memcmp(outF32, refF32, samples * sizeof(*outF32)))
+            << "float, " << channels << " channels, " << from << " to " << to;
+
+    delete[] ones;
+    delete[] gain;
+    delete[] gainQ;
+    delete[] inS16;
+    delete[] outS16;
+    delete[] refS16;
+    delete[] inF32;
+    delete[] outF32;
+    delete[] refF32;
+}
+
+// A ramp that lands on unity leaves S16 bit-exact, and gains above it are
+// clamped to unity rather than wrapping.
+TEST(ALSASoftVolume, S16UnityIsBitExact)
+{
+    int16_t in[SAMPLES], out[SAMPLES];
+
+    srand(5);
+
+    for (size_t i = 0; i < SAMPLES; i++)
+        in[i] = randomS16();
+    in[0] = -32768;
+    in[1] = 32767;
+
+    ALSASoftVolume volume(1);
+
+    volume.setVolume(0.5f, 0.5f);
+    volume.process(in, out, SAMPLES, SND_PCM_FORMAT_S16_LE);
+
+    volume.setVolume(1.0f, 1.0f);
+    volume.process(in, out, SAMPLES, SND_PCM_FORMAT_S16_LE);
+    volume.process(in, out, SAMPLES, SND_PCM_FORMAT_S16_LE);
+    EXPECT_EQ(0, memcmp(in, out, sizeof(in)));
+
+    volume.setVolume(2.0f, 2.0f);
+    volume.process(in, out, SAMPLES, SND_PCM_FORMAT_S16_LE);
+    volume.process(in, out, SAMPLES, SND_PCM_FORMAT_S16_LE);
+    EXPECT_EQ(0, memcmp(in, out, sizeof(in)));
+}
+
+TEST(ALSASoftVolume, LinearRampsMatchReference)
+{
+    srand(3);
+
+    for (unsigned int channels = 1; channels <= ALSASoftVolume::MAX_CHANNELS; channels++) {
+        checkRamp(ALSASoftVolume::RAMP_LINEAR, channels, 0.0f, 1.0f, 1001);
+        checkRamp(ALSASoftVolume::RAMP_LINEAR, channels, 1.0f, 0.0f, 1001);
+        checkRamp(ALSASoftVolume::RAMP_LINEAR, channels, 0.25f, 0.75f, 37);
+    }
+}
+
+TEST(ALSASoftVolume, ExponentialRampsMatchReference)
+{
+    srand(4);
+
+    for (unsigned int channels = 1; channels <= ALSASoftVolume::MAX_CHANNELS; channels++) {
+        checkRamp(ALSASoftVolume::RAMP_EXPONENTIAL, channels, 0.0f, 1.0f, 1001);
+        checkRamp(ALSASoftVolume::RAMP_EXPONENTIAL, channels, 1.0f, 0.0f, 1001);
+        checkRamp(ALSASoftVolume::RAMP_EXPONENTIAL, channels, 0.5f, 0.1f, 37);
+    }
+}
+
+}       // namespace android